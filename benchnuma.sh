@@ -0,0 +1,65 @@
+#!/bin/bash
+# Compare the throughput of a topic when the daemon serves it from its
+# writer's and reader's NUMA node, and from another node.
+#
+#   bash benchnuma.sh [DAEMON_NODE] [CLIENT_NODE] [MEGABYTES]
+#
+# The daemon binds itself, CPUs and memory, with -o numa_node, or spreads
+# over every node with -o numa. The writer and reader are only kept on the
+# CPUs of CLIENT_NODE, so that their own memory stays local to them.
+DAEMON_NODE=${1:-0}
+CLIENT_NODE=${2:-1}
+MB=${3:-1024}
+MOUNTPOINT="$PWD/mountpoint"
+
+BUSFS_PID=
+set -e
+
+cpus() {
+    cat /sys/devices/system/node/node$1/cpulist
+}
+
+mount_busfs() {
+    fusermount3 -u $MOUNTPOINT 2>/dev/null || true
+    ./busfs -f -o $1 $MOUNTPOINT & BUSFS_PID=$!
+    sleep 0.5
+}
+
+umount_busfs() {
+    kill $BUSFS_PID
+    wait $BUSFS_PID || true
+    fusermount3 -u $MOUNTPOINT 2>/dev/null || true
+}
+
+trap umount_busfs EXIT
+
+run() {
+    local label="$1" topic="$MOUNTPOINT/numabench"
+    local on="taskset -c $(cpus $CLIENT_NODE)"
+    local reader start end
+
+    touch "$topic@slots=65536"
+    $on dd if="$topic" of=/dev/null bs=1M 2>/dev/null & reader=$!
+
+    start=$(date +%s.%N)
+    $on sh -c "yes 'a message of roughly sixty four bytes, as seen in most logs' |
+               head -c ${MB}M > '$topic'"
+    end=$(date +%s.%N)
+
+    grep "^node" "$topic@status" || true
+    kill $reader
+    rm "$topic"
+    awk -v l="$label" -v mb=$MB -v t=$(echo "$end $start" | awk '{print $1-$2}') \
+        'BEGIN { printf "%s: %.0f MB/s\n", l, mb/t }'
+}
+
+mount_busfs numa_node=$CLIENT_NODE
+run "daemon on node $CLIENT_NODE, clients on node $CLIENT_NODE"
+umount_busfs
+
+mount_busfs numa_node=$DAEMON_NODE
+run "daemon on node $DAEMON_NODE, clients on node $CLIENT_NODE"
+umount_busfs
+
+mount_busfs numa
+run "daemon on every node, clients on node $CLIENT_NODE"
@@ -4,23 +4,13 @@
  */
 
 #include "busfs.h"
+#include "busfs_fops.h"
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
 
-int busfs_op_access(const char *path, int mask)
-{
-    int res;
-    BUSFS_CONVERT_PATH(path);
-    res = access(path, mask);
-    if (res == -1)
-        return -errno;
-
-    return 0;
-}
-
 int busfs_op_readlink(const char *path, char *buf, size_t size)
 {
     int res;
@@ -34,7 +24,7 @@ int busfs_op_readlink(const char *path, char *buf, size_t size)
 }
 
 
-int busfs_op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+int busfs_op_readdir(const char *path, void *buf, busfs_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi)
 {
     DIR *dp;
@@ -49,6 +39,13 @@ int busfs_op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     while ((de = readdir(dp)) != NULL) {
         struct stat st;
+
+        /* Topic names can't contain '@', so these are the daemon's own
+         * files (such as saved cursors) */
+        if (strchr(de->d_name, '@')) {
+            continue;
+        }
+
         memset(&st, 0, sizeof(st));
         st.st_ino = de->d_ino;
         st.st_mode = de->d_type << 12;
@@ -100,60 +97,72 @@ int busfs_op_symlink(const char *from, const char *to)
 }
 
 
-int busfs_op_chmod(const char *path, mode_t mode)
+int busfs_op_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int res;
-    BUSFS_CONVERT_PATH(path);
-    res = chmod(path, mode);
+    BUSFS_CONVERT_PATH_EX(path, fqpath);
+    BUSFS_STRIP_OPTS(path);
+    (void) fi;
+    res = chmod(fqpath, mode);
     if (res == -1)
         return -errno;
 
+    busfs_file_invalidate(path);
     return 0;
 }
 
-int busfs_op_chown(const char *path, uid_t uid, gid_t gid)
+int busfs_op_chown(const char *path, uid_t uid, gid_t gid,
+               struct fuse_file_info *fi)
 {
     int res;
-    BUSFS_CONVERT_PATH(path);
-    res = lchown(path, uid, gid);
+    BUSFS_CONVERT_PATH_EX(path, fqpath);
+    BUSFS_STRIP_OPTS(path);
+    (void) fi;
+    res = lchown(fqpath, uid, gid);
     if (res == -1)
         return -errno;
 
+    busfs_file_invalidate(path);
     return 0;
 }
 
-int busfs_op_truncate(const char *path, off_t size)
-{
-    (void)path;
-    (void)size;
-    return 0;
-}
-
-int busfs_op_utimens(const char *path, const struct timespec ts[2])
+int busfs_op_utimens(const char *path, const struct timespec ts[2],
+                 struct fuse_file_info *fi)
 {
     int res;
-    BUSFS_CONVERT_PATH(path);
+    BUSFS_CONVERT_PATH_EX(path, fqpath);
+    BUSFS_STRIP_OPTS(path);
+    (void) fi;
     struct timeval tv[2];
     tv[0].tv_sec = ts[0].tv_sec;
     tv[0].tv_usec = ts[0].tv_nsec / 1000;
     tv[1].tv_sec = ts[1].tv_sec;
     tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
-    res = utimes(path, tv);
+    res = utimes(fqpath, tv);
     if (res == -1)
         return -errno;
 
+    busfs_file_invalidate(path);
     return 0;
 }
 
 int busfs_op_fsync(const char *path, int isdatasync,
              struct fuse_file_info *fi)
 {
-    /* Just a stub.  This method is optional and can safely be left
-       unimplemented */
+    busfs_common o;
     (void) path;
     (void) isdatasync;
-    (void) fi;
+
+    if (fi == NULL) {
+        return 0;
+    }
+
+    /* Nothing is kept on disk, but queued writes can be committed */
+    o = BUSFS_GET_COMMON(fi);
+    if (o && o->type == BUSFS_INFO_WRITER) {
+        busfs_write_flush(((busfs_writer)o)->f);
+    }
     return 0;
 }
 
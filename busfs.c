@@ -13,8 +13,6 @@ FILE *busfs_log_output;
 
 void busfs_init(void)
 {
-    struct sigaction sa;
-
     assert(pthread_rwlock_init(&_BFG.lock, NULL) == 0);
     LOG_MSG("Lock initialized for hashtable");
 
@@ -22,13 +20,67 @@ void busfs_init(void)
     assert(_BFG.ht);
     LOG_MSG("Hash table initialized");
 
-    assert( pthread_key_create(&_BFG.iowait_seq_key, NULL) == 0);
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        _BFG.clock_offset_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec
+                - (int64_t)busfs_clock_ns();
+    }
+
+    pthread_mutex_init(&_BFG.merge.mutex, NULL);
+    g_queue_init(&_BFG.merge.waiting);
+    pthread_mutex_init(&_BFG.repl.mutex, NULL);
+    pthread_cond_init(&_BFG.repl.cond, NULL);
+}
+
+/**
+ * Free the slots of f, and any compressed blocks they point into
+ */
+static void dgrams_free(busfs_file f)
+{
+    size_t ii;
+    for (ii = 0; ii < f->dgram_count; ii++) {
+        busfs_dgram *msg = f->dgrams + ii;
+        busfs_dgram_release(f, msg);
+        if (f->arena == NULL) {
+            free(msg->root);
+        }
+    }
+    free(f->dgrams);
+    free(f->arena);
+    f->arena = NULL;
+}
+
+/**
+ * Give f an empty ring of count slots, continuing from its current serial.
+ * Slots get their buffers when they are first written to, except in
+ * fixed-record topics, where every slot has its place in the arena.
+ */
+static void dgrams_alloc(busfs_file f, size_t count)
+{
+    size_t ii;
+
+    f->dgram_count = count;
+    f->dgrams = calloc(f->dgram_count, sizeof(busfs_dgram));
 
-    /* Initialize signal handlers, maybe?*/
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = busfs_read_interrupt_handler;
-    sigaction(SIGUSR1, &sa, NULL);
+    if (f->framing == BUSFS_FRAMING_FIXED) {
+        f->dgram_maxlen = f->record_size;
+        f->arena = malloc(f->dgram_count * f->record_size);
+        for (ii = 0; ii < f->dgram_count; ii++) {
+            f->dgrams[ii].root = f->arena + ii * f->record_size;
+            f->dgrams[ii].msgalloc = f->record_size;
+        }
+    } else {
+        f->dgram_maxlen = BUSFS_MSGLEN_INITIAL;
+        f->dgrams[0].root = malloc(f->dgram_maxlen);
+        f->dgrams[0].msgalloc = f->dgram_maxlen;
+    }
 
+    f->dgrams[0].serial = f->serial;
+    f->curidx = 0;
+    f->head_idx = 0;
+    f->head_serial = f->serial;
+    f->ring_gen++;
 }
 
 /**
@@ -37,32 +89,81 @@ void busfs_init(void)
 static busfs_file new_busfs_file(const char *path)
 {
     busfs_file f;
-    int ii;
     f = calloc(1, sizeof(struct busfs_file_st));
 
-    f->dgram_maxlen = BUSFS_MSGLEN_INITIAL;
-    f->dgram_count = BUSFS_DGRAM_COUNT;
-    f->dgrams = calloc(f->dgram_count, sizeof(busfs_dgram));
-
-    for (ii = 0; ii < f->dgram_count; ii++) {
-        f->dgrams[ii].root = malloc(f->dgram_maxlen);
-    }
+    f->serial = 0x100;
+    f->incarnation = ((uint64_t)g_random_int() << 32) | g_random_int();
+    f->numa_node = -1;
+    dgrams_alloc(f, BUSFS_DGRAM_COUNT);
 
     strncpy(f->path, path, sizeof(f->path));
 
     f->delim = '\n';
-    f->serial = 0x100;
-    f->dgrams[0].serial = f->serial;
 
     pthread_rwlock_init(&f->sync.refs_rwlock, NULL);
     pthread_rwlock_init(&f->sync.buf_rwlock, NULL);
-    pthread_cond_init(&f->sync.iowait_cond, NULL);
-    pthread_mutex_init(&f->sync.iowait_mutex, NULL);
+    pthread_mutex_init(&f->sync.attr_mutex, NULL);
+    pthread_mutex_init(&f->sync.pubq_mutex, NULL);
+    pthread_mutex_init(&f->sync.sub_mutex, NULL);
+    pthread_mutex_init(&f->sync.poll_mutex, NULL);
+
+    f->pubq.buf = g_string_new(NULL);
+    f->pubq.spare = g_string_new(NULL);
+    g_queue_init(&f->waiting);
     return f;
 }
 
+static void file_free(busfs_file f)
+{
+    size_t ii;
+    dgrams_free(f);
+    if (f->latest) {
+        g_hash_table_destroy(f->latest);
+    }
+    if (f->readers) {
+        g_hash_table_destroy(f->readers);
+    }
+    if (f->pollers) {
+        g_hash_table_destroy(f->pollers);
+    }
+    if (f->replay_paths) {
+        g_hash_table_destroy(f->replay_paths);
+    }
+    g_string_free(f->pubq.buf, TRUE);
+    g_string_free(f->pubq.spare, TRUE);
+    if (f->sub.writers) {
+        g_ptr_array_free(f->sub.writers, TRUE);
+    }
+    for (ii = 0; ii < f->nparts; ii++) {
+        file_free(f->parts[ii]);
+    }
+    free(f->parts);
+    pthread_rwlock_destroy(&f->sync.refs_rwlock);
+    pthread_rwlock_destroy(&f->sync.buf_rwlock);
+    pthread_mutex_destroy(&f->sync.attr_mutex);
+    pthread_mutex_destroy(&f->sync.pubq_mutex);
+    pthread_mutex_destroy(&f->sync.sub_mutex);
+    pthread_mutex_destroy(&f->sync.poll_mutex);
+    free(f);
+}
+
+/**
+ * busfs_file_notify() for f and each of its partitions
+ */
+static void file_notify_all(busfs_file f)
+{
+    uint32_t ii;
+
+    busfs_file_notify(f);
+    for (ii = 0; ii < f->nparts; ii++) {
+        busfs_file_notify(f->parts[ii]);
+    }
+}
+
 void busfs_file_release(busfs_file f, busfs_info_t type)
 {
+    int gone = 0;
+
     /* Decrement the refcount, and maybe do some other things */
     pthread_rwlock_wrlock(&f->sync.refs_rwlock);
     f->refcount--;
@@ -73,25 +174,30 @@ void busfs_file_release(busfs_file f, busfs_info_t type)
         break;
     case BUSFS_INFO_WRITER:
         f->writer_count--;
+        /* Readers of an unlinked topic see the end of it once the last
+         * writer has gone */
+        gone = f->writer_count == 0 && f->unlinked;
         break;
     default:
         break;
     }
 
-    if (f->refcount == 0 && f->unlinked) {
-        size_t ii;
-        for (ii = 0; ii < f->dgram_count; ii++) {
-            busfs_dgram *msg = f->dgrams + ii;
-            free(msg->root);
-        }
-        free(f->dgrams);
-        pthread_rwlock_destroy(&f->sync.refs_rwlock);
-        pthread_rwlock_destroy(&f->sync.buf_rwlock);
-        pthread_mutex_destroy(&f->sync.iowait_mutex);
-        pthread_cond_destroy(&f->sync.iowait_cond);
-        free(f);
+    if (f->parent) {
+        /* Partitions live as long as their topic */
+        pthread_rwlock_unlock(&f->sync.refs_rwlock);
+        busfs_file_release(f->parent, BUSFS_INFO_NONE);
+    } else if (f->refcount == 0 && f->unlinked) {
+        file_free(f);
     } else {
+        if (gone) {
+            /* Kept until its readers have been told */
+            f->refcount++;
+        }
         pthread_rwlock_unlock(&f->sync.refs_rwlock);
+        if (gone) {
+            file_notify_all(f);
+            busfs_file_release(f, BUSFS_INFO_NONE);
+        }
     }
 }
 
@@ -99,8 +205,6 @@ busfs_file busfs_file_get(const char *path, busfs_getflags_t flags)
 {
     busfs_file f;
     int ret;
-    LOG_MSG("Requested file object for %s", path);
-
     ret = pthread_rwlock_rdlock(&_BFG.lock);
 
     if (ret != 0) {
@@ -108,15 +212,9 @@ busfs_file busfs_file_get(const char *path, busfs_getflags_t flags)
         return NULL;
     }
 
-    LOG_MSG("Locked hashtable via rdlock");
-
-
     f = (busfs_file)g_hash_table_lookup(_BFG.ht, path);
 
-    LOG_MSG("Initial lookup returns %p", f);
-
     if (f && (flags & BUSFS_GETf_INC)) {
-        LOG_MSG("Incrementing the refcount");
         pthread_rwlock_wrlock(&f->sync.refs_rwlock);
         f->refcount++;
         pthread_rwlock_unlock(&f->sync.refs_rwlock);
@@ -136,38 +234,526 @@ busfs_file busfs_file_get(const char *path, busfs_getflags_t flags)
             return NULL;
         }
 
+        LOG_MSG("Creating file object for %s", path);
         f = new_busfs_file(path);
         g_hash_table_insert(_BFG.ht, f->path, f);
+        _BFG.generation++;
 
         f->refcount = (flags & BUSFS_GETf_INC) ? 1 : 0;
 
         pthread_rwlock_unlock(&_BFG.lock);
+
+        /* Directory readers pick up the new topic */
+        if (_BFG.merge.readers) {
+            busfs_merge_notify();
+        }
         return f;
     }
 }
 
+/**
+ * Write the path of partition idx of the topic at path into buf. Returns
+ * -ENAMETOOLONG if it doesn't fit.
+ */
+static int partition_path(char *buf, size_t len, const char *path,
+                          uint32_t idx)
+{
+    int n = snprintf(buf, len, "%s@%u", path, idx);
+    return (n < 0 || (size_t)n >= len) ? -ENAMETOOLONG : 0;
+}
+
 int busfs_file_rename(busfs_file f, const char *to)
 {
-    const char *from = f->path;
-    BUSFS_CONVERT_PATH(to);
-    BUSFS_CONVERT_PATH(from);
+    char from[sizeof(f->path)];
+    uint32_t ii;
+
+    /* The longest partition path has to fit under the new name too */
+    if (f->nparts && partition_path(from, sizeof(from), to,
+                                    f->nparts - 1) != 0) {
+        return -ENAMETOOLONG;
+    }
 
     pthread_rwlock_wrlock(&_BFG.lock);
-    g_hash_table_remove(_BFG.ht, from);
+    memcpy(from, f->path, sizeof(from));
+    g_hash_table_remove(_BFG.ht, f->path);
     strncpy(f->path, to, sizeof(f->path));
     g_hash_table_insert(_BFG.ht, f->path, f);
+    _BFG.generation++;
 
     pthread_rwlock_unlock(&_BFG.lock);
+    if (_BFG.merge.readers) {
+        busfs_merge_notify();
+    }
+
+    for (ii = 0; ii < f->nparts; ii++) {
+        partition_path(f->parts[ii]->path, sizeof(f->parts[ii]->path), to,
+                       ii);
+    }
+    busfs_cursor_rename(from, to);
+
+    pthread_mutex_lock(&f->sync.attr_mutex);
+    f->attr_valid = 0;
+    f->access_known = 0;
+    pthread_mutex_unlock(&f->sync.attr_mutex);
+    return 0;
+}
+
+/**
+ * Give the partitions of f the settings in opts which apply to them
+ */
+static int partitions_configure(busfs_file f,
+                                const struct busfs_openopts_st *opts)
+{
+    struct busfs_openopts_st sub = *opts;
+    uint32_t ii;
+    int ret;
+
+    sub.configure &= BUSFS_CONFf_FRAMING|BUSFS_CONFf_COMPACT|
+            BUSFS_CONFf_RETENTION|BUSFS_CONFf_SLOTS|BUSFS_CONFf_COMPRESS|
+            BUSFS_CONFf_NUMA;
+
+    for (ii = 0; ii < f->nparts; ii++) {
+        ret = busfs_file_configure(f->parts[ii], &sub);
+        if (ret != 0) {
+            return ret;
+        }
+    }
     return 0;
 }
 
+/**
+ * Split f into nparts rings, which take its current settings. The caller
+ * checks that their paths fit. Must be called with buf_rwlock held for
+ * writing.
+ */
+static void partitions_create(busfs_file f, uint32_t nparts)
+{
+    uint32_t ii;
+
+    f->parts = calloc(nparts, sizeof(busfs_file));
+    for (ii = 0; ii < nparts; ii++) {
+        char path[FILENAME_MAX];
+        busfs_file part;
+
+        partition_path(path, sizeof(path), f->path, ii);
+        part = new_busfs_file(path);
+        if (f->dgram_count != part->dgram_count) {
+            dgrams_free(part);
+            dgrams_alloc(part, f->dgram_count);
+        }
+        part->parent = f;
+        part->z.enabled = f->z.enabled;
+        part->framing = f->framing;
+        part->retention_ns = f->retention_ns;
+        part->numa_node = f->numa_node;
+        if (f->latest) {
+            part->latest = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+        }
+        f->parts[ii] = part;
+    }
+    f->nparts = nparts;
+}
+
+/**
+ * Get partition idx of f, taking a reference on it in place of the caller's
+ * reference on f. Returns NULL if there is no such partition.
+ */
+busfs_file busfs_file_partition(busfs_file f, uint32_t idx)
+{
+    busfs_file part;
+
+    if (idx >= f->nparts) {
+        return NULL;
+    }
+
+    part = f->parts[idx];
+    pthread_rwlock_wrlock(&part->sync.refs_rwlock);
+    part->refcount++;
+    pthread_rwlock_unlock(&part->sync.refs_rwlock);
+    return part;
+}
+
+/**
+ * Apply the topic settings given in opts. Settings may only be changed while
+ * the topic is empty, as existing messages would otherwise be misinterpreted.
+ */
+int busfs_file_configure(busfs_file f, const struct busfs_openopts_st *opts)
+{
+    int ret = 0;
+    busfs_framing_t framing = f->framing;
+    size_t record_size = f->record_size;
+    int compact = f->latest != NULL;
+    uint64_t window_ns = f->pubq.window_ns;
+    uint32_t nparts = f->nparts;
+    size_t slots = f->dgram_count;
+    int numa_node = f->numa_node;
+    int start_compress = 0, rebuild = 0;
+
+    if (!opts->configure) {
+        return 0;
+    }
+
+    if (f->nparts) {
+        /* Partitions are checked first, as they may hold messages */
+        ret = partitions_configure(f, opts);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    busfs_write_drain(f);
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+
+    if (opts->configure & BUSFS_CONFf_FRAMING) {
+        framing = opts->framing;
+        record_size = (framing == BUSFS_FRAMING_FIXED) ? opts->record_size : 0;
+    }
+    if (opts->configure & BUSFS_CONFf_COMPACT) {
+        compact = opts->compact;
+    }
+
+    if (opts->configure & BUSFS_CONFf_BATCH) {
+        window_ns = (uint64_t)opts->batch_us * 1000;
+    }
+
+    if (opts->configure & BUSFS_CONFf_PARTITIONS) {
+        nparts = opts->partitions;
+    }
+
+    if (opts->configure & BUSFS_CONFf_SLOTS) {
+        slots = opts->slots;
+    }
+
+    if (opts->configure & BUSFS_CONFf_NUMA) {
+        numa_node = opts->numa_node;
+    }
+
+    if ((compact || window_ns || nparts) && framing != BUSFS_FRAMING_DELIM) {
+        ret = -EINVAL;
+        goto GT_RET;
+    }
+
+    if (framing == BUSFS_FRAMING_FIXED &&
+            (f->z.enabled || (opts->configure & BUSFS_CONFf_COMPRESS))) {
+        /* Records stay in place in the arena */
+        ret = -EINVAL;
+        goto GT_RET;
+    }
+
+    if (nparts && window_ns) {
+        /* Writes to partitioned topics are routed as they arrive */
+        ret = -EINVAL;
+        goto GT_RET;
+    }
+
+    if (nparts != f->nparts) {
+        char path[FILENAME_MAX];
+
+        if (f->nparts || f->serial != f->head_serial ||
+                f->dgrams[f->curidx].msgsize ||
+                f->reader_count || f->writer_count) {
+            LOG_MSG("Can't partition %s again, or while it is in use",
+                    f->path);
+            ret = -EBUSY;
+            goto GT_RET;
+        }
+
+        if (nparts && partition_path(path, sizeof(path), f->path,
+                                     nparts - 1) != 0) {
+            ret = -ENAMETOOLONG;
+            goto GT_RET;
+        }
+    }
+
+    if (slots != f->dgram_count || record_size != f->record_size) {
+        if (f->serial != f->head_serial || f->dgrams[f->curidx].msgsize ||
+                f->exports) {
+            LOG_MSG("Can't resize %s while it holds messages or is exported",
+                    f->path);
+            ret = -EBUSY;
+            goto GT_RET;
+        }
+    }
+
+    if (numa_node != f->numa_node) {
+        /* Slots which have been written to keep their memory */
+        if (f->serial != f->head_serial || f->dgrams[f->curidx].msgsize) {
+            LOG_MSG("Can't move %s to another node while it holds messages",
+                    f->path);
+            ret = -EBUSY;
+            goto GT_RET;
+        }
+    }
+
+    if (f->framing != framing || f->record_size != record_size ||
+            (f->latest != NULL) != compact) {
+        if (f->serial != f->head_serial || f->dgrams[f->curidx].msgsize ||
+                f->exports) {
+            LOG_MSG("Can't reconfigure non-empty topic %s", f->path);
+            ret = -EBUSY;
+            goto GT_RET;
+        }
+
+        f->framing = framing;
+        if (f->record_size != record_size) {
+            /* The ring is rebuilt with slots of the new size below */
+            f->record_size = record_size;
+            rebuild = 1;
+        }
+
+        if (compact && !f->latest) {
+            f->latest = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, g_free);
+        } else if (!compact && f->latest) {
+            g_hash_table_destroy(f->latest);
+            f->latest = NULL;
+        }
+    }
+
+    f->numa_node = numa_node;
+
+    if (opts->configure & BUSFS_CONFf_RETENTION) {
+        f->retention_ns = (uint64_t)opts->retention_ms * 1000000;
+    }
+
+    if (window_ns != f->pubq.window_ns) {
+        /* Writes queued under the old window go out now */
+        busfs_write_commit_queued(f);
+        f->pubq.window_ns = window_ns;
+    }
+
+    if (slots != f->dgram_count || rebuild) {
+        uint64_t boff = f->dgrams[f->curidx].boff;
+        dgrams_free(f);
+        dgrams_alloc(f, slots);
+        f->dgrams[0].boff = boff;
+    }
+
+    if ((opts->configure & BUSFS_CONFf_COMPRESS) && !f->z.enabled) {
+        f->z.enabled = 1;
+        /* The thread compresses partitions along with their topic */
+        start_compress = f->parent == NULL;
+    }
+
+    if (nparts != f->nparts) {
+        partitions_create(f, nparts);
+    }
+
+    GT_RET:
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    busfs_read_wake(f);
+    if (start_compress) {
+        busfs_compress_enable(f);
+    }
+    return ret;
+}
+
+/**
+ * Place the ring of f, and those of its partitions, on node, unless it has
+ * been placed already. Called when a writer opens it.
+ */
+void busfs_file_place(busfs_file f, int node)
+{
+    uint32_t ii;
+
+    if (node < 0) {
+        return;
+    }
+    if (__sync_bool_compare_and_swap(&f->numa_node, -1, node)) {
+        LOG_MSG("Placed %s on node %d", f->path, node);
+    }
+    for (ii = 0; ii < f->nparts; ii++) {
+        busfs_file_place(f->parts[ii], node);
+    }
+}
+
+/**
+ * Whether the oldest committed message of f is older than the topic's
+ * retention period. Must be called with buf_rwlock held.
+ */
+int busfs_file_expired(busfs_file f, uint64_t now)
+{
+    return f->retention_ns != 0 && now >= f->retention_ns &&
+        f->head_serial != f->serial &&
+        f->dgrams[f->head_idx].ts < now - f->retention_ns;
+}
+
+/**
+ * Drop committed messages older than the topic's retention period. Must be
+ * called with buf_rwlock held for writing.
+ */
+void busfs_file_expire(busfs_file f, uint64_t now)
+{
+    while (busfs_file_expired(f, now)) {
+        busfs_file_evict(f, f->head_serial + 1);
+    }
+}
+
+/**
+ * Move the head of f forward to serial, releasing the compressed blocks of
+ * the messages it passes so that they are no longer counted. Must be called
+ * with buf_rwlock held for writing.
+ */
+void busfs_file_evict(busfs_file f, uint32_t serial)
+{
+    while (f->head_serial != serial && f->z.raw_bytes) {
+        busfs_dgram_release(f, f->dgrams + f->head_idx);
+        f->head_idx++;
+        f->head_idx %= f->dgram_count;
+        f->head_serial++;
+    }
+    f->head_idx = BUSFS_SERIAL_IDX(f, serial);
+    f->head_serial = serial;
+}
+
+/**
+ * Let everything following f know that it has changed: readers in poll(2),
+ * directory readers and replication peers. Called after committing, without
+ * holding buf_rwlock.
+ */
+void busfs_file_notify(busfs_file f)
+{
+    busfs_read_wake(f);
+    if (BusFS_Global.merge.readers) {
+        busfs_merge_notify();
+    }
+    if (BusFS_Global.repl.peers) {
+        busfs_repl_notify();
+    }
+}
+
+/**
+ * Discard committed messages in constant time, by moving the head. If size
+ * is 0 every committed message goes, along with the keys of a compacted
+ * topic; otherwise it is the serial of the first message to keep. Readers
+ * which were behind the new head continue from it.
+ */
+int busfs_file_truncate(busfs_file f, off_t size)
+{
+    uint32_t serial = (uint32_t)size;
+    int ret = 0;
+
+    if (size < 0 || size > UINT32_MAX) {
+        return -EINVAL;
+    }
+
+    if (f->nparts) {
+        /* Serials are per partition, so only a purge makes sense */
+        uint32_t ii;
+        if (size != 0) {
+            return -EINVAL;
+        }
+        for (ii = 0; ii < f->nparts; ii++) {
+            busfs_file_truncate(f->parts[ii], 0);
+        }
+    }
+
+    busfs_write_drain(f);
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+
+    if (size == 0) {
+        serial = f->serial;
+        if (f->latest) {
+            g_hash_table_remove_all(f->latest);
+        }
+    } else if (BUSFS_SERIAL_BEFORE(f->serial, serial)) {
+        ret = -EINVAL;
+        goto GT_RET;
+    } else if (BUSFS_SERIAL_BEFORE(serial, f->head_serial)) {
+        goto GT_RET;
+    }
+
+    LOG_MSG("Purging %s up to serial %u", f->path, serial);
+    busfs_file_evict(f, serial);
+
+    GT_RET:
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    /* As after a write, so that readers behind the new head notice */
+    busfs_file_notify(f);
+    return ret;
+}
+
+/**
+ * lstat() the file backing f, reusing the result of an earlier call until
+ * the attributes are changed through the daemon.
+ */
+int busfs_file_stat(busfs_file f, const char *realpath, struct stat *st)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&f->sync.attr_mutex);
+    if (!f->attr_valid) {
+        if (lstat(realpath, &f->attr) == -1) {
+            ret = -errno;
+            goto GT_RET;
+        }
+        f->attr_valid = 1;
+    }
+    *st = f->attr;
+
+    GT_RET:
+    pthread_mutex_unlock(&f->sync.attr_mutex);
+    return ret;
+}
+
+/**
+ * access() the file backing f, remembering the result for each mask.
+ */
+int busfs_file_access(busfs_file f, const char *realpath, int mask)
+{
+    int ret;
+    mask &= (R_OK|W_OK|X_OK);
+
+    pthread_mutex_lock(&f->sync.attr_mutex);
+    if (f->access_known & (1 << mask)) {
+        ret = f->access_res[mask];
+    } else {
+        ret = (access(realpath, mask) == -1) ? -errno : 0;
+        f->access_res[mask] = ret;
+        f->access_known |= (1 << mask);
+    }
+    pthread_mutex_unlock(&f->sync.attr_mutex);
+    return ret;
+}
+
+/**
+ * Forget the cached attributes of the topic at path, after they were
+ * changed.
+ */
+void busfs_file_invalidate(const char *path)
+{
+    busfs_file f = busfs_file_get(path, BUSFS_GETf_INC);
+    if (f == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&f->sync.attr_mutex);
+    f->attr_valid = 0;
+    f->access_known = 0;
+    pthread_mutex_unlock(&f->sync.attr_mutex);
+
+    busfs_file_release(f, BUSFS_INFO_NONE);
+}
+
 int busfs_file_unlink(busfs_file f, const char *path)
 {
+    uint32_t ii;
     BUSFS_CONVERT_PATH(path);
 
     pthread_rwlock_wrlock(&_BFG.lock);
     g_hash_table_remove(_BFG.ht, f->path);
+    _BFG.generation++;
     pthread_rwlock_unlock(&_BFG.lock);
     f->unlinked = 1;
+    for (ii = 0; ii < f->nparts; ii++) {
+        f->parts[ii]->unlinked = 1;
+    }
+    busfs_cursor_drop(f->path);
+
+    /* Readers at the end of a topic nobody writes to any more see EOF, and
+     * directory readers drop it */
+    file_notify_all(f);
     return 0;
 }
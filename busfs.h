@@ -1,7 +1,7 @@
 #ifndef BUSFS_H_
 #define BUSFS_H_
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
 
 #include <glib.h>
@@ -9,7 +9,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <stdint.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -19,6 +19,7 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,7 +34,7 @@
 #define BUSFS_LOGFILE "busfs.log"
 #endif /* BUSFS_LOGFILE */
 
-/*The 'real' path which takes care of the fs map */
+/*The 'real' path which takes care of the fs map, unless -o realfs= is given */
 #ifndef BUSFS_REALFS
 #define BUSFS_REALFS "/tmp/busfs"
 #endif /*BUSFS_REALFS*/
@@ -41,6 +42,56 @@
 #define BUSFS_DGRAM_COUNT 1024
 #define BUSFS_MSGLEN_INITIAL 256
 
+/* Largest record accepted by length-prefixed topics */
+#define BUSFS_FRAME_MAXLEN (1 << 20)
+
+/* Largest record size of a fixed-record topic */
+#define BUSFS_RECORD_MAXLEN (64 * 1024)
+
+/* Default for -o max_write; the largest request the kernel will send */
+#define BUSFS_MAX_WRITE_DEFAULT (1 << 20)
+
+/* Queued writes are committed at once when they reach this size, rather
+ * than waiting for the topic's batch window */
+#define BUSFS_BATCH_MAX_BYTES (256 * 1024)
+
+/* Writes each writer of a delimited topic may queue in its sub-ring before
+ * it has to wait for them to be applied */
+#define BUSFS_SUBRING_SLOTS 16
+/* Ring sizes which may be given with slots=N. Indices are 16 bits */
+#define BUSFS_SLOTS_MIN 16
+#define BUSFS_SLOTS_MAX 65536
+
+/* Compression of cold messages: how much raw data goes into a block, and
+ * how often the background thread looks for more */
+#define BUSFS_ZBLOCK_SIZE (64 * 1024)
+#define BUSFS_COMPRESS_INTERVAL_MS 1000
+
+/* Most partitions a topic may be split into */
+#define BUSFS_PARTITIONS_MAX 1024
+
+/* NUMA nodes which may be given with numa=N */
+#define BUSFS_NUMA_NODES_MAX 1024
+
+/* How often the positions of named cursors are saved */
+#define BUSFS_CURSOR_FLUSH_MS 1000
+
+/* How long a daemon handing over its topics waits for the other side */
+#define BUSFS_HANDOFF_TIMEOUT_MS 10000
+
+/* How long batching readers wait for min_bytes/min_msgs by default */
+#define BUSFS_LINGER_DEFAULT_MS 100
+
+/* Worker threads reading requests, unless -o workers= is given. Reads
+ * waiting for messages don't occupy one */
+#define BUSFS_WORKERS_DEFAULT 10
+
+/* How long the kernel may cache names and attributes, unless given with
+ * -o entry_timeout=, attr_timeout= or negative_timeout= */
+#define BUSFS_ENTRY_TIMEOUT 60.0
+#define BUSFS_ATTR_TIMEOUT 1.0
+#define BUSFS_NEGATIVE_TIMEOUT 0.0
+
 typedef struct busfs_file_st* busfs_file;
 
 typedef enum {
@@ -53,7 +104,10 @@ typedef enum {
     BUSFS_INFO_NONE,
     BUSFS_INFO_READER = 1,
     BUSFS_INFO_WRITER,
-    BUSFS_INFO_CTL
+    BUSFS_INFO_CTL,
+    BUSFS_INFO_MERGE,
+    BUSFS_INFO_REPLAY,
+    BUSFS_INFO_EXPORT
 } busfs_info_t;
 
 /* Enum containing various 'flags' */
@@ -63,20 +117,114 @@ typedef enum {
 } busfs_filestate_t;
 
 
+/* How messages are delimited within a topic */
+typedef enum {
+    /* Messages end with busfs_file_st::delim */
+    BUSFS_FRAMING_DELIM = 0,
+
+    /* Each message is preceded by its length, as a 32 bit big-endian value */
+    BUSFS_FRAMING_LENGTH,
+
+    /* Each message is a record of busfs_file_st::record_size bytes */
+    BUSFS_FRAMING_FIXED
+} busfs_framing_t;
+
 typedef struct busfs_common_st *busfs_common;
+typedef struct busfs_pending_st *busfs_pending;
 struct busfs_common_st {
     busfs_info_t type;
     int (*read_func)(busfs_common o, const char*, char*, size_t, off_t);
     int (*write_func)(busfs_common o, const char*, const char *, size_t, off_t);
     int (*close_func)(busfs_common o, const char*);
+
+    /* Optional. Adds the poll(2) events which are ready to *reventsp, and
+     * takes ownership of ph, if given, to notify when that changes */
+    int (*poll_func)(busfs_common o, struct fuse_pollhandle *ph,
+                     unsigned *reventsp);
+
+    /* Optional, for handles whose reads may wait. Answers the read p, or
+     * keeps it to answer once there is something to read, so that no
+     * worker thread waits with it. Replaces read_func for read(2) */
+    void (*wait_func)(busfs_common o, busfs_pending p);
+
+    /* Takes p back, if it is being kept. With interrupt, p is marked so
+     * that it is answered with EINTR rather than kept again. Returns 1 if
+     * p was being kept, and now belongs to the caller */
+    int (*unwait_func)(busfs_common o, busfs_pending p, int interrupt);
+};
+
+/**
+ * A read(2) which has been taken off its worker thread, see busfs_ll.c. It
+ * is answered with busfs_pending_reply(). Until then it belongs to the
+ * thread which is looking at it, or to the list it is kept on; link,
+ * parked and interrupted are protected by the lock of that list.
+ */
+struct busfs_pending_st {
+    fuse_req_t req;
+    uint64_t unique;
+    busfs_common o;
+    size_t size;
+
+    /* The handle read, as the kernel knows it, and the device the request
+     * came from. A read taken over from a previous daemon has no req, and
+     * is answered by writing to fd */
+    uint64_t fh;
+    int fd;
+
+    /* When the read first had to wait, and until when a batching reader
+     * waits for min_bytes or min_msgs. Both are from busfs_clock_ns() */
+    uint64_t since_ns;
+    uint64_t linger_ns;
+
+    GList link;
+    unsigned parked :1;
+    unsigned interrupted :1;
 };
 
 typedef struct {
     char *root;
     uint32_t msgsize;
     uint32_t serial;
+
+    /* Allocated size of root */
+    uint32_t msgalloc;
+
+    /* Offset of this message within the stream of bytes seen by readers */
+    uint64_t boff;
+
+    /* When the message was committed, from busfs_clock_ns() */
+    uint64_t ts;
+
+    /* If the message has been compressed, the block holding it and where
+     * it starts once the block is decompressed. root is then NULL */
+    struct busfs_zblock_st *zblock;
+    uint32_t zoff;
 } busfs_dgram;
 
+/* A reader's copy of the last compressed block it needed */
+typedef struct {
+    struct busfs_zblock_st *block;
+    char *buf;
+    size_t alloc;
+} busfs_zcache;
+
+/* Latest message for a key, in compacted topics */
+typedef struct {
+    uint32_t serial;
+    uint32_t msgsize;
+    char root[1];
+} busfs_latest;
+
+/* A write queued in a writer's sub-ring, with its place in the topic's
+ * order and the time it arrived */
+typedef struct {
+    gint ticket;
+    uint64_t ts;
+    char *buf;
+    size_t len;
+    size_t alloc;
+} busfs_subent;
+
 struct busfs_file_st {
     /* Common information - Must be first */
     struct busfs_common_st common;
@@ -94,18 +242,112 @@ struct busfs_file_st {
     /* Total count of datagrams in the ringbuffer */
     size_t dgram_count;
 
-    /* Current datagram sequence */
+    /* Current datagram sequence (the message being written) */
     uint32_t serial;
 
     /* Index into array of datagrams */
     uint16_t curidx;
 
+    /* Serial and index of the oldest datagram still in the ringbuffer */
+    uint32_t head_serial;
+    uint16_t head_idx;
+
+    /* Bumped whenever the ring is rebuilt, so readers re-derive their index */
+    uint32_t ring_gen;
+
+    /* Random, and kept across a handover, so that a cursor saved for an
+     * earlier topic of the same name isn't applied to this one's serials */
+    uint64_t incarnation;
+
     /* Implicit datagram delimiter */
     char delim;
 
+    /* How writers delimit messages, and how readers receive them */
+    busfs_framing_t framing;
+
+    /* For fixed-record topics, the size of each record, and the buffer
+     * holding every slot's record in ring order. Slot i is at
+     * arena + i * record_size, so runs of slots are contiguous */
+    size_t record_size;
+    char *arena;
+
+    /* NUMA node the ring's memory is on, and whose workers read and write
+     * it, or -1 until it is written to. Only with -o numa */
+    int numa_node;
+
+    /* For compacted topics, the latest busfs_latest for each key */
+    GHashTable *latest;
+
+    /* Messages older than this many nanoseconds are dropped, if nonzero */
+    uint64_t retention_ns;
+
+    /* Timestamp for messages committed by the current write */
+    uint64_t pub_ts;
+
     uint16_t writer_count;
     uint32_t reader_count;
 
+    /* Open readers, for status files. Protected by sync.refs_rwlock */
+    GHashTable *readers;
+
+    /* Readers waiting in poll(2) with a handle to notify when messages
+     * arrive, reads waiting for messages, and how many there are of both,
+     * for writers to check without the lock. Protected by sync.poll_mutex */
+    GHashTable *pollers;
+    GQueue waiting;
+    gint nwaiting;
+
+    /* For partitioned topics, the rings messages are routed to. Each
+     * partition refers back to its topic, which owns it */
+    busfs_file *parts;
+    uint32_t nparts;
+    busfs_file parent;
+
+    /* Compression of cold messages, see busfs_compress.c. Protected by
+     * buf_rwlock, except for scheduled */
+    struct {
+        int enabled;
+        int scheduled;
+
+        /* The first serial which hasn't been looked at yet */
+        uint32_t next;
+
+        /* Size of the messages which are compressed, before and after */
+        uint64_t raw_bytes;
+        uint64_t z_bytes;
+    } z;
+
+    /* Group commit. If window_ns is nonzero, writes are appended to buf
+     * and committed to the ring together, at most window_ns after the
+     * first of them. buf and first_ns are protected by sync.pubq_mutex;
+     * spare belongs to whoever holds buf_rwlock for writing */
+    struct {
+        GString *buf;
+        GString *spare;
+        uint64_t first_ns;
+        uint64_t window_ns;
+
+        /* Whether the topic is waiting for the batch thread, which
+         * protects this */
+        int scheduled;
+    } pubq;
+
+    /* Writes queued in the sub-rings of concurrent writers, see
+     * busfs_write.c. Each takes a ticket from the single counter ticket,
+     * and they are applied to the ring in ticket order, so the stream is
+     * the same as if the writes had taken buf_rwlock one after another.
+     * writers and next are protected by sync.sub_mutex */
+    struct {
+        GPtrArray *writers;
+        gint ticket;
+        guint next;
+
+        /* Writes queued and not yet applied, and a count of every write
+         * queued, which tells the drainer to look again */
+        gint pending;
+        gint queued;
+    } sub;
+
     /* Flag for initialization */
     unsigned initialized :1;
 
@@ -117,13 +359,21 @@ struct busfs_file_st {
         /* Lock controlling buffer positions and indices */
         pthread_rwlock_t buf_rwlock;
 
-        /* condvar + mutex for new data */
-        pthread_cond_t iowait_cond;
-        pthread_mutex_t iowait_mutex;
-
         /* lock controlling the manipulation of refcounts */
         pthread_rwlock_t refs_rwlock;
 
+        /* lock for the cached attributes */
+        pthread_mutex_t attr_mutex;
+
+        /* lock for the publish queue */
+        pthread_mutex_t pubq_mutex;
+
+        /* held while applying the writers' sub-rings */
+        pthread_mutex_t sub_mutex;
+
+        /* lock for the readers waiting in poll(2) or read(2) */
+        pthread_mutex_t poll_mutex;
+
     } sync;
 
     /* Total number of 'filehandles' */
@@ -131,6 +381,110 @@ struct busfs_file_st {
 
     /* 'time' for update */
     time_t mtime;
+
+    /* Cached lstat() of the backing file, and access() results by mask.
+     * Protected by sync.attr_mutex, and dropped by busfs_file_invalidate() */
+    struct stat attr;
+    int attr_valid;
+    uint8_t access_known;
+    int access_res[8];
+
+    /* Paths the replay file has been opened under, whose page cache holds
+     * this topic's data. Protected by sync.attr_mutex */
+    GHashTable *replay_paths;
+
+    /* Exports still taking their copy, and the slot buffers writers gave
+     * up rather than reuse while those exports need them. Protected by
+     * sync.buf_rwlock */
+    GList *exports;
+    GPtrArray *orphans;
+};
+
+/* Reader flags which may be requested at open time */
+typedef enum {
+    /* Only return whole messages from read(2) */
+    BUSFS_RDf_ATOMIC = 1 << 0,
+
+    /* In atomic mode, truncate messages which don't fit rather than failing */
+    BUSFS_RDf_TRUNCATE = 1 << 1,
+
+    /* Don't start with a snapshot when reading a compacted topic */
+    BUSFS_RDf_NOSNAPSHOT = 1 << 2,
+} busfs_rdflags_t;
+
+/* Topic settings which were given at open time */
+typedef enum {
+    BUSFS_CONFf_FRAMING = 1 << 0,
+    BUSFS_CONFf_COMPACT = 1 << 1,
+    BUSFS_CONFf_RETENTION = 1 << 2,
+    BUSFS_CONFf_BATCH = 1 << 3,
+    BUSFS_CONFf_PARTITIONS = 1 << 4,
+    BUSFS_CONFf_SLOTS = 1 << 5,
+    BUSFS_CONFf_COMPRESS = 1 << 6,
+    BUSFS_CONFf_NUMA = 1 << 7,
+} busfs_confflags_t;
+
+/**
+ * Options which may be appended to the last component of a path, as in
+ * 'topic@option,option=value'.
+ */
+struct busfs_openopts_st {
+    /* busfs_rdflags_t */
+    int rdflags;
+
+    /* Don't return from a blocking read until this many bytes or
+     * messages are available, or linger_ms have passed */
+    size_t min_bytes;
+    uint32_t min_msgs;
+    uint32_t linger_ms;
+
+    /* Only deliver messages which match these. Owned by the options */
+    char *prefix;
+    char *substr;
+    GRegex *regex;
+
+    /* Of the messages which match, only deliver every sample'th, at most
+     * max_rate a second, or only the newest one at the time of each read */
+    uint32_t sample;
+    uint32_t max_rate;
+    unsigned latest :1;
+
+    /* Position new readers at the first message stamped at or after this
+     * time (in nanoseconds since the epoch), or at most this long ago */
+    uint64_t since_ns;
+    uint64_t last_ns;
+
+    /* Resume from, and save the position to, the cursor of this name.
+     * Owned by the options */
+    char *cursor;
+
+    /* Open the topic's status file rather than reading messages */
+    unsigned status :1;
+
+    /* Open the topic's replay file, see busfs_replay.c */
+    unsigned replay :1;
+
+    /* Open a copy of the topic's messages, see busfs_export.c */
+    unsigned export :1;
+
+    /* Open this partition of a partitioned topic */
+    unsigned has_partition :1;
+    uint32_t partition;
+
+    /* busfs_confflags_t: which of the topic settings below were given */
+    int configure;
+
+    /* Topic settings. Framing and compaction may only be changed while a
+     * topic is empty */
+    busfs_framing_t framing;
+    uint32_t record_size;
+    unsigned compact :1;
+    uint32_t retention_ms;
+    uint32_t batch_us;
+    uint32_t partitions;
+    uint32_t slots;
+    unsigned compress :1;
+    uint32_t numa_node;
 };
 
 /* Structure defining a 'reader' */
@@ -145,26 +499,286 @@ struct busfs_reader_st {
     /* Serial of the last message read */
     uint32_t r_serial;
 
-    /* Index of the last message read */
+    /* Index of the last message read, in ring generation ring_gen */
     uint16_t r_idx;
+    uint32_t ring_gen;
 
     /* Offset into the last message */
     size_t r_offset;
 
+    /* Options provided in the path during open() */
+    struct busfs_openopts_st opts;
+
+    /* Latest value of each key, for compacted topics, and how much of it
+     * has been read */
+    GString *snapshot;
+    size_t snap_off;
+
+    /* The next serial to deliver. Read by the thread which saves cursors,
+     * and by status files */
+    gint next_serial;
+
+    /* Process which opened the reader */
+    pid_t pid;
+
+    /* Handle to notify when messages arrive, if waiting in poll(2) */
+    struct fuse_pollhandle *poll_ph;
+
+    /* The last compressed block read from */
+    busfs_zcache zcache;
+
+    /* Sampling and rate cap, see reader_select() */
+    struct {
+        /* The last message decided on, and whether it was selected */
+        uint32_t serial;
+        int valid;
+        int selected;
+
+        /* Messages which passed the filters */
+        uint32_t count;
+
+        /* When the next message may be delivered under max_rate */
+        uint64_t tat_ns;
+    } sel;
+
+    /* Counters for status files, updated with BUSFS_STAT_ADD() by the
+     * reading thread only */
+    struct {
+        /* Messages lost to overruns, retention or purging */
+        uint64_t skipped;
+
+        /* Time spent waiting for new data */
+        uint64_t blocked_ns;
+    } stats;
+
     /* Parent */
     busfs_file f;
 
 };
 
-typedef busfs_file busfs_writer;
+/* Structure defining a 'writer' */
+typedef struct busfs_writer_st* busfs_writer;
+struct busfs_writer_st {
+    /* Common information. Must be first */
+    struct busfs_common_st common;
+
+    /* Partially received record, for length-prefixed topics */
+    char *frame;
+    size_t frame_len;
+    size_t frame_alloc;
+
+    /* Set when a header completed from frame was rejected, after the write
+     * which completed it had already used some bytes. The next write fails
+     * with it instead */
+    int frame_err;
+
+    /* Writes queued for the ring while the topic has other writers.
+     * Entries from sub_head to sub_tail are queued; the writer fills
+     * them, and whoever holds the topic's sync.sub_mutex applies them */
+    pthread_mutex_t sub_mutex;
+    busfs_subent sub[BUSFS_SUBRING_SLOTS];
+    unsigned sub_head;
+    unsigned sub_tail;
+
+    /* Parent */
+    busfs_file f;
+};
+
+/**
+ * Number of ringbuffer slots in use, including the one currently being
+ * written to. This is always exact, even after wrap-around.
+ */
+#define BUSFS_FILE_FILL(f) \
+        ((size_t)((f)->serial - (f)->head_serial) + 1)
+
+/* Index of the slot holding a serial which is in the ring */
+#define BUSFS_SERIAL_IDX(f, s) \
+        (((f)->head_idx + (size_t)((uint32_t)(s) - (f)->head_serial)) \
+                % (f)->dgram_count)
+
+/* Serial comparison which survives 32 bit wrap-around */
+#define BUSFS_SERIAL_BEFORE(a, b) \
+        ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+
+/* Wall-clock seconds for a timestamp from busfs_clock_ns() */
+#define BUSFS_CLOCK_TO_TIME(ns) \
+        ((time_t)(((int64_t)(ns) + BusFS_Global.clock_offset_ns) / 1000000000))
+
+/* Relaxed access to counters which are read by other threads */
+#define BUSFS_STAT_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define BUSFS_STAT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* Length of the header readers see before each message */
+#define BUSFS_FRAME_HDRLEN(f) \
+        (((f)->framing == BUSFS_FRAMING_LENGTH) ? sizeof(uint32_t) : 0)
+
+/* Length of a message as seen by readers, including any header */
+#define BUSFS_MSG_LENGTH(f, msg) \
+        (BUSFS_FRAME_HDRLEN(f) + (msg)->msgsize)
+
+
+/* Read-only handle on a topic's status, rendered as text when opened */
+typedef struct busfs_status_st* busfs_status;
+struct busfs_status_st {
+    /* Common information. Must be first */
+    struct busfs_common_st common;
+
+    GString *text;
+};
+
+/* Read-only handle on a topic's messages at fixed offsets */
+typedef struct busfs_replay_st* busfs_replay;
+struct busfs_replay_st {
+    /* Common information. Must be first */
+    struct busfs_common_st common;
+
+    busfs_file f;
+
+    /* Reads of one handle may arrive together, through readahead */
+    pthread_mutex_t mutex;
+    busfs_zcache zcache;
+};
+
+/* Read-only copy of a topic's committed messages, taken at open */
+typedef struct busfs_export_st* busfs_export;
+struct busfs_export_st {
+    /* Common information. Must be first */
+    struct busfs_common_st common;
+
+    char *data;
+    size_t size;
+
+    /* While the copy is being taken, the serials of the messages going
+     * into it, up to end. Records of a fixed-record topic are copied from
+     * next on; writers copy out any they overwrite first. Protected by the
+     * topic's buf_rwlock */
+    uint32_t first;
+    uint32_t next;
+    uint32_t end;
+};
+
+/* Structure defining a reader of a whole directory */
+typedef struct busfs_merge_st* busfs_merge;
+struct busfs_merge_st {
+    /* Common information. Must be first */
+    struct busfs_common_st common;
+
+    /* Flags provided during open() */
+    int open_flags;
+
+    /* Directory being followed, with a trailing slash */
+    char dir[FILENAME_MAX];
+
+    /* Options provided in the path; shared with the children */
+    struct busfs_openopts_st opts;
+
+    /* One reader per topic, keyed by busfs_file, and in reading order */
+    GHashTable *children;
+    GPtrArray *order;
+
+    /* Global generation at which children were last looked up */
+    unsigned generation;
+
+    /* Child to start the next read with, for fairness */
+    unsigned next;
+
+    /* A tagged message which did not fit the last read */
+    GString *pending;
+    size_t pending_off;
+};
+
+/* Settings given with -o on the command line */
+struct busfs_conf_st {
+    /* Directory holding the files which back each topic */
+    const char *realfs;
+
+    /* Stream topics to followers connecting on this address */
+    const char *repl_listen;
+
+    /* Mirror the topics of the leader on this address */
+    const char *repl_follow;
+
+    /* Only replicate topics whose path begins with this */
+    const char *repl_topics;
+
+    /* Largest write (and direct read) request to ask the kernel for */
+    unsigned max_write;
+
+    /* Don't give each worker thread its own /dev/fuse descriptor */
+    int noclone_fd;
+
+    /* Number of worker threads */
+    unsigned workers;
+
+    /* How long the kernel caches names, attributes and missing names */
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+
+    /* Where named cursors are saved, instead of '@cursors' in realfs */
+    const char *cursor_file;
+
+    /* Run on the CPUs of this NUMA node and prefer its memory, or -1 */
+    int numa_node;
+
+    /* Spread the workers over every node, and serve each topic on its
+     * ring's node, see busfs_numa.c */
+    int numa;
+
+    /* Hand topics over to, or take them from, a daemon on this socket */
+    const char *handoff;
+};
+
+/* The request a worker thread is handling, see busfs_loop.c */
+struct busfs_request_st {
+    uint64_t unique;
+    pid_t pid;
 
+    /* The device it was read from */
+    int fd;
+};
+
+/**
+ * A handover being written to, or read from, its memfd, see
+ * busfs_handoff.c. Writing goes through fp; reading takes left bytes from
+ * p onwards.
+ */
+typedef struct busfs_hbuf_st *busfs_hbuf;
+struct busfs_hbuf_st {
+    FILE *fp;
+    const char *p;
+    size_t left;
+};
 
 struct busfs_global_st {
     pthread_rwlock_t lock;
 
-    /* key for pthread_getspecific, used for aborting iowait lock loops */
-    pthread_key_t iowait_seq_key;
+    struct busfs_conf_st conf;
+
     GHashTable *ht;
+
+    /* Difference between the realtime and monotonic clocks, in ns */
+    int64_t clock_offset_ns;
+
+    /* Incremented whenever a topic is added to or removed from ht */
+    unsigned generation;
+
+    /* Reads of directory readers waiting for any of their topics, and a
+     * count of wakeups, to tell whether one was missed */
+    struct {
+        pthread_mutex_t mutex;
+        GQueue waiting;
+        unsigned seq;
+        unsigned readers;
+    } merge;
+
+    /* Wakeups for replication leaders, which follow every topic */
+    struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        unsigned seq;
+        unsigned peers;
+    } repl;
 };
 
 extern struct busfs_global_st BusFS_Global;
@@ -194,20 +808,29 @@ extern FILE *busfs_log_output;
         fi->fh = (unsigned long)w;
 
 #define BUSFS_GET_WR(fi) \
-        (busfs_writer)(fi->fh);
+        (busfs_writer)(fi->fh)
 
 #define BUSFS_GET_COMMON(fi) \
         (busfs_common)(fi->fh);
 
 #define BUSFS_CONVERT_PATH(orig) \
         char BUSFS__converted__ ##orig [FILENAME_MAX]; \
-        sprintf(BUSFS__converted__ ## orig, "%s%s", BUSFS_REALFS, orig); \
+        snprintf(BUSFS__converted__ ## orig, FILENAME_MAX, "%s%s", \
+                 BusFS_Global.conf.realfs, orig); \
+        busfs_opts_strip(BUSFS__converted__ ## orig); \
         orig = BUSFS__converted__ ## orig;
 
 #define BUSFS_CONVERT_PATH_EX(orig, real) \
         const char *real = orig; \
         BUSFS_CONVERT_PATH(real);
 
+/* Strip any open options from the path, leaving the topic name */
+#define BUSFS_STRIP_OPTS(orig) \
+        char BUSFS__stripped__ ##orig [FILENAME_MAX]; \
+        snprintf(BUSFS__stripped__ ## orig, FILENAME_MAX, "%s", orig); \
+        busfs_opts_strip(BUSFS__stripped__ ## orig); \
+        orig = BUSFS__stripped__ ## orig;
+
 
 void busfs_init(void);
 
@@ -217,13 +840,137 @@ busfs_file busfs_file_get(const char *path, busfs_getflags_t flags);
 void busfs_file_release(busfs_file f, busfs_info_t type);
 
 int busfs_file_rename(busfs_file f, const char *to);
+int busfs_file_configure(busfs_file f, const struct busfs_openopts_st *opts);
+busfs_file busfs_file_partition(busfs_file f, uint32_t idx);
+int busfs_file_expired(busfs_file f, uint64_t now);
+void busfs_file_expire(busfs_file f, uint64_t now);
+void busfs_file_evict(busfs_file f, uint32_t serial);
 int busfs_file_unlink(busfs_file f, const char *path);
+int busfs_file_truncate(busfs_file f, off_t size);
+void busfs_file_place(busfs_file f, int node);
+void busfs_file_notify(busfs_file f);
+int busfs_file_stat(busfs_file f, const char *realpath, struct stat *st);
+int busfs_file_access(busfs_file f, const char *realpath, int mask);
+void busfs_file_invalidate(const char *path);
+
+/* Open options */
+int busfs_opts_parse(const char *path, char *base,
+                     struct busfs_openopts_st *opts);
+void busfs_opts_strip(char *path);
+int busfs_opts_is_merge(const char *path);
+void busfs_opts_clear(struct busfs_openopts_st *opts);
 
 /* Reader Funtions */
-busfs_reader busfs_read_new(busfs_file f, struct fuse_file_info *fi);
-void busfs_read_interrupt_handler(int sig);
+busfs_reader busfs_read_new(busfs_file f, struct fuse_file_info *fi,
+                            const struct busfs_openopts_st *opts);
+
+size_t busfs_read_pop(busfs_reader r, const char *tag,
+                      GString *out, size_t max);
+void busfs_read_detach(busfs_reader r);
+void busfs_read_dump(busfs_file f, uint32_t tail, GString *out);
+void busfs_read_wake(busfs_file f);
+void busfs_read_copy(busfs_file f, busfs_dgram *msg, busfs_zcache *zc,
+                     size_t offset, char *dst, size_t size);
+
+/* Directory reader functions */
+busfs_merge busfs_merge_new(const char *dir, struct fuse_file_info *fi,
+                            const struct busfs_openopts_st *opts);
+void busfs_merge_notify(void);
 
 /* Writer functions */
 busfs_writer busfs_write_new(busfs_file f, struct fuse_file_info *fi);
+void busfs_write_replicated(busfs_file f, uint32_t serial, uint64_t ts,
+                            const char *buf, size_t size);
+void busfs_write_commit_queued(busfs_file f);
+void busfs_write_flush(busfs_file f);
+void busfs_write_drain(busfs_file f);
+
+/* Compression of cold messages */
+void busfs_compress_enable(busfs_file f);
+const char *busfs_dgram_data(busfs_dgram *msg, busfs_zcache *zc);
+void busfs_dgram_prepare(busfs_file f, busfs_dgram *msg);
+void busfs_dgram_release(busfs_file f, busfs_dgram *msg);
+void busfs_dgram_hold(busfs_dgram *msg);
+void busfs_dgram_unhold(busfs_dgram *msg);
+void busfs_zcache_clear(busfs_zcache *zc);
+size_t busfs_lz_compress(const char *src, size_t size, char *dst, size_t cap);
+int busfs_lz_decompress(const char *src, size_t zlen, char *dst, size_t size);
+
+/* Named cursors */
+void busfs_cursor_init(void);
+void busfs_cursor_flush(void);
+int busfs_cursor_lookup(busfs_file f, const char *name,
+                        uint32_t *serial);
+void busfs_cursor_attach(busfs_reader r);
+void busfs_cursor_detach(busfs_reader r);
+void busfs_cursor_dump(busfs_file f, uint32_t tail, GString *out);
+void busfs_cursor_drop(const char *topic);
+void busfs_cursor_rename(const char *from, const char *to);
+
+/* Status files */
+busfs_status busfs_status_new(busfs_file f);
+
+/* Replay files */
+busfs_replay busfs_replay_new(busfs_file f, const char *path,
+                              struct fuse_file_info *fi);
+void busfs_replay_range(busfs_file f, uint64_t *first, uint64_t *end);
+off_t busfs_replay_size(busfs_file f);
+
+/* Exports */
+busfs_export busfs_export_new(busfs_file f);
+off_t busfs_export_size(busfs_file f);
+void busfs_export_preserve(busfs_file f, busfs_dgram *msg);
+
+/* Replication */
+void busfs_repl_start(void);
+void busfs_repl_notify(void);
+int busfs_repl_is_replica(const char *path);
+
+/* NUMA placement */
+int busfs_numa_nodes(void);
+int busfs_numa_bind(int node);
+int busfs_numa_node_of(pid_t pid);
+
+/* Requests, see busfs_ll.c and busfs_loop.c */
+int busfs_loop_run(struct fuse_session *se,
+                   const struct fuse_lowlevel_ops *ops, int debug);
+const struct busfs_request_st *busfs_loop_request(void);
+void busfs_loop_pause(void);
+void busfs_loop_resume(void);
+void busfs_loop_stop(void);
+int busfs_loop_fds(int *fds, int max);
+void busfs_loop_init_request(const char **buf, size_t *len);
+void busfs_ll_interrupt(uint64_t unique);
+int busfs_ll_node(const char *buf, size_t len);
+void busfs_pending_reply(busfs_pending p, const char *buf, int res);
+void busfs_pending_linger(busfs_pending p);
+GList *busfs_ll_take_pending(void);
+void busfs_ll_return_pending(GList *taken);
+void busfs_ll_save(busfs_hbuf hb, GList *taken, const int *fds, int nfds);
+int busfs_ll_restore(busfs_hbuf hb, const int *fds, int nfds);
+
+/* Handover to a new daemon */
+void busfs_handoff_start(void);
+int busfs_handoff_request(const char *path);
+int busfs_handoff_adopted(const int **fds, const char **init,
+                          size_t *init_len);
+void busfs_handoff_restore(void);
+void busfs_handoff_unmount(const char *mountpoint);
+int busfs_handoff_gone(void);
+int busfs_handoff_enter(void);
+void busfs_handoff_leave(void);
+void busfs_handoff_put(busfs_hbuf hb, const void *src, size_t n);
+void busfs_handoff_put_str(busfs_hbuf hb, const char *s, size_t len);
+off_t busfs_handoff_put_begin(busfs_hbuf hb);
+void busfs_handoff_put_end(busfs_hbuf hb, off_t mark);
+int busfs_handoff_get(busfs_hbuf hb, void *dst, size_t n);
+int busfs_handoff_get_span(busfs_hbuf hb, size_t n, const char **out);
+int busfs_handoff_get_str(busfs_hbuf hb, char *dst, size_t size);
+int busfs_handoff_get_part(busfs_hbuf hb, busfs_hbuf part);
+void busfs_handoff_put_handle(busfs_hbuf hb, busfs_common o);
+int busfs_handoff_get_handle(busfs_hbuf hb, busfs_common o);
+
+#define BUSFS_HANDOFF_PUT(hb, v) busfs_handoff_put(hb, &(v), sizeof(v))
+#define BUSFS_HANDOFF_GET(hb, v) busfs_handoff_get(hb, &(v), sizeof(v))
 
 #endif /*BUSFS_H_*/
@@ -0,0 +1,319 @@
+/**
+ * This file contains compression of cold messages. A topic opened as
+ *
+ *  echo -n > 'mountpoint/topic@compress'
+ *
+ * has its older messages packed into compressed blocks by a background
+ * thread every BUSFS_COMPRESS_INTERVAL_MS. The newest quarter of the ring,
+ * where most readers are, is left alone.
+ *
+ * A compressed message gives up its slot buffer, and points into a block
+ * holding up to BUSFS_ZBLOCK_SIZE of consecutive messages instead. Readers
+ * decompress a whole block at a time into their busfs_zcache, so reading
+ * through history costs one decompression per block. The slot gets a buffer
+ * back when it is next written to.
+ */
+
+#include "busfs.h"
+
+/* Most messages which go into a block */
+#define ZBLOCK_MSGS 4096
+
+struct busfs_zblock_st {
+    /* Held by each slot pointing into the block, and by each zcache */
+    gint refcount;
+
+    /* Slots pointing into the block. Protected by buf_rwlock */
+    uint32_t nslots;
+
+    uint32_t rawlen;
+    uint32_t zlen;
+    char data[1];
+};
+
+/* Topics with compression, each holding a reference */
+static struct {
+    pthread_mutex_t mutex;
+    GQueue topics;
+} Compressor = { PTHREAD_MUTEX_INITIALIZER, G_QUEUE_INIT };
+
+static pthread_once_t compressor_once = PTHREAD_ONCE_INIT;
+
+static void zblock_unref(struct busfs_zblock_st *zb)
+{
+    if (g_atomic_int_dec_and_test(&zb->refcount)) {
+        free(zb);
+    }
+}
+
+/**
+ * Get the contents of a message, decompressing its block into zc if it has
+ * been compressed. Must be called with buf_rwlock held, and the result is
+ * valid until it is released or zc is next used.
+ */
+const char *busfs_dgram_data(busfs_dgram *msg, busfs_zcache *zc)
+{
+    struct busfs_zblock_st *zb = msg->zblock;
+
+    if (zb == NULL) {
+        return msg->root;
+    }
+
+    if (zc->block != zb) {
+        if (zc->alloc < zb->rawlen) {
+            zc->buf = realloc(zc->buf, zb->rawlen);
+            zc->alloc = zb->rawlen;
+        }
+
+        if (busfs_lz_decompress(zb->data, zb->zlen,
+                                zc->buf, zb->rawlen) != 0) {
+            LOG_MSG("Corrupt compressed block %p", (void*)zb);
+            memset(zc->buf, 0, zb->rawlen);
+        }
+
+        if (zc->block) {
+            zblock_unref(zc->block);
+        }
+        g_atomic_int_inc(&zb->refcount);
+        zc->block = zb;
+    }
+
+    return zc->buf + msg->zoff;
+}
+
+void busfs_zcache_clear(busfs_zcache *zc)
+{
+    if (zc->block) {
+        zblock_unref(zc->block);
+    }
+    free(zc->buf);
+    memset(zc, 0, sizeof(*zc));
+}
+
+/**
+ * Drop the compressed block of a slot, if it has one. Must be called with
+ * buf_rwlock held for writing.
+ */
+void busfs_dgram_release(busfs_file f, busfs_dgram *msg)
+{
+    struct busfs_zblock_st *zb = msg->zblock;
+
+    if (zb == NULL) {
+        return;
+    }
+
+    f->z.raw_bytes -= msg->msgsize;
+    if (--zb->nslots == 0) {
+        f->z.z_bytes -= zb->zlen;
+    }
+    zblock_unref(zb);
+    msg->zblock = NULL;
+    msg->zoff = 0;
+}
+
+/**
+ * Keep the compressed block of msg, if it has one, for a copy of msg which
+ * is read after buf_rwlock is released. Must be called with buf_rwlock
+ * held, and undone with busfs_dgram_unhold() on the copy.
+ */
+void busfs_dgram_hold(busfs_dgram *msg)
+{
+    if (msg->zblock) {
+        g_atomic_int_inc(&msg->zblock->refcount);
+    }
+}
+
+void busfs_dgram_unhold(busfs_dgram *msg)
+{
+    if (msg->zblock) {
+        zblock_unref(msg->zblock);
+    }
+}
+
+/**
+ * Make a slot ready to be written to, giving it back a buffer if it was
+ * compressed. Must be called with buf_rwlock held for writing.
+ */
+void busfs_dgram_prepare(busfs_file f, busfs_dgram *msg)
+{
+    if (f->exports) {
+        busfs_export_preserve(f, msg);
+    }
+    busfs_dgram_release(f, msg);
+
+    if (msg->root == NULL) {
+        msg->root = malloc(f->dgram_maxlen);
+        msg->msgalloc = f->dgram_maxlen;
+    }
+}
+
+/**
+ * Compress the next run of cold messages of f into a block. Returns 1 if
+ * there may be more to do.
+ */
+static int compress_block(busfs_file f)
+{
+    uint32_t serials[ZBLOCK_MSGS], offsets[ZBLOCK_MSGS], sizes[ZBLOCK_MSGS];
+    GString *raw = g_string_new(NULL);
+    struct busfs_zblock_st *zb;
+    uint32_t serial, limit;
+    size_t ii, count = 0, zlen;
+    int more;
+
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+
+    limit = f->serial - f->dgram_count / 4;
+    serial = f->z.next;
+    if (BUSFS_SERIAL_BEFORE(serial, f->head_serial) ||
+            BUSFS_SERIAL_BEFORE(f->serial, serial)) {
+        /* The ring was truncated, or jumped ahead */
+        serial = f->head_serial;
+    }
+
+    for (; BUSFS_SERIAL_BEFORE(serial, limit) && count < ZBLOCK_MSGS &&
+            raw->len < BUSFS_ZBLOCK_SIZE; serial++) {
+        busfs_dgram *msg = f->dgrams + BUSFS_SERIAL_IDX(f, serial);
+        if (msg->zblock) {
+            continue;
+        }
+
+        serials[count] = serial;
+        offsets[count] = raw->len;
+        sizes[count] = msg->msgsize;
+        g_string_append_len(raw, msg->root, msg->msgsize);
+        count++;
+    }
+
+    more = BUSFS_SERIAL_BEFORE(serial, limit);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    f->z.next = serial;
+
+    if (count == 0) {
+        g_string_free(raw, TRUE);
+        return more;
+    }
+
+    /* Blocks which don't save at least an eighth aren't worth the
+     * decompression */
+    zb = malloc(sizeof(*zb) + raw->len);
+    zlen = busfs_lz_compress(raw->str, raw->len, zb->data,
+                             raw->len - raw->len / 8);
+    if (zlen == 0) {
+        free(zb);
+        g_string_free(raw, TRUE);
+        return more;
+    }
+
+    zb = realloc(zb, sizeof(*zb) + zlen);
+    zb->refcount = 0;
+    zb->nslots = 0;
+    zb->rawlen = raw->len;
+    zb->zlen = zlen;
+    g_string_free(raw, TRUE);
+
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+    for (ii = 0; ii < count; ii++) {
+        busfs_dgram *msg;
+
+        /* Skip messages which were evicted in the meantime */
+        if (BUSFS_SERIAL_BEFORE(serials[ii], f->head_serial) ||
+                !BUSFS_SERIAL_BEFORE(serials[ii], f->serial)) {
+            continue;
+        }
+        msg = f->dgrams + BUSFS_SERIAL_IDX(f, serials[ii]);
+        if (msg->serial != serials[ii] || msg->zblock ||
+                msg->msgsize != sizes[ii]) {
+            continue;
+        }
+
+        if (f->exports) {
+            busfs_export_preserve(f, msg);
+        }
+        free(msg->root);
+        msg->root = NULL;
+        msg->msgalloc = 0;
+        msg->zblock = zb;
+        msg->zoff = offsets[ii];
+        zb->refcount++;
+        zb->nslots++;
+        f->z.raw_bytes += msg->msgsize;
+    }
+
+    if (zb->nslots) {
+        f->z.z_bytes += zb->zlen;
+    } else {
+        free(zb);
+    }
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    return more;
+}
+
+static void compress_topic(busfs_file f)
+{
+    uint32_t ii;
+
+    if (f->nparts) {
+        for (ii = 0; ii < f->nparts; ii++) {
+            compress_topic(f->parts[ii]);
+        }
+        return;
+    }
+
+    while (compress_block(f)) {
+    }
+}
+
+static void *compressor_thread(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        GList *topics, *l;
+
+        usleep(BUSFS_COMPRESS_INTERVAL_MS * 1000);
+
+        pthread_mutex_lock(&Compressor.mutex);
+        topics = g_list_copy(Compressor.topics.head);
+        pthread_mutex_unlock(&Compressor.mutex);
+
+        for (l = topics; l; l = l->next) {
+            busfs_file f = l->data;
+
+            if (f->unlinked) {
+                pthread_mutex_lock(&Compressor.mutex);
+                g_queue_remove(&Compressor.topics, f);
+                pthread_mutex_unlock(&Compressor.mutex);
+                busfs_file_release(f, BUSFS_INFO_NONE);
+                continue;
+            }
+
+            compress_topic(f);
+        }
+        g_list_free(topics);
+    }
+    return NULL;
+}
+
+static void compressor_start(void)
+{
+    pthread_t thr;
+    pthread_create(&thr, NULL, compressor_thread, NULL);
+    pthread_detach(thr);
+}
+
+/**
+ * Have the background thread compress f, and its partitions, from now on.
+ * The thread holds a reference on f until it is unlinked.
+ */
+void busfs_compress_enable(busfs_file f)
+{
+    pthread_once(&compressor_once, compressor_start);
+
+    pthread_rwlock_wrlock(&f->sync.refs_rwlock);
+    f->refcount++;
+    pthread_rwlock_unlock(&f->sync.refs_rwlock);
+
+    pthread_mutex_lock(&Compressor.mutex);
+    g_queue_push_tail(&Compressor.topics, f);
+    pthread_mutex_unlock(&Compressor.mutex);
+}
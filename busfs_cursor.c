@@ -0,0 +1,398 @@
+/**
+ * This file contains named reader cursors. A reader opened as
+ *
+ *  cat 'mountpoint/topic@cursor=NAME'
+ *
+ * starts where the last reader of that name left off. Positions of open
+ * readers are collected by a background thread every
+ * BUSFS_CURSOR_FLUSH_MS, and when they are closed, and written to the
+ * cursor file so that they outlive the daemon.
+ *
+ * The cursor file holds one line per cursor: serial, incarnation, name and
+ * topic, separated by tabs. A saved serial is the next message to deliver,
+ * so a message which was only partly read is delivered again. Serials are
+ * only meaningful for the ring they were read from, so a cursor is ignored
+ * unless the topic's incarnation is the one it was saved with, and cursors
+ * go with their topic when it is unlinked or renamed.
+ */
+
+#include "busfs.h"
+#include "busfs_util.h"
+
+#define _BFG BusFS_Global
+
+/* Where a cursor left off */
+typedef struct {
+    uint32_t serial;
+    uint64_t incarnation;
+} cursor_pos;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Saved cursor_pos, keyed by "topic\tname" */
+    GHashTable *saved;
+
+    /* Open readers with a cursor */
+    GHashTable *readers;
+
+    /* Whether saved differs from the file */
+    int dirty;
+
+    /* Where cursors are kept */
+    char *path;
+} Cursors;
+
+static char *cursor_key(const char *topic, const char *name)
+{
+    return g_strdup_printf("%s\t%s", topic, name);
+}
+
+static cursor_pos *cursor_pos_new(uint32_t serial, uint64_t incarnation)
+{
+    cursor_pos *pos = g_new(cursor_pos, 1);
+
+    pos->serial = serial;
+    pos->incarnation = incarnation;
+    return pos;
+}
+
+/**
+ * If key is that of a cursor of topic or of one of its partitions, return
+ * the part after the topic's name, such as "\tname" or "@2\tname"
+ */
+static const char *cursor_of(const char *key, const char *topic)
+{
+    size_t toplen = strlen(topic);
+    const char *rest = key + toplen;
+
+    if (strncmp(key, topic, toplen) != 0) {
+        return NULL;
+    }
+    if (*rest == '@') {
+        const char *end = rest + 1 + strspn(rest + 1, "0123456789");
+        return (end > rest + 1 && *end == '\t') ? rest : NULL;
+    }
+    return (*rest == '\t') ? rest : NULL;
+}
+
+/**
+ * Move the positions of open readers into the saved table. Must be called
+ * with the mutex held.
+ */
+static void cursor_collect(void)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, Cursors.readers);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        busfs_reader r = key;
+        uint32_t serial = (uint32_t)g_atomic_int_get(&r->next_serial);
+        char *ckey;
+        cursor_pos *old;
+
+        /* Its cursors were dropped along with the topic */
+        if (r->f->unlinked) {
+            continue;
+        }
+
+        ckey = cursor_key(r->f->path, r->opts.cursor);
+        old = g_hash_table_lookup(Cursors.saved, ckey);
+        if (old && old->serial == serial &&
+                old->incarnation == r->f->incarnation) {
+            g_free(ckey);
+            continue;
+        }
+
+        g_hash_table_replace(Cursors.saved, ckey,
+                             cursor_pos_new(serial, r->f->incarnation));
+        Cursors.dirty = 1;
+    }
+}
+
+/**
+ * Write the saved table to a temporary file, and rename it over the cursor
+ * file. Must be called with the mutex held.
+ */
+static void cursor_write(void)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GString *out = g_string_new(NULL);
+    char *tmp = g_strdup_printf("%s.tmp", Cursors.path);
+    FILE *fp;
+
+    g_hash_table_iter_init(&iter, Cursors.saved);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *sep = strchr(key, '\t');
+        cursor_pos *pos = value;
+
+        g_string_append_printf(out, "%u\t%016llx\t%s\t%.*s\n", pos->serial,
+                               (unsigned long long)pos->incarnation, sep + 1,
+                               (int)(sep - (const char*)key),
+                               (const char*)key);
+    }
+
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        LOG_MSG("Couldn't save cursors to %s: %s", tmp, strerror(errno));
+        goto GT_RET;
+    }
+
+    if (fwrite(out->str, 1, out->len, fp) != out->len) {
+        fclose(fp);
+        fp = NULL;
+    }
+    if (fp == NULL || fclose(fp) != 0) {
+        LOG_MSG("Couldn't save cursors to %s", tmp);
+        unlink(tmp);
+        goto GT_RET;
+    }
+
+    if (rename(tmp, Cursors.path) != 0) {
+        LOG_MSG("Couldn't rename %s: %s", tmp, strerror(errno));
+        goto GT_RET;
+    }
+    Cursors.dirty = 0;
+
+    GT_RET:
+    g_free(tmp);
+    g_string_free(out, TRUE);
+}
+
+static void cursor_load(void)
+{
+    gchar *contents = NULL, **lines, **cur;
+
+    if (!g_file_get_contents(Cursors.path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (cur = lines; *cur; cur++) {
+        char *name, *topic, *end, *inc;
+        unsigned long serial = strtoul(*cur, &end, 10);
+        unsigned long long incarnation;
+
+        if (end == *cur || *end != '\t') {
+            continue;
+        }
+        inc = end + 1;
+        incarnation = strtoull(inc, &end, 16);
+
+        /* Lines without an incarnation can't be matched to a topic */
+        if (end == inc || *end != '\t') {
+            continue;
+        }
+        name = end + 1;
+        topic = strchr(name, '\t');
+        if (topic == NULL) {
+            continue;
+        }
+        *(topic++) = '\0';
+
+        g_hash_table_replace(Cursors.saved, cursor_key(topic, name),
+                             cursor_pos_new(serial, incarnation));
+    }
+
+    LOG_MSG("Loaded %u cursors from %s",
+            g_hash_table_size(Cursors.saved), Cursors.path);
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+static void *cursor_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&Cursors.mutex);
+    while (1) {
+        struct timespec timeout;
+        mk_condwait_deadline(&timeout, BUSFS_CURSOR_FLUSH_MS);
+        pthread_cond_timedwait(&Cursors.cond, &Cursors.mutex, &timeout);
+
+        cursor_collect();
+        if (Cursors.dirty) {
+            cursor_write();
+        }
+    }
+    pthread_mutex_unlock(&Cursors.mutex);
+    return NULL;
+}
+
+/**
+ * Load saved cursors and start saving them. Called once the filesystem is
+ * initialized.
+ */
+void busfs_cursor_init(void)
+{
+    pthread_t thr;
+
+    pthread_mutex_init(&Cursors.mutex, NULL);
+    pthread_cond_init(&Cursors.cond, NULL);
+    Cursors.saved = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    Cursors.readers = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (_BFG.conf.cursor_file) {
+        Cursors.path = g_strdup(_BFG.conf.cursor_file);
+    } else {
+        Cursors.path = g_strdup_printf("%s/@cursors", _BFG.conf.realfs);
+    }
+
+    cursor_load();
+    pthread_create(&thr, NULL, cursor_thread, NULL);
+    pthread_detach(thr);
+}
+
+/**
+ * Save cursors now, rather than waiting for the background thread
+ */
+void busfs_cursor_flush(void)
+{
+    pthread_mutex_lock(&Cursors.mutex);
+    cursor_collect();
+    if (Cursors.dirty) {
+        cursor_write();
+    }
+    pthread_mutex_unlock(&Cursors.mutex);
+}
+
+/**
+ * Look up where the last reader of a cursor of f left off. Returns 1 and
+ * sets serial if there is a saved position for this incarnation of f.
+ */
+int busfs_cursor_lookup(busfs_file f, const char *name, uint32_t *serial)
+{
+    char *key = cursor_key(f->path, name);
+    cursor_pos *pos;
+    int found = 0;
+
+    pthread_mutex_lock(&Cursors.mutex);
+    pos = g_hash_table_lookup(Cursors.saved, key);
+    if (pos && pos->incarnation == f->incarnation) {
+        *serial = pos->serial;
+        found = 1;
+    } else if (pos) {
+        LOG_MSG("Ignoring cursor %s, saved for an earlier %s", name, f->path);
+    }
+    pthread_mutex_unlock(&Cursors.mutex);
+
+    g_free(key);
+    return found;
+}
+
+/**
+ * Start saving the position of r, which was opened with a cursor.
+ */
+void busfs_cursor_attach(busfs_reader r)
+{
+    pthread_mutex_lock(&Cursors.mutex);
+    g_hash_table_insert(Cursors.readers, r, r);
+    pthread_mutex_unlock(&Cursors.mutex);
+}
+
+/**
+ * Save the final position of r, which is being closed. It is written out
+ * with the next batch.
+ */
+void busfs_cursor_detach(busfs_reader r)
+{
+    pthread_mutex_lock(&Cursors.mutex);
+    cursor_collect();
+    g_hash_table_remove(Cursors.readers, r);
+    pthread_mutex_unlock(&Cursors.mutex);
+}
+
+/**
+ * Append a line for each cursor of f to out, with the number of messages
+ * between it and the newest message of the topic (tail).
+ */
+void busfs_cursor_dump(busfs_file f, uint32_t tail, GString *out)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    size_t toplen = strlen(f->path);
+
+    pthread_mutex_lock(&Cursors.mutex);
+    cursor_collect();
+
+    g_hash_table_iter_init(&iter, Cursors.saved);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *ckey = key;
+        cursor_pos *pos = value;
+
+        if (strncmp(ckey, f->path, toplen) != 0 || ckey[toplen] != '\t' ||
+                pos->incarnation != f->incarnation) {
+            continue;
+        }
+
+        g_string_append_printf(out, "cursor %s %u %u\n", ckey + toplen + 1,
+                               pos->serial,
+                               BUSFS_SERIAL_BEFORE(pos->serial, tail) ?
+                                       tail - pos->serial : 0);
+    }
+
+    pthread_mutex_unlock(&Cursors.mutex);
+}
+
+/**
+ * Forget the cursors of topic and of its partitions, which has been
+ * unlinked. Readers still open on it don't save theirs any more.
+ */
+void busfs_cursor_drop(const char *topic)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    pthread_mutex_lock(&Cursors.mutex);
+    g_hash_table_iter_init(&iter, Cursors.saved);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (cursor_of(key, topic)) {
+            g_hash_table_iter_remove(&iter);
+            Cursors.dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&Cursors.mutex);
+}
+
+/**
+ * Move the cursors of a topic, and of its partitions, which has been
+ * renamed from one path to another. Positions already saved under the new
+ * name by open readers are newer, and are kept.
+ */
+void busfs_cursor_rename(const char *from, const char *to)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *moved = g_ptr_array_new();
+    guint ii;
+
+    pthread_mutex_lock(&Cursors.mutex);
+    g_hash_table_iter_init(&iter, Cursors.saved);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *rest = cursor_of(key, from);
+
+        if (rest) {
+            g_ptr_array_add(moved, g_strconcat(to, rest, NULL));
+            g_ptr_array_add(moved, value);
+            g_hash_table_iter_steal(&iter);
+            g_free(key);
+        }
+    }
+
+    for (ii = 0; ii < moved->len; ii += 2) {
+        if (g_hash_table_contains(Cursors.saved, moved->pdata[ii])) {
+            g_free(moved->pdata[ii]);
+            g_free(moved->pdata[ii + 1]);
+        } else {
+            g_hash_table_insert(Cursors.saved, moved->pdata[ii],
+                                moved->pdata[ii + 1]);
+        }
+        Cursors.dirty = 1;
+    }
+    pthread_mutex_unlock(&Cursors.mutex);
+    g_ptr_array_free(moved, TRUE);
+}
@@ -0,0 +1,234 @@
+/**
+ * This file contains exports, opened as 'topic@export'. Each open takes a
+ * copy of every committed message in the ring and serves it as an ordinary
+ * file of that size:
+ *
+ *  cp 'mountpoint/topic@export' archive
+ *
+ * The copy holds the same bytes a reader starting at the oldest message
+ * would receive, including length headers, but it is consistent: messages
+ * written or overwritten while it is being read don't show up in it. Reads
+ * are plain copies at their offset, so they may be as large as the kernel
+ * allows, and in any order.
+ *
+ * Writers aren't held up while the copy is taken. Only the slot headers,
+ * and references on compressed blocks, are taken under the lock, and the
+ * messages are copied or decompressed after it is released. A writer
+ * coming round to a slot which an export still needs gives its buffer up
+ * to f->orphans and allocates another. Fixed-record topics keep their
+ * records in place in the arena, so they are copied a chunk at a time
+ * under the read lock, and a writer about to overwrite a record which
+ * hasn't been copied yet copies it into the export itself.
+ */
+
+#include "busfs.h"
+#include "busfs_util.h"
+
+/* How much of a fixed-record topic is copied at a time */
+#define EXPORT_CHUNK (256 * 1024)
+
+/**
+ * Whether ex still needs the message with the given serial. Must be called
+ * with buf_rwlock held.
+ */
+static int export_needs(busfs_export ex, uint32_t serial)
+{
+    return !BUSFS_SERIAL_BEFORE(serial, ex->next) &&
+            BUSFS_SERIAL_BEFORE(serial, ex->end);
+}
+
+void busfs_export_preserve(busfs_file f, busfs_dgram *msg)
+{
+    GList *l;
+
+    for (l = f->exports; l; l = l->next) {
+        busfs_export ex = l->data;
+
+        if (!export_needs(ex, msg->serial)) {
+            continue;
+        }
+
+        if (f->arena) {
+            memcpy(ex->data + (size_t)(msg->serial - ex->first) *
+                   f->record_size, msg->root, f->record_size);
+        } else if (msg->root) {
+            if (f->orphans == NULL) {
+                f->orphans = g_ptr_array_new_with_free_func(free);
+            }
+            g_ptr_array_add(f->orphans, msg->root);
+            msg->root = NULL;
+            msg->msgalloc = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * Copy the records of a fixed-record topic from ex->next on, a chunk under
+ * the read lock at a time. Records whose slot has been written to again
+ * since were copied by the writer.
+ */
+static void export_copy_fixed(busfs_file f, busfs_export ex)
+{
+    size_t chunk = MAX(1, EXPORT_CHUNK / f->record_size);
+
+    while (ex->next != ex->end) {
+        uint32_t stop;
+
+        pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+        stop = ex->next + MIN(chunk, (size_t)(ex->end - ex->next));
+        for (; ex->next != stop; ex->next++) {
+            uint32_t age = f->serial - ex->next;
+            busfs_dgram *msg;
+
+            if (age >= f->dgram_count) {
+                continue;
+            }
+            msg = f->dgrams + (f->curidx + f->dgram_count - age) %
+                    f->dgram_count;
+            memcpy(ex->data + (size_t)(ex->next - ex->first) *
+                   f->record_size, msg->root, f->record_size);
+        }
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    }
+}
+
+/**
+ * Copy the messages whose slot headers are in msgs to ex, now that the lock
+ * is no longer held. Their buffers are kept by the writers, and their
+ * compressed blocks by the headers.
+ */
+static void export_copy(busfs_file f, busfs_export ex,
+                        busfs_dgram *msgs, size_t count)
+{
+    busfs_zcache zc;
+    char *dst = ex->data;
+    size_t ii;
+
+    memset(&zc, 0, sizeof(zc));
+    for (ii = 0; ii < count; ii++) {
+        size_t len = BUSFS_MSG_LENGTH(f, msgs + ii);
+
+        busfs_read_copy(f, msgs + ii, &zc, 0, dst, len);
+        busfs_dgram_unhold(msgs + ii);
+        dst += len;
+    }
+    busfs_zcache_clear(&zc);
+}
+
+/**
+ * Get the size an export of f would have now. Must be called with
+ * buf_rwlock held.
+ */
+static size_t export_size(busfs_file f)
+{
+    return f->dgrams[f->curidx].boff - f->dgrams[f->head_idx].boff;
+}
+
+off_t busfs_export_size(busfs_file f)
+{
+    size_t size;
+
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+    size = export_size(f);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    return size;
+}
+
+static int busfs_export_read(busfs_common o, const char *path,
+                             char *buf, size_t size, off_t offset)
+{
+    busfs_export ex = (busfs_export)o;
+    (void)path;
+
+    if (offset < 0 || (size_t)offset >= ex->size) {
+        return 0;
+    }
+
+    size = MIN(size, ex->size - offset);
+    memcpy(buf, ex->data + offset, size);
+    return size;
+}
+
+static int busfs_export_write(busfs_common o, const char *path,
+                              const char *buf, size_t size, off_t offset)
+{
+    (void)o;
+    (void)path;
+    (void)buf;
+    (void)size;
+    (void)offset;
+    return -EBADF;
+}
+
+static int busfs_export_close(busfs_common o, const char *path)
+{
+    busfs_export ex = (busfs_export)o;
+    (void)path;
+
+    free(ex->data);
+    free(ex);
+    return 0;
+}
+
+/**
+ * Take an export of the committed messages of f. Returns NULL if there
+ * isn't enough memory for the copy.
+ */
+busfs_export busfs_export_new(busfs_file f)
+{
+    busfs_export ex = calloc(1, sizeof(struct busfs_export_st));
+    busfs_dgram *msgs = NULL;
+    size_t count = 0, ii;
+
+    ex->common.read_func = busfs_export_read;
+    ex->common.write_func = busfs_export_write;
+    ex->common.close_func = busfs_export_close;
+    ex->common.type = BUSFS_INFO_EXPORT;
+
+    busfs_write_drain(f);
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+    if (f->retention_ns) {
+        busfs_file_expire(f, busfs_clock_ns());
+    }
+
+    ex->size = export_size(f);
+    ex->data = malloc(ex->size ? ex->size : 1);
+    if (ex->data && f->arena == NULL) {
+        count = f->serial - f->head_serial;
+        msgs = malloc(count * sizeof(*msgs) + 1);
+    }
+    if (ex->data == NULL || (f->arena == NULL && msgs == NULL)) {
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+        LOG_MSG("Couldn't allocate %lu bytes to export %s", ex->size, f->path);
+        free(ex->data);
+        free(ex);
+        return NULL;
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        msgs[ii] = f->dgrams[BUSFS_SERIAL_IDX(f, f->head_serial + ii)];
+        busfs_dgram_hold(msgs + ii);
+    }
+    ex->first = ex->next = f->head_serial;
+    ex->end = f->serial;
+    f->exports = g_list_prepend(f->exports, ex);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    if (f->arena) {
+        export_copy_fixed(f, ex);
+    } else {
+        export_copy(f, ex, msgs, count);
+    }
+    free(msgs);
+
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+    f->exports = g_list_remove(f->exports, ex);
+    if (f->exports == NULL && f->orphans) {
+        g_ptr_array_free(f->orphans, TRUE);
+        f->orphans = NULL;
+    }
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    return ex;
+}
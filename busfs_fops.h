@@ -3,22 +3,26 @@
 
 #include "busfs.h"
 
+/* Adds a directory entry for busfs_op_readdir(), returning 1 when full */
+typedef int (*busfs_fill_dir_t)(void *buf, const char *name,
+                                const struct stat *stbuf, off_t off);
+
 /* boilerplate.c */
-int busfs_op_access(const char *path, int mask);
 int busfs_op_readlink(const char *path, char *buf, size_t size);
-int busfs_op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+int busfs_op_readdir(const char *path, void *buf, busfs_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi);
 int busfs_op_mknod(const char *path, mode_t mode, dev_t rdev);
 int busfs_op_mkdir(const char *path, mode_t mode);
 int busfs_op_rmdir(const char *path);
 int busfs_op_symlink(const char *from, const char *to);
-int busfs_op_rename(const char *from, const char *to);
+int busfs_op_rename(const char *from, const char *to, unsigned int flags);
 int busfs_op_link(const char *from, const char *to);
 int busfs_op_unlink(const char *path);
-int busfs_op_chmod(const char *path, mode_t mode);
-int busfs_op_chown(const char *path, uid_t uid, gid_t gid);
-int busfs_op_truncate(const char *path, off_t size);
-int busfs_op_utimens(const char *path, const struct timespec ts[2]);
+int busfs_op_chmod(const char *path, mode_t mode, struct fuse_file_info *fi);
+int busfs_op_chown(const char *path, uid_t uid, gid_t gid,
+               struct fuse_file_info *fi);
+int busfs_op_utimens(const char *path, const struct timespec ts[2],
+                 struct fuse_file_info *fi);
 int busfs_op_fsync(const char *path, int isdatasync,
              struct fuse_file_info *fi);
 int busfs_op_statfs(const char *path, struct statvfs *stbuf);
@@ -34,13 +38,75 @@ int busfs_op_removexattr(const char *path, const char *name);
 #endif /*HAVE_SETXATTR*/
 
 /* fops.c */
-int busfs_op_getattr(const char *path, struct stat *stbuf);
+int busfs_op_access(const char *path, int mask);
+int busfs_op_getattr(const char *path, struct stat *stbuf,
+                 struct fuse_file_info *fi);
 int busfs_op_open(const char *path, struct fuse_file_info *fi);
+int busfs_op_reopen(const char *path, struct fuse_file_info *fi);
 int busfs_op_read(const char *path, char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi);
 int busfs_op_write(const char *path, const char *buf, size_t size,
              off_t offset, struct fuse_file_info *fi);
+int busfs_op_poll(const char *path, struct fuse_file_info *fi,
+                  struct fuse_pollhandle *ph, unsigned *reventsp);
 int busfs_op_release(const char *path, struct fuse_file_info *fi);
 int busfs_op_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int busfs_op_truncate(const char *path, off_t size,
+                  struct fuse_file_info *fi);
+
+/* busfs_ll.c. Operations on open handles pass a NULL path to the ones
+ * above, which only use fi */
+void busfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void busfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+void busfs_ll_forget_multi(fuse_req_t req, size_t count,
+                           struct fuse_forget_data *forgets);
+void busfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi);
+void busfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                      int to_set, struct fuse_file_info *fi);
+void busfs_ll_readlink(fuse_req_t req, fuse_ino_t ino);
+void busfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode, dev_t rdev);
+void busfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode);
+void busfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+void busfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+void busfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                      const char *name);
+void busfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     fuse_ino_t newparent, const char *newname,
+                     unsigned int flags);
+void busfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                   const char *newname);
+void busfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void busfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info *fi);
+void busfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                    size_t size, off_t off, struct fuse_file_info *fi);
+void busfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi);
+void busfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                    struct fuse_file_info *fi);
+void busfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi);
+void busfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      struct fuse_file_info *fi);
+void busfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi);
+void busfs_ll_statfs(fuse_req_t req, fuse_ino_t ino);
+void busfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask);
+void busfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, struct fuse_file_info *fi);
+void busfs_ll_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                   struct fuse_pollhandle *ph);
+
+#ifdef HAVE_SETXATTR
+void busfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                       const char *value, size_t size, int flags);
+void busfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                       size_t size);
+void busfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size);
+void busfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name);
+#endif /*HAVE_SETXATTR*/
 
 #endif /*BUSFS_FOPS_H_*/
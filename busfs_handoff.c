@@ -0,0 +1,1248 @@
+/**
+ * This file contains the handover of a mounted filesystem to a new daemon,
+ * for upgrades. A daemon mounted with -o handoff=PATH listens on the UNIX
+ * socket PATH. A second daemon started with the same options connects to
+ * it before mounting, and takes over:
+ *
+ *  1. The old daemon stops reading requests, waits for writes and other
+ *     changes to topics to finish, and takes the reads it is keeping.
+ *     Readers waiting in poll(2) are woken, to poll the new daemon.
+ *  2. It writes its topics, the inodes and open handles the kernel knows
+ *     of, and the kept reads into a memfd, and saves its cursors.
+ *  3. The memfd and the /dev/fuse descriptors are passed to the new daemon
+ *     (SCM_RIGHTS), which answers with one byte once it holds them. The
+ *     old daemon then exits without unmounting.
+ *  4. The new daemon sees the socket close, starts its sessions on the
+ *     descriptors it was given, and rebuilds the topics and handles from
+ *     the memfd before serving any request. The kept reads are answered
+ *     on the descriptors they were read from.
+ *
+ * Serials, timestamps and topic settings are kept, so open files read on
+ * from where they were, and followers continue from the serials they hold.
+ * A handle on a topic which can't be opened again under its old name, such
+ * as one renamed since, is dropped, and fails with EBADF.
+ *
+ * The socket is only accessible to the daemon's user, and either side
+ * hangs up on a peer running as anyone else, since whoever connects gets
+ * every message and the mount itself.
+ *
+ * Until the new daemon has answered, the old one carries on if anything
+ * goes wrong. Once it has answered, the new daemon waits for the old one
+ * to exit for as long as that takes, as nobody else serves the mount.
+ */
+
+#define _GNU_SOURCE
+
+#include "busfs.h"
+#include "busfs_util.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+
+#define _BFG BusFS_Global
+
+#define HANDOFF_MAGIC "busfs-h3"
+
+/* Most /dev/fuse descriptors handed over, one per worker */
+#define HANDOFF_MAX_FDS 250
+
+/* Sent by the old daemon if it carries on after all */
+#define HANDOFF_NAK 'X'
+
+/* Settings of a topic, as handed over. Both daemons run on the same host,
+ * so this is in host order */
+typedef struct {
+    uint32_t pathlen;
+    uint32_t framing;
+    uint32_t record_size;
+    uint32_t slots;
+    uint32_t nparts;
+    uint32_t batch_us;
+    uint64_t retention_ns;
+    int32_t numa_node;
+    uint8_t compact;
+    uint8_t compress;
+} handoff_topic;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Writes being committed */
+    unsigned active;
+
+    /* Set while rings are copied, holding back new writes */
+    int frozen;
+
+    /* Set once they have been handed over; writes then fail */
+    int gone;
+
+    /* Received from the previous daemon: the memfd, mapped, what is left
+     * of it to restore, and the /dev/fuse descriptors, the first of which
+     * was mounted */
+    int memfd;
+    void *map;
+    size_t size;
+    struct busfs_hbuf_st hb;
+    int fds[HANDOFF_MAX_FDS];
+    int nfds;
+
+    /* The INIT request the kernel sent the previous daemon, within map */
+    const char *init;
+    size_t init_len;
+} Handoff = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .memfd = -1
+};
+
+/**
+ * Called before committing a write, or anything else which changes what is
+ * handed over. Waits while topics are being handed over, and returns
+ * -ENOTCONN once they have been. Otherwise returns 0, and
+ * busfs_handoff_leave() must be called afterwards.
+ */
+int busfs_handoff_enter(void)
+{
+    int ret = 0;
+
+    if (_BFG.conf.handoff == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&Handoff.mutex);
+    while (Handoff.frozen) {
+        pthread_cond_wait(&Handoff.cond, &Handoff.mutex);
+    }
+    if (Handoff.gone) {
+        ret = -ENOTCONN;
+    } else {
+        Handoff.active++;
+    }
+    pthread_mutex_unlock(&Handoff.mutex);
+    return ret;
+}
+
+void busfs_handoff_leave(void)
+{
+    if (_BFG.conf.handoff == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&Handoff.mutex);
+    if (--Handoff.active == 0) {
+        pthread_cond_broadcast(&Handoff.cond);
+    }
+    pthread_mutex_unlock(&Handoff.mutex);
+}
+
+static void handoff_freeze(void)
+{
+    pthread_mutex_lock(&Handoff.mutex);
+    Handoff.frozen = 1;
+    while (Handoff.active) {
+        pthread_cond_wait(&Handoff.cond, &Handoff.mutex);
+    }
+    pthread_mutex_unlock(&Handoff.mutex);
+}
+
+static void handoff_thaw(int gone)
+{
+    pthread_mutex_lock(&Handoff.mutex);
+    Handoff.frozen = 0;
+    Handoff.gone = gone;
+    pthread_cond_broadcast(&Handoff.cond);
+    pthread_mutex_unlock(&Handoff.mutex);
+}
+
+/**
+ * Whether this daemon has handed the mount over, and must leave it alone
+ */
+int busfs_handoff_gone(void)
+{
+    int gone;
+
+    pthread_mutex_lock(&Handoff.mutex);
+    gone = Handoff.gone;
+    pthread_mutex_unlock(&Handoff.mutex);
+    return gone;
+}
+
+/*
+ * The memfd
+ */
+
+void busfs_handoff_put(busfs_hbuf hb, const void *src, size_t n)
+{
+    if (n) {
+        fwrite(src, 1, n, hb->fp);
+    }
+}
+
+/**
+ * Write len bytes of s, preceded by their length
+ */
+void busfs_handoff_put_str(busfs_hbuf hb, const char *s, size_t len)
+{
+    uint32_t len32 = len;
+
+    BUSFS_HANDOFF_PUT(hb, len32);
+    busfs_handoff_put(hb, s, len);
+}
+
+/**
+ * Start a part which can be skipped whole when reading, see
+ * busfs_handoff_get_part(). Returns the mark to pass to
+ * busfs_handoff_put_end().
+ */
+off_t busfs_handoff_put_begin(busfs_hbuf hb)
+{
+    uint64_t len = 0;
+
+    BUSFS_HANDOFF_PUT(hb, len);
+    return ftello(hb->fp);
+}
+
+void busfs_handoff_put_end(busfs_hbuf hb, off_t mark)
+{
+    off_t end = ftello(hb->fp);
+    uint64_t len = end - mark;
+
+    if (mark < 0 || end < 0 ||
+            fseeko(hb->fp, mark - (off_t)sizeof(len), SEEK_SET) != 0) {
+        return;
+    }
+    BUSFS_HANDOFF_PUT(hb, len);
+    fseeko(hb->fp, end, SEEK_SET);
+}
+
+int busfs_handoff_get(busfs_hbuf hb, void *dst, size_t n)
+{
+    if (hb->left < n) {
+        return -1;
+    }
+    memcpy(dst, hb->p, n);
+    hb->p += n;
+    hb->left -= n;
+    return 0;
+}
+
+int busfs_handoff_get_span(busfs_hbuf hb, size_t n, const char **out)
+{
+    if (hb->left < n) {
+        return -1;
+    }
+    *out = hb->p;
+    hb->p += n;
+    hb->left -= n;
+    return 0;
+}
+
+/**
+ * Read what busfs_handoff_put_str() wrote into dst, NUL terminated
+ */
+int busfs_handoff_get_str(busfs_hbuf hb, char *dst, size_t size)
+{
+    const char *s;
+    uint32_t len;
+
+    if (BUSFS_HANDOFF_GET(hb, len) != 0 || len >= size ||
+            busfs_handoff_get_span(hb, len, &s) != 0) {
+        return -1;
+    }
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    return 0;
+}
+
+/**
+ * Take the part started by busfs_handoff_put_begin() off hb, to be read
+ * from part
+ */
+int busfs_handoff_get_part(busfs_hbuf hb, busfs_hbuf part)
+{
+    uint64_t len;
+
+    memset(part, 0, sizeof(*part));
+    if (BUSFS_HANDOFF_GET(hb, len) != 0 ||
+            busfs_handoff_get_span(hb, len, &part->p) != 0) {
+        return -1;
+    }
+    part->left = len;
+    return 0;
+}
+
+/*
+ * Open handles
+ */
+
+static void put_reader(busfs_hbuf hb, busfs_reader r)
+{
+    gint next_serial = g_atomic_int_get(&r->next_serial);
+    uint64_t offset = r->r_offset;
+
+    BUSFS_HANDOFF_PUT(hb, r->r_serial);
+    BUSFS_HANDOFF_PUT(hb, offset);
+    BUSFS_HANDOFF_PUT(hb, next_serial);
+    BUSFS_HANDOFF_PUT(hb, r->sel);
+    BUSFS_HANDOFF_PUT(hb, r->stats);
+    BUSFS_HANDOFF_PUT(hb, r->pid);
+    if (r->snapshot) {
+        busfs_handoff_put_str(hb, r->snapshot->str + r->snap_off,
+                              r->snapshot->len - r->snap_off);
+    } else {
+        busfs_handoff_put_str(hb, NULL, 0);
+    }
+}
+
+/**
+ * Move r to where the old daemon's reader was. The topic holds the same
+ * serials, and positions which have left the ring are dealt with by the
+ * next read.
+ */
+static int get_reader(busfs_hbuf hb, busfs_reader r)
+{
+    gint next_serial;
+    uint64_t offset;
+    uint32_t serial, snaplen;
+    const char *snap;
+
+    if (BUSFS_HANDOFF_GET(hb, serial) != 0 ||
+            BUSFS_HANDOFF_GET(hb, offset) != 0 ||
+            BUSFS_HANDOFF_GET(hb, next_serial) != 0 ||
+            BUSFS_HANDOFF_GET(hb, r->sel) != 0 ||
+            BUSFS_HANDOFF_GET(hb, r->stats) != 0 ||
+            BUSFS_HANDOFF_GET(hb, r->pid) != 0 ||
+            BUSFS_HANDOFF_GET(hb, snaplen) != 0 ||
+            busfs_handoff_get_span(hb, snaplen, &snap) != 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&r->f->sync.buf_rwlock);
+    r->r_serial = serial;
+    r->r_idx = BUSFS_SERIAL_IDX(r->f, serial);
+    r->ring_gen = r->f->ring_gen;
+    r->r_offset = offset;
+    pthread_rwlock_unlock(&r->f->sync.buf_rwlock);
+    g_atomic_int_set(&r->next_serial, next_serial);
+
+    if (r->snapshot) {
+        g_string_free(r->snapshot, TRUE);
+        r->snapshot = NULL;
+    }
+    if (snaplen) {
+        r->snapshot = g_string_new_len(snap, snaplen);
+    }
+    r->snap_off = 0;
+    return 0;
+}
+
+static void put_merge(busfs_hbuf hb, busfs_merge m)
+{
+    uint32_t ii, nchildren = m->order->len;
+
+    BUSFS_HANDOFF_PUT(hb, m->next);
+    busfs_handoff_put_str(hb, m->pending->str + m->pending_off,
+                          m->pending->len - m->pending_off);
+
+    BUSFS_HANDOFF_PUT(hb, nchildren);
+    for (ii = 0; ii < nchildren; ii++) {
+        busfs_reader r = m->order->pdata[ii];
+        off_t mark;
+
+        busfs_handoff_put_str(hb, r->f->path, strlen(r->f->path));
+        mark = busfs_handoff_put_begin(hb);
+        put_reader(hb, r);
+        busfs_handoff_put_end(hb, mark);
+    }
+}
+
+static int get_merge(busfs_hbuf hb, busfs_merge m)
+{
+    char path[FILENAME_MAX];
+    uint32_t ii, nchildren, len;
+    const char *pending;
+
+    if (BUSFS_HANDOFF_GET(hb, m->next) != 0 ||
+            BUSFS_HANDOFF_GET(hb, len) != 0 ||
+            busfs_handoff_get_span(hb, len, &pending) != 0 ||
+            BUSFS_HANDOFF_GET(hb, nchildren) != 0) {
+        return -1;
+    }
+    g_string_truncate(m->pending, 0);
+    g_string_append_len(m->pending, pending, len);
+    m->pending_off = 0;
+
+    for (ii = 0; ii < nchildren; ii++) {
+        struct busfs_hbuf_st part;
+        busfs_reader r = NULL;
+        guint jj;
+
+        if (busfs_handoff_get_str(hb, path, sizeof(path)) != 0 ||
+                busfs_handoff_get_part(hb, &part) != 0) {
+            return -1;
+        }
+
+        /* Topics which are gone are skipped */
+        for (jj = 0; jj < m->order->len && r == NULL; jj++) {
+            busfs_reader child = m->order->pdata[jj];
+            if (strcmp(child->f->path, path) == 0) {
+                r = child;
+            }
+        }
+        if (r && get_reader(&part, r) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the state of the handle o which isn't rebuilt by opening it again
+ */
+void busfs_handoff_put_handle(busfs_hbuf hb, busfs_common o)
+{
+    uint32_t type = o->type;
+
+    BUSFS_HANDOFF_PUT(hb, type);
+    switch (o->type) {
+    case BUSFS_INFO_READER:
+        put_reader(hb, (busfs_reader)o);
+        break;
+
+    case BUSFS_INFO_WRITER: {
+        busfs_writer w = (busfs_writer)o;
+
+        busfs_handoff_put_str(hb, w->frame, w->frame_len);
+        BUSFS_HANDOFF_PUT(hb, w->frame_err);
+        break;
+    }
+
+    case BUSFS_INFO_MERGE:
+        put_merge(hb, (busfs_merge)o);
+        break;
+
+    case BUSFS_INFO_EXPORT: {
+        busfs_export ex = (busfs_export)o;
+
+        busfs_handoff_put_str(hb, ex->data, ex->size);
+        break;
+    }
+
+    case BUSFS_INFO_CTL: {
+        busfs_status st = (busfs_status)o;
+
+        busfs_handoff_put_str(hb, st->text->str, st->text->len);
+        break;
+    }
+
+    default:
+        /* Replay handles read from the ring, and keep nothing */
+        break;
+    }
+}
+
+/**
+ * Give o, just opened again, the state written by
+ * busfs_handoff_put_handle(). Returns 0, or -1 if it doesn't match.
+ */
+int busfs_handoff_get_handle(busfs_hbuf hb, busfs_common o)
+{
+    const char *data;
+    uint32_t type, len;
+
+    if (BUSFS_HANDOFF_GET(hb, type) != 0 || type != o->type) {
+        return -1;
+    }
+
+    switch (o->type) {
+    case BUSFS_INFO_READER:
+        return get_reader(hb, (busfs_reader)o);
+
+    case BUSFS_INFO_WRITER: {
+        busfs_writer w = (busfs_writer)o;
+
+        if (BUSFS_HANDOFF_GET(hb, len) != 0 ||
+                busfs_handoff_get_span(hb, len, &data) != 0 ||
+                BUSFS_HANDOFF_GET(hb, w->frame_err) != 0) {
+            return -1;
+        }
+        if (len > w->frame_alloc) {
+            w->frame_alloc = len;
+            w->frame = realloc(w->frame, w->frame_alloc);
+        }
+        memcpy(w->frame, data, len);
+        w->frame_len = len;
+        return 0;
+    }
+
+    case BUSFS_INFO_MERGE:
+        return get_merge(hb, (busfs_merge)o);
+
+    case BUSFS_INFO_EXPORT: {
+        busfs_export ex = (busfs_export)o;
+
+        if (BUSFS_HANDOFF_GET(hb, len) != 0 ||
+                busfs_handoff_get_span(hb, len, &data) != 0) {
+            return -1;
+        }
+        free(ex->data);
+        ex->data = malloc(len ? len : 1);
+        memcpy(ex->data, data, len);
+        ex->size = len;
+        return 0;
+    }
+
+    case BUSFS_INFO_CTL: {
+        busfs_status st = (busfs_status)o;
+
+        if (BUSFS_HANDOFF_GET(hb, len) != 0 ||
+                busfs_handoff_get_span(hb, len, &data) != 0) {
+            return -1;
+        }
+        g_string_truncate(st->text, 0);
+        g_string_append_len(st->text, data, len);
+        return 0;
+    }
+
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Sending
+ */
+
+/**
+ * Write the committed messages of f, and the latest message for each key
+ * of a compacted topic. Must be called with buf_rwlock held.
+ */
+static void snapshot_ring(busfs_file f, busfs_hbuf hb)
+{
+    uint32_t serial, count = f->serial - f->head_serial;
+    uint64_t boff = f->dgrams[f->head_idx].boff;
+    busfs_zcache zc;
+
+    memset(&zc, 0, sizeof(zc));
+    BUSFS_HANDOFF_PUT(hb, f->incarnation);
+    BUSFS_HANDOFF_PUT(hb, f->head_serial);
+    BUSFS_HANDOFF_PUT(hb, count);
+    BUSFS_HANDOFF_PUT(hb, boff);
+
+    for (serial = f->head_serial; serial != f->serial; serial++) {
+        busfs_dgram *msg = f->dgrams + BUSFS_SERIAL_IDX(f, serial);
+
+        BUSFS_HANDOFF_PUT(hb, msg->ts);
+        BUSFS_HANDOFF_PUT(hb, msg->msgsize);
+        busfs_handoff_put(hb, busfs_dgram_data(msg, &zc), msg->msgsize);
+    }
+    busfs_zcache_clear(&zc);
+
+    count = f->latest ? g_hash_table_size(f->latest) : 0;
+    BUSFS_HANDOFF_PUT(hb, count);
+
+    if (f->latest) {
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init(&iter, f->latest);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            busfs_latest *latest = value;
+            uint32_t keylen = strlen(key);
+
+            BUSFS_HANDOFF_PUT(hb, keylen);
+            busfs_handoff_put(hb, key, keylen);
+            BUSFS_HANDOFF_PUT(hb, latest->serial);
+            BUSFS_HANDOFF_PUT(hb, latest->msgsize);
+            busfs_handoff_put(hb, latest->root, latest->msgsize);
+        }
+    }
+}
+
+static void snapshot_topic(busfs_file f, busfs_hbuf hb)
+{
+    handoff_topic hdr;
+    uint32_t ii;
+
+    /* Queued writes have been acknowledged, so they go along */
+    busfs_write_drain(f);
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+    busfs_write_commit_queued(f);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.pathlen = strlen(f->path);
+    hdr.framing = f->framing;
+    hdr.record_size = f->record_size;
+    hdr.slots = f->dgram_count;
+    hdr.nparts = f->nparts;
+    hdr.batch_us = f->pubq.window_ns / 1000;
+    hdr.retention_ns = f->retention_ns;
+    hdr.numa_node = f->numa_node;
+    hdr.compact = f->latest != NULL;
+    hdr.compress = f->z.enabled;
+
+    BUSFS_HANDOFF_PUT(hb, hdr);
+    busfs_handoff_put(hb, f->path, hdr.pathlen);
+
+    if (f->nparts == 0) {
+        snapshot_ring(f, hb);
+    }
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    for (ii = 0; ii < hdr.nparts; ii++) {
+        busfs_file part = f->parts[ii];
+        pthread_rwlock_rdlock(&part->sync.buf_rwlock);
+        snapshot_ring(part, hb);
+        pthread_rwlock_unlock(&part->sync.buf_rwlock);
+    }
+
+    /* Readers waiting in poll(2) ask again, and are answered by the new
+     * daemon. Kept reads have already been taken */
+    busfs_read_wake(f);
+    for (ii = 0; ii < hdr.nparts; ii++) {
+        busfs_read_wake(f->parts[ii]);
+    }
+}
+
+/**
+ * Write the INIT request, every topic, and the handles and reads of
+ * busfs_ll.c to memfd. fds are the devices being handed over. Returns 0,
+ * or -1.
+ */
+static int handoff_snapshot(int memfd, GList *taken, const int *fds, int nfds)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GPtrArray *topics = g_ptr_array_new();
+    struct busfs_hbuf_st hb;
+    const char *init;
+    size_t init_len;
+    uint32_t ntopics;
+    int dupfd = dup(memfd), ret = -1;
+    guint ii;
+
+    memset(&hb, 0, sizeof(hb));
+    hb.fp = (dupfd < 0) ? NULL : fdopen(dupfd, "w");
+    if (hb.fp == NULL) {
+        LOG_MSG("Couldn't write handoff: %s", strerror(errno));
+        if (dupfd >= 0) {
+            close(dupfd);
+        }
+        g_ptr_array_free(topics, TRUE);
+        return -1;
+    }
+
+    busfs_handoff_put(&hb, HANDOFF_MAGIC, strlen(HANDOFF_MAGIC));
+    busfs_loop_init_request(&init, &init_len);
+    busfs_handoff_put_str(&hb, init, init_len);
+
+    pthread_rwlock_rdlock(&_BFG.lock);
+    g_hash_table_iter_init(&iter, _BFG.ht);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        busfs_file f = value;
+
+        if (f->unlinked) {
+            continue;
+        }
+        pthread_rwlock_wrlock(&f->sync.refs_rwlock);
+        f->refcount++;
+        pthread_rwlock_unlock(&f->sync.refs_rwlock);
+        g_ptr_array_add(topics, f);
+    }
+    pthread_rwlock_unlock(&_BFG.lock);
+
+    ntopics = topics->len;
+    BUSFS_HANDOFF_PUT(&hb, ntopics);
+    for (ii = 0; ii < topics->len; ii++) {
+        snapshot_topic(topics->pdata[ii], &hb);
+        busfs_file_release(topics->pdata[ii], BUSFS_INFO_NONE);
+    }
+    g_ptr_array_free(topics, TRUE);
+
+    busfs_ll_save(&hb, taken, fds, nfds);
+
+    if (fflush(hb.fp) == 0 && !ferror(hb.fp)) {
+        LOG_MSG("Handing over %u topics in %lld bytes", ntopics,
+                (long long)ftello(hb.fp));
+        ret = 0;
+    } else {
+        LOG_MSG("Couldn't write handoff: %s", strerror(errno));
+    }
+    fclose(hb.fp);
+    return ret;
+}
+
+/**
+ * Hand the mount over to the daemon connected on fd. Returns 0 once it
+ * has it; this daemon must then exit without touching the mount.
+ */
+static int handoff_send(int fd)
+{
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * (HANDOFF_MAX_FDS + 1))];
+    char byte = 'H';
+    int fds[HANDOFF_MAX_FDS + 1], nfds, ret = -1;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    GList *taken, *l;
+
+    /* Nothing is read from the devices, and nothing changes, from here */
+    busfs_loop_pause();
+    handoff_freeze();
+    taken = busfs_ll_take_pending();
+
+    fds[0] = memfd_create("busfs-handoff", MFD_CLOEXEC);
+    nfds = busfs_loop_fds(fds + 1, HANDOFF_MAX_FDS);
+    if (fds[0] < 0 || handoff_snapshot(fds[0], taken, fds + 1, nfds) != 0) {
+        goto GT_RET;
+    }
+    busfs_cursor_flush();
+
+    memset(&mh, 0, sizeof(mh));
+    memset(cmsgbuf, 0, sizeof(cmsgbuf));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgbuf;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * (nfds + 1));
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (nfds + 1));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (nfds + 1));
+
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) != 1) {
+        LOG_MSG("Couldn't send handoff: %s", strerror(errno));
+        goto GT_RET;
+    }
+
+    /* Until the new daemon has everything, this one carries on if it goes
+     * away */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, BUSFS_HANDOFF_TIMEOUT_MS) == 1 &&
+            read(fd, &byte, 1) == 1 && byte == 'A') {
+        ret = 0;
+    } else {
+        LOG_MSG("New daemon didn't take over; carrying on");
+
+        /* In case it answers after all */
+        byte = HANDOFF_NAK;
+        send(fd, &byte, 1, MSG_NOSIGNAL);
+    }
+
+    GT_RET:
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (ret == 0) {
+        /* The new daemon answers them */
+        for (l = taken; l; l = l->next) {
+            free(l->data);
+        }
+        g_list_free(taken);
+    } else {
+        busfs_ll_return_pending(taken);
+    }
+    handoff_thaw(ret == 0);
+    if (ret != 0) {
+        busfs_loop_resume();
+    }
+    return ret;
+}
+
+static int handoff_socket(const char *path, struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+}
+
+/**
+ * Whether the process at the other end of fd runs as the same user as
+ * this one
+ */
+static int handoff_peer_ok(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return 0;
+    }
+    return cred.uid == geteuid();
+}
+
+static void *handoff_thread(void *arg)
+{
+    int lfd = (int)(intptr_t)arg;
+
+    while (1) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            LOG_MSG("Handoff socket failed: %s", strerror(errno));
+            break;
+        }
+
+        if (!handoff_peer_ok(fd)) {
+            LOG_MSG("Refusing a handoff to another user");
+            close(fd);
+            continue;
+        }
+
+        LOG_MSG("New daemon is taking over");
+        if (handoff_send(fd) == 0) {
+            /* fd stays open until this process exits, which tells the new
+             * daemon to start */
+            close(lfd);
+            busfs_loop_stop();
+            return NULL;
+        }
+        close(fd);
+    }
+
+    close(lfd);
+    return NULL;
+}
+
+/**
+ * Listen for a new daemon to hand the mount over to. Called once the
+ * filesystem is initialized.
+ */
+void busfs_handoff_start(void)
+{
+    struct sockaddr_un sun;
+    struct stat st;
+    pthread_t thr;
+    const char *path = _BFG.conf.handoff;
+    mode_t mask;
+    int lfd, ret;
+
+    if (path == NULL) {
+        return;
+    }
+
+    lfd = handoff_socket(path, &sun);
+    if (lfd < 0) {
+        LOG_MSG("Couldn't listen on %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* Only a socket left by an earlier daemon is replaced */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            LOG_MSG("Couldn't listen on %s: not a socket", path);
+            close(lfd);
+            return;
+        }
+        unlink(path);
+    }
+
+    /* Created 0600, so that other users can't connect */
+    mask = umask(0177);
+    ret = bind(lfd, (struct sockaddr*)&sun, sizeof(sun));
+    umask(mask);
+    if (ret != 0 || listen(lfd, 1) != 0) {
+        LOG_MSG("Couldn't listen on %s: %s", path, strerror(errno));
+        close(lfd);
+        return;
+    }
+
+    pthread_create(&thr, NULL, handoff_thread, (void*)(intptr_t)lfd);
+    pthread_detach(thr);
+}
+
+/*
+ * Receiving
+ */
+
+static void handoff_close(void)
+{
+    int ii;
+
+    if (Handoff.map) {
+        munmap(Handoff.map, Handoff.size);
+        Handoff.map = NULL;
+    }
+    if (Handoff.memfd >= 0) {
+        close(Handoff.memfd);
+        Handoff.memfd = -1;
+    }
+    for (ii = 0; ii < Handoff.nfds; ii++) {
+        close(Handoff.fds[ii]);
+    }
+    Handoff.nfds = 0;
+}
+
+/**
+ * Map the memfd received, and check that it can be restored. Returns 0 or
+ * -1.
+ */
+static int handoff_map(void)
+{
+    struct stat sb;
+    uint32_t len;
+
+    if (fstat(Handoff.memfd, &sb) != 0 || sb.st_size == 0) {
+        return -1;
+    }
+    Handoff.map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+                       Handoff.memfd, 0);
+    if (Handoff.map == MAP_FAILED) {
+        Handoff.map = NULL;
+        return -1;
+    }
+    Handoff.size = sb.st_size;
+    Handoff.hb.p = Handoff.map;
+    Handoff.hb.left = Handoff.size;
+
+    if (Handoff.hb.left < strlen(HANDOFF_MAGIC) ||
+            memcmp(Handoff.hb.p, HANDOFF_MAGIC, strlen(HANDOFF_MAGIC)) != 0) {
+        fprintf(stderr, "busfs: handoff from an incompatible daemon\n");
+        return -1;
+    }
+    Handoff.hb.p += strlen(HANDOFF_MAGIC);
+    Handoff.hb.left -= strlen(HANDOFF_MAGIC);
+
+    if (BUSFS_HANDOFF_GET(&Handoff.hb, len) != 0 ||
+            busfs_handoff_get_span(&Handoff.hb, len, &Handoff.init) != 0) {
+        return -1;
+    }
+    Handoff.init_len = len;
+    return 0;
+}
+
+/**
+ * Take the mount over from a daemon listening on path, if there is one.
+ * Returns once it has exited, with 0, or -1 if the handover failed. This
+ * is called before mounting, and so before logging is set up.
+ */
+int busfs_handoff_request(const char *path)
+{
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * (HANDOFF_MAX_FDS + 1))], byte;
+    int fds[HANDOFF_MAX_FDS + 1], nfds = 0, fd, ii, ret = -1;
+    struct sockaddr_un sun;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t res;
+
+    fd = handoff_socket(path, &sun);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+        /* Nothing running; start afresh */
+        close(fd);
+        return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+    }
+
+    if (!handoff_peer_ok(fd)) {
+        fprintf(stderr, "busfs: %s belongs to another user\n", path);
+        goto GT_RET;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgbuf;
+    mh.msg_controllen = sizeof(cmsgbuf);
+
+    res = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    cmsg = (res == 1) ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    }
+
+    /* The memfd, and at least the device which was mounted */
+    if (nfds < 2 || (mh.msg_flags & MSG_CTRUNC)) {
+        fprintf(stderr, "busfs: incomplete handoff\n");
+        for (ii = 0; ii < nfds; ii++) {
+            close(fds[ii]);
+        }
+        goto GT_RET;
+    }
+    Handoff.memfd = fds[0];
+    Handoff.nfds = nfds - 1;
+    memcpy(Handoff.fds, fds + 1, sizeof(int) * Handoff.nfds);
+
+    if (handoff_map() != 0) {
+        handoff_close();
+        goto GT_RET;
+    }
+
+    byte = 'A';
+    if (write(fd, &byte, 1) != 1) {
+        handoff_close();
+        goto GT_RET;
+    }
+
+    /* The old daemon has given up the mount, or is about to, and only
+     * exits when it has. Nobody else will serve it, so there is no giving
+     * up here */
+    while (1) {
+        res = read(fd, &byte, 1);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res == 1 && byte == HANDOFF_NAK) {
+            /* It timed out, and carries on */
+            fprintf(stderr, "busfs: the old daemon carried on\n");
+            handoff_close();
+        } else if (res != 1) {
+            ret = 0;
+        } else {
+            continue;
+        }
+        break;
+    }
+
+    GT_RET:
+    close(fd);
+    return ret;
+}
+
+/**
+ * The /dev/fuse descriptors taken over, the first of which is to be
+ * mounted, and the INIT request they were started with. Returns how many
+ * there are, or 0 if nothing was taken over.
+ */
+int busfs_handoff_adopted(const int **fds, const char **init,
+                          size_t *init_len)
+{
+    if (fds) {
+        *fds = Handoff.fds;
+    }
+    if (init) {
+        *init = Handoff.init;
+    }
+    if (init_len) {
+        *init_len = Handoff.init_len;
+    }
+    return Handoff.nfds;
+}
+
+/**
+ * Unmount a mount which was taken over. The library didn't mount it, and
+ * doesn't unmount it.
+ */
+void busfs_handoff_unmount(const char *mountpoint)
+{
+    int status;
+    pid_t pid;
+
+    if (umount2(mountpoint, MNT_DETACH) == 0) {
+        return;
+    }
+
+    /* Not privileged; fusermount3 is setuid */
+    pid = fork();
+    if (pid == 0) {
+        execlp("fusermount3", "fusermount3", "-u", "-z", "--", mountpoint,
+               (char*)NULL);
+        _exit(127);
+    }
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+}
+
+static int restore_ring(busfs_file f, busfs_hbuf c)
+{
+    uint32_t serial, count, ii;
+    uint64_t incarnation, boff, ts = 0;
+    busfs_dgram *msg;
+    int ret = -1;
+
+    if (busfs_handoff_get(c, &incarnation, sizeof(incarnation)) != 0 ||
+            busfs_handoff_get(c, &serial, sizeof(serial)) != 0 ||
+            busfs_handoff_get(c, &count, sizeof(count)) != 0 ||
+            busfs_handoff_get(c, &boff, sizeof(boff)) != 0) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+
+    /* Continue from the old daemon's serials and offsets, which its saved
+     * cursors refer to */
+    f->incarnation = incarnation;
+    msg = f->dgrams + f->curidx;
+    f->serial = serial;
+    f->head_serial = serial;
+    f->head_idx = f->curidx;
+    msg->serial = serial;
+    msg->msgsize = 0;
+    msg->boff = boff;
+
+    for (ii = 0; ii < count; ii++) {
+        uint32_t len;
+        const char *data;
+
+        if (busfs_handoff_get(c, &ts, sizeof(ts)) != 0 || busfs_handoff_get(c, &len, sizeof(len)) != 0 ||
+                busfs_handoff_get_span(c, len, &data) != 0 ||
+                (f->record_size && len != f->record_size)) {
+            goto GT_RET;
+        }
+        busfs_write_replicated(f, serial + ii, ts, data, len);
+    }
+
+    if (busfs_handoff_get(c, &count, sizeof(count)) != 0 || (count && !f->latest)) {
+        goto GT_RET;
+    }
+
+    /* Including keys whose messages have left the ring */
+    for (ii = 0; ii < count; ii++) {
+        uint32_t keylen, lserial, len;
+        const char *key, *data;
+        busfs_latest *latest;
+
+        if (busfs_handoff_get(c, &keylen, sizeof(keylen)) != 0 ||
+                busfs_handoff_get_span(c, keylen, &key) != 0 ||
+                busfs_handoff_get(c, &lserial, sizeof(lserial)) != 0 ||
+                busfs_handoff_get(c, &len, sizeof(len)) != 0 ||
+                busfs_handoff_get_span(c, len, &data) != 0) {
+            goto GT_RET;
+        }
+
+        latest = g_malloc(sizeof(*latest) + len);
+        latest->serial = lserial;
+        latest->msgsize = len;
+        memcpy(latest->root, data, len);
+        g_hash_table_replace(f->latest, g_strndup(key, keylen), latest);
+    }
+
+    if (ts) {
+        f->mtime = BUSFS_CLOCK_TO_TIME(ts);
+    }
+    ret = 0;
+
+    GT_RET:
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    return ret;
+}
+
+static int restore_topic(busfs_hbuf c, const handoff_topic *hdr)
+{
+    struct busfs_openopts_st opts;
+    char path[FILENAME_MAX];
+    const char *name;
+    busfs_file f;
+    uint32_t ii;
+    int ret = -1;
+
+    if (hdr->pathlen >= sizeof(path) || busfs_handoff_get_span(c, hdr->pathlen, &name)) {
+        return -1;
+    }
+    memcpy(path, name, hdr->pathlen);
+    path[hdr->pathlen] = '\0';
+
+    memset(&opts, 0, sizeof(opts));
+    opts.configure = BUSFS_CONFf_FRAMING|BUSFS_CONFf_COMPACT|
+            BUSFS_CONFf_RETENTION|BUSFS_CONFf_BATCH|BUSFS_CONFf_SLOTS;
+    opts.framing = hdr->framing;
+    opts.record_size = hdr->record_size;
+    opts.compact = hdr->compact;
+    opts.retention_ms = hdr->retention_ns / 1000000;
+    opts.batch_us = hdr->batch_us;
+    opts.slots = hdr->slots;
+    if (hdr->nparts) {
+        opts.configure |= BUSFS_CONFf_PARTITIONS;
+        opts.partitions = hdr->nparts;
+    }
+    if (hdr->numa_node >= 0) {
+        opts.configure |= BUSFS_CONFf_NUMA;
+        opts.numa_node = hdr->numa_node;
+    }
+    if (hdr->compress) {
+        opts.configure |= BUSFS_CONFf_COMPRESS;
+        opts.compress = 1;
+    }
+
+    f = busfs_file_get(path, BUSFS_GETf_CREATE|BUSFS_GETf_INC);
+    if (f == NULL) {
+        return -1;
+    }
+    if (busfs_file_configure(f, &opts) != 0) {
+        LOG_MSG("Couldn't configure %s", path);
+        goto GT_RET;
+    }
+
+    if (hdr->nparts == 0) {
+        ret = restore_ring(f, c);
+    } else {
+        for (ii = 0, ret = 0; ii < hdr->nparts && ret == 0; ii++) {
+            ret = restore_ring(f->parts[ii], c);
+        }
+    }
+
+    GT_RET:
+    busfs_file_release(f, BUSFS_INFO_NONE);
+    return ret;
+}
+
+/**
+ * Rebuild the topics, inodes, open handles and kept reads received by
+ * busfs_handoff_request(), if any. Called once the filesystem and cursors
+ * are initialized, before any request is read.
+ */
+void busfs_handoff_restore(void)
+{
+    busfs_hbuf c = &Handoff.hb;
+    uint32_t ntopics, ii;
+
+    if (Handoff.map == NULL) {
+        return;
+    }
+
+    if (busfs_handoff_get(c, &ntopics, sizeof(ntopics)) != 0) {
+        ntopics = 0;
+    }
+
+    for (ii = 0; ii < ntopics; ii++) {
+        handoff_topic hdr;
+
+        if (busfs_handoff_get(c, &hdr, sizeof(hdr)) != 0 ||
+                restore_topic(c, &hdr)) {
+            LOG_MSG("Corrupt handoff after %u topics", ii);
+            break;
+        }
+    }
+    LOG_MSG("Took over %u of %u topics", ii, ntopics);
+
+    if (ii == ntopics &&
+            busfs_ll_restore(c, Handoff.fds, Handoff.nfds) != 0) {
+        LOG_MSG("Corrupt handoff of open files");
+    }
+
+    /* The devices are the sessions' now */
+    munmap(Handoff.map, Handoff.size);
+    Handoff.map = NULL;
+    Handoff.init = NULL;
+    close(Handoff.memfd);
+    Handoff.memfd = -1;
+}
@@ -0,0 +1,1592 @@
+/**
+ * This file contains the low-level FUSE operations. They keep the table of
+ * inodes the kernel knows about, turn inodes back into the paths which the
+ * operations in fops.c and boilerplate.c take, and answer each request.
+ *
+ * A read(2) which has to wait for messages doesn't wait on its worker
+ * thread. The handle's wait_func keeps it, as a busfs_pending, until a
+ * writer commits, a batching reader has lingered long enough, or the
+ * request is interrupted, and it is then answered from that thread.
+ *
+ * Inodes, open handles and kept reads are all in tables here, so that
+ * they can be handed over to a new daemon along with the /dev/fuse
+ * descriptors, see busfs_handoff.c.
+ */
+
+#include "busfs.h"
+#include "busfs_fops.h"
+#include "busfs_util.h"
+
+#include <sys/uio.h>
+#include <linux/fuse.h>
+
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+#define _BFG BusFS_Global
+
+/* Interrupts are remembered for this long, in case they arrive before the
+ * request they are for */
+#define LL_INTERRUPT_KEEP_NS 1000000000ULL
+
+/* How soon to look again at a lingering read which was busy */
+#define LL_LINGER_RETRY_NS 1000000ULL
+
+/**
+ * An inode the kernel has looked up. Names are kept rather than paths, so
+ * that renaming a directory moves everything under it.
+ */
+typedef struct ll_node_st *ll_node;
+struct ll_node_st {
+    fuse_ino_t ino;
+    uint64_t nlookup;
+    fuse_ino_t parent;
+
+    /* "<parent>/<name>", the key in Nodes.names, or NULL once unlinked */
+    char *key;
+    const char *name;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+
+    /* By inode number, and by parent and name */
+    GHashTable *inodes;
+    GHashTable *names;
+
+    /* Inode numbers aren't reused, so a stale one is never mistaken for
+     * another file */
+    fuse_ino_t next_ino;
+} Nodes = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .next_ino = FUSE_ROOT_ID + 1
+};
+
+/**
+ * An open file or directory. The kernel knows it by fh rather than by a
+ * pointer, so that it can be opened again under the same fh by a new
+ * daemon.
+ */
+typedef struct ll_handle_st *ll_handle;
+struct ll_handle_st {
+    uint64_t fh;
+
+    /* What was opened, with any options, and how */
+    char *path;
+    int flags;
+
+    /* The busfs_common of a file, or the GPtrArray of ll_dirents read
+     * when a directory was opened */
+    void *obj;
+    int is_dir;
+};
+
+static struct {
+    pthread_rwlock_t lock;
+
+    /* By fh */
+    GHashTable *table;
+    uint64_t next_fh;
+} Handles = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .next_fh = 1
+};
+
+static struct {
+    pthread_mutex_t mutex;
+
+    /* Reads being looked at or kept, by unique */
+    GHashTable *reads;
+
+    /* Interrupts for requests which weren't found, by unique, with the
+     * time they arrived */
+    GHashTable *early;
+
+    /* Reads of batching readers which are lingering, by unique, and the
+     * thread which looks at them again when their time is up */
+    GHashTable *lingering;
+    pthread_cond_t linger_cond;
+    pthread_t linger_thread;
+    int linger_started;
+} Pending = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void ll_init_tables(void)
+{
+    ll_node root = calloc(1, sizeof(struct ll_node_st));
+    pthread_condattr_t attr;
+
+    root->ino = FUSE_ROOT_ID;
+    root->nlookup = 1;
+    root->key = g_strdup("");
+    root->name = root->key;
+
+    Nodes.inodes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    Nodes.names = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(Nodes.inodes, &root->ino, root);
+
+    Handles.table = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    Pending.reads = g_hash_table_new(g_int64_hash, g_int64_equal);
+    Pending.early = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                          g_free, g_free);
+    Pending.lingering = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Pending.linger_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void ll_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, ll_init_tables);
+}
+
+/*
+ * Inodes
+ */
+
+static char *node_key(fuse_ino_t parent, const char *name)
+{
+    return g_strdup_printf("%llu/%s", (unsigned long long)parent, name);
+}
+
+static ll_node node_get(fuse_ino_t ino)
+{
+    uint64_t key = ino;
+    return g_hash_table_lookup(Nodes.inodes, &key);
+}
+
+/**
+ * Write the path of ino, relative to the mountpoint, to buf. Returns 0, or
+ * -ENOENT if ino was forgotten or unlinked.
+ */
+static int node_path(fuse_ino_t ino, char *buf, size_t size)
+{
+    char tmp[FILENAME_MAX];
+    ll_node n;
+    int ret = 0;
+
+    if (ino == FUSE_ROOT_ID) {
+        snprintf(buf, size, "/");
+        return 0;
+    }
+
+    buf[0] = '\0';
+    pthread_mutex_lock(&Nodes.mutex);
+    while (ino != FUSE_ROOT_ID) {
+        n = node_get(ino);
+        if (n == NULL || n->key == NULL) {
+            ret = -ENOENT;
+            break;
+        }
+        snprintf(tmp, sizeof(tmp), "/%s%s", n->name, buf);
+        snprintf(buf, size, "%s", tmp);
+        ino = n->parent;
+    }
+    pthread_mutex_unlock(&Nodes.mutex);
+    return ret;
+}
+
+/**
+ * The path of name within the directory parent
+ */
+static int child_path(fuse_ino_t parent, const char *name,
+                      char *buf, size_t size)
+{
+    char dir[FILENAME_MAX];
+    int ret = node_path(parent, dir, sizeof(dir));
+
+    if (ret == 0) {
+        snprintf(buf, size, "%s%s%s", dir,
+                 (parent == FUSE_ROOT_ID) ? "" : "/", name);
+    }
+    return ret;
+}
+
+/**
+ * Count a lookup of name within parent, adding it to the table if it is
+ * new. Returns its inode number.
+ */
+static fuse_ino_t node_lookup(fuse_ino_t parent, const char *name)
+{
+    char *key = node_key(parent, name);
+    ll_node n;
+
+    pthread_mutex_lock(&Nodes.mutex);
+    n = g_hash_table_lookup(Nodes.names, key);
+    if (n) {
+        g_free(key);
+    } else {
+        n = calloc(1, sizeof(struct ll_node_st));
+        n->ino = Nodes.next_ino++;
+        n->parent = parent;
+        n->key = key;
+        n->name = strchr(key, '/') + 1;
+        g_hash_table_insert(Nodes.inodes, &n->ino, n);
+        g_hash_table_insert(Nodes.names, n->key, n);
+    }
+    n->nlookup++;
+    pthread_mutex_unlock(&Nodes.mutex);
+    return n->ino;
+}
+
+/**
+ * Take name within parent out of the table, so that its inode no longer
+ * has a path. Must be called with Nodes.mutex held.
+ */
+static void node_detach(fuse_ino_t parent, const char *name)
+{
+    char *key = node_key(parent, name);
+    ll_node n = g_hash_table_lookup(Nodes.names, key);
+
+    if (n) {
+        g_hash_table_remove(Nodes.names, n->key);
+        g_free(n->key);
+        n->key = NULL;
+        n->name = NULL;
+    }
+    g_free(key);
+}
+
+static void node_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+    ll_node n;
+
+    pthread_mutex_lock(&Nodes.mutex);
+    n = node_get(ino);
+    if (n && ino != FUSE_ROOT_ID) {
+        n->nlookup -= MIN(n->nlookup, nlookup);
+        if (n->nlookup == 0) {
+            g_hash_table_remove(Nodes.inodes, &n->ino);
+            if (n->key) {
+                g_hash_table_remove(Nodes.names, n->key);
+                g_free(n->key);
+            }
+            free(n);
+        }
+    }
+    pthread_mutex_unlock(&Nodes.mutex);
+}
+
+/**
+ * Answer a lookup, or the creation of a file, with path and its attributes
+ * as name within parent.
+ */
+static int make_entry(fuse_ino_t parent, const char *name, const char *path,
+                      struct fuse_file_info *fi, struct fuse_entry_param *e)
+{
+    int res;
+
+    memset(e, 0, sizeof(*e));
+    res = busfs_op_getattr(path, &e->attr, fi);
+    if (res != 0) {
+        return res;
+    }
+
+    e->ino = node_lookup(parent, name);
+    e->attr.st_ino = e->ino;
+    e->entry_timeout = _BFG.conf.entry_timeout;
+    e->attr_timeout = _BFG.conf.attr_timeout;
+    return 0;
+}
+
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        const char *path)
+{
+    struct fuse_entry_param e;
+    int res = make_entry(parent, name, path, NULL, &e);
+
+    if (res == 0) {
+        fuse_reply_entry(req, &e);
+    } else {
+        fuse_reply_err(req, -res);
+    }
+}
+
+/*
+ * Handles
+ */
+
+/**
+ * Add the handle which was just opened as path, with its object in fi->fh,
+ * and give fi the fh the kernel will know it by.
+ */
+static void handle_add(const char *path, struct fuse_file_info *fi,
+                       int is_dir)
+{
+    ll_handle h = calloc(1, sizeof(struct ll_handle_st));
+
+    h->path = g_strdup(path);
+    h->flags = fi->flags;
+    h->obj = (void*)(uintptr_t)fi->fh;
+    h->is_dir = is_dir;
+
+    pthread_rwlock_wrlock(&Handles.lock);
+    h->fh = Handles.next_fh++;
+    g_hash_table_insert(Handles.table, &h->fh, h);
+    pthread_rwlock_unlock(&Handles.lock);
+
+    fi->fh = h->fh;
+}
+
+/**
+ * The handle fh, or NULL. The kernel sends nothing for a handle once it
+ * has been released, so it can be used without the lock.
+ */
+static ll_handle handle_get(uint64_t fh)
+{
+    ll_handle h;
+
+    pthread_rwlock_rdlock(&Handles.lock);
+    h = g_hash_table_lookup(Handles.table, &fh);
+    pthread_rwlock_unlock(&Handles.lock);
+    return h;
+}
+
+/**
+ * Fill hfi from fi, for the operations in fops.c, which take the object
+ * itself in fh. Returns hfi, or NULL if fi is NULL or its handle couldn't
+ * be taken over from a previous daemon.
+ */
+static struct fuse_file_info *handle_fi(struct fuse_file_info *fi,
+                                        struct fuse_file_info *hfi)
+{
+    ll_handle h = fi ? handle_get(fi->fh) : NULL;
+
+    if (h == NULL || h->is_dir) {
+        return NULL;
+    }
+    *hfi = *fi;
+    hfi->fh = (uintptr_t)h->obj;
+    return hfi;
+}
+
+/**
+ * Close the handle fi, and forget it. Returns 0 or a negative errno.
+ */
+static int handle_release(struct fuse_file_info *fi)
+{
+    struct fuse_file_info hfi;
+    ll_handle h;
+    int res = 0;
+
+    pthread_rwlock_wrlock(&Handles.lock);
+    h = g_hash_table_lookup(Handles.table, &fi->fh);
+    if (h) {
+        g_hash_table_remove(Handles.table, &h->fh);
+    }
+    pthread_rwlock_unlock(&Handles.lock);
+
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if (h->is_dir) {
+        g_ptr_array_free(h->obj, TRUE);
+    } else {
+        hfi = *fi;
+        hfi.fh = (uintptr_t)h->obj;
+        res = busfs_op_release(NULL, &hfi);
+    }
+    g_free(h->path);
+    free(h);
+    return res;
+}
+
+void busfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[FILENAME_MAX];
+    struct fuse_entry_param e;
+    int res;
+
+    ll_init();
+    res = child_path(parent, name, path, sizeof(path));
+    if (res == 0) {
+        res = make_entry(parent, name, path, NULL, &e);
+    }
+
+    if (res == 0) {
+        fuse_reply_entry(req, &e);
+    } else if (res == -ENOENT && _BFG.conf.negative_timeout > 0) {
+        /* The kernel remembers that there is nothing there */
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = _BFG.conf.negative_timeout;
+        fuse_reply_entry(req, &e);
+    } else {
+        fuse_reply_err(req, -res);
+    }
+}
+
+void busfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    node_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void busfs_ll_forget_multi(fuse_req_t req, size_t count,
+                           struct fuse_forget_data *forgets)
+{
+    size_t ii;
+
+    for (ii = 0; ii < count; ii++) {
+        node_forget(forgets[ii].ino, forgets[ii].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino, const char *path,
+                       struct fuse_file_info *fi)
+{
+    struct stat st;
+    int res;
+
+    memset(&st, 0, sizeof(st));
+    res = busfs_op_getattr(path, &st, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, _BFG.conf.attr_timeout);
+}
+
+void busfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    char path[FILENAME_MAX];
+    struct fuse_file_info hfi;
+    int res;
+
+    ll_init();
+    fi = handle_fi(fi, &hfi);
+    if ((res = node_path(ino, path, sizeof(path))) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    reply_attr(req, ino, path, fi);
+}
+
+/**
+ * Resolve a time given to setattr, which may be the current time, or not
+ * given at all, in which case the current one is kept.
+ */
+static void setattr_time(struct timespec *ts, const struct timespec *given,
+                         const struct timespec *current, int set, int now)
+{
+    if (now) {
+        clock_gettime(CLOCK_REALTIME, ts);
+    } else if (set) {
+        *ts = *given;
+    } else {
+        *ts = *current;
+    }
+}
+
+void busfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                      int to_set, struct fuse_file_info *fi)
+{
+    char path[FILENAME_MAX];
+    struct fuse_file_info hfi;
+    int res;
+
+    ll_init();
+    fi = handle_fi(fi, &hfi);
+    if ((res = node_path(ino, path, sizeof(path))) != 0) {
+        goto GT_RET;
+    }
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        if ((res = busfs_op_chmod(path, attr->st_mode, fi)) != 0) {
+            goto GT_RET;
+        }
+    }
+
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+
+        if ((res = busfs_op_chown(path, uid, gid, fi)) != 0) {
+            goto GT_RET;
+        }
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if ((res = busfs_op_truncate(path, attr->st_size, fi)) != 0) {
+            goto GT_RET;
+        }
+    }
+
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                  FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)) {
+        struct timespec ts[2];
+        struct stat st;
+
+        if ((res = busfs_op_getattr(path, &st, fi)) != 0) {
+            goto GT_RET;
+        }
+        setattr_time(&ts[0], &attr->st_atim, &st.st_atim,
+                     to_set & FUSE_SET_ATTR_ATIME,
+                     to_set & FUSE_SET_ATTR_ATIME_NOW);
+        setattr_time(&ts[1], &attr->st_mtim, &st.st_mtim,
+                     to_set & FUSE_SET_ATTR_MTIME,
+                     to_set & FUSE_SET_ATTR_MTIME_NOW);
+        if ((res = busfs_op_utimens(path, ts, fi)) != 0) {
+            goto GT_RET;
+        }
+    }
+
+    reply_attr(req, ino, path, fi);
+    return;
+
+    GT_RET:
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char path[FILENAME_MAX], buf[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0) {
+        res = busfs_op_readlink(path, buf, sizeof(buf));
+    }
+
+    if (res == 0) {
+        fuse_reply_readlink(req, buf);
+    } else {
+        fuse_reply_err(req, -res);
+    }
+}
+
+void busfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode, dev_t rdev)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = child_path(parent, name, path, sizeof(path))) == 0 &&
+            (res = busfs_op_mknod(path, mode, rdev)) == 0) {
+        reply_entry(req, parent, name, path);
+        return;
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = child_path(parent, name, path, sizeof(path))) == 0 &&
+            (res = busfs_op_mkdir(path, mode)) == 0) {
+        reply_entry(req, parent, name, path);
+        return;
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                      const char *name)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = child_path(parent, name, path, sizeof(path))) == 0 &&
+            (res = busfs_op_symlink(link, path)) == 0) {
+        reply_entry(req, parent, name, path);
+        return;
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                   const char *newname)
+{
+    char from[FILENAME_MAX], to[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, from, sizeof(from))) == 0 &&
+            (res = child_path(newparent, newname, to, sizeof(to))) == 0 &&
+            (res = busfs_op_link(from, to)) == 0) {
+        reply_entry(req, newparent, newname, to);
+        return;
+    }
+    fuse_reply_err(req, -res);
+}
+
+/**
+ * unlink(2) and rmdir(2), which take name out of the table once done
+ */
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      int (*op)(const char *path))
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = child_path(parent, name, path, sizeof(path))) == 0 &&
+            (res = op(path)) == 0) {
+        pthread_mutex_lock(&Nodes.mutex);
+        node_detach(parent, name);
+        pthread_mutex_unlock(&Nodes.mutex);
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_remove(req, parent, name, busfs_op_unlink);
+}
+
+void busfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_remove(req, parent, name, busfs_op_rmdir);
+}
+
+void busfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     fuse_ino_t newparent, const char *newname,
+                     unsigned int flags)
+{
+    char from[FILENAME_MAX], to[FILENAME_MAX];
+    char *key;
+    ll_node n;
+    int res;
+
+    ll_init();
+    if ((res = child_path(parent, name, from, sizeof(from))) != 0 ||
+            (res = child_path(newparent, newname, to, sizeof(to))) != 0 ||
+            (res = busfs_op_rename(from, to, flags)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    /* Whatever was at the new name is replaced */
+    pthread_mutex_lock(&Nodes.mutex);
+    node_detach(newparent, newname);
+    key = node_key(parent, name);
+    n = g_hash_table_lookup(Nodes.names, key);
+    g_free(key);
+    if (n) {
+        g_hash_table_remove(Nodes.names, n->key);
+        g_free(n->key);
+        n->parent = newparent;
+        n->key = node_key(newparent, newname);
+        n->name = strchr(n->key, '/') + 1;
+        g_hash_table_insert(Nodes.names, n->key, n);
+    }
+    pthread_mutex_unlock(&Nodes.mutex);
+
+    fuse_reply_err(req, 0);
+}
+
+/*
+ * Open handles
+ */
+
+void busfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0 &&
+            (res = busfs_op_open(path, fi)) == 0) {
+        handle_add(path, fi, 0);
+        if (fuse_reply_open(req, fi) == -ENOENT) {
+            /* The open was interrupted */
+            handle_release(fi);
+        }
+        return;
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, struct fuse_file_info *fi)
+{
+    char path[FILENAME_MAX];
+    struct fuse_entry_param e;
+    int res;
+
+    ll_init();
+    if ((res = child_path(parent, name, path, sizeof(path))) != 0 ||
+            (res = busfs_op_create(path, mode, fi)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    if ((res = make_entry(parent, name, path, fi, &e)) != 0) {
+        busfs_op_release(NULL, fi);
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    handle_add(path, fi, 0);
+    if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+        handle_release(fi);
+    }
+}
+
+void busfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info *fi)
+{
+    const struct busfs_request_st *cur = busfs_loop_request();
+    struct fuse_file_info hfi;
+    busfs_common o;
+    busfs_pending p;
+    char *buf;
+    int res;
+    (void)ino;
+
+    ll_init();
+    if (handle_fi(fi, &hfi) == NULL) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    o = (busfs_common)(uintptr_t)hfi.fh;
+
+    if (o && o->wait_func && cur) {
+        p = calloc(1, sizeof(struct busfs_pending_st));
+        p->req = req;
+        p->unique = cur->unique;
+        p->o = o;
+        p->size = size;
+        p->fh = fi->fh;
+        p->fd = cur->fd;
+        p->link.data = p;
+
+        /* Interrupts may come as soon as p is in the table */
+        pthread_mutex_lock(&Pending.mutex);
+        if (g_hash_table_remove(Pending.early, &p->unique)) {
+            p->interrupted = 1;
+        }
+        g_hash_table_insert(Pending.reads, &p->unique, p);
+        pthread_mutex_unlock(&Pending.mutex);
+
+        o->wait_func(o, p);
+        return;
+    }
+
+    buf = malloc(size);
+    res = busfs_op_read(NULL, buf, size, off, &hfi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_buf(req, buf, res);
+    }
+    free(buf);
+}
+
+void busfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                    size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_file_info hfi;
+    int res = -EBADF;
+    (void)ino;
+
+    if (handle_fi(fi, &hfi)) {
+        res = busfs_op_write(NULL, buf, size, off, &hfi);
+    }
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_write(req, res);
+    }
+}
+
+void busfs_ll_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                   struct fuse_pollhandle *ph)
+{
+    struct fuse_file_info hfi;
+    unsigned revents = 0;
+    int res;
+    (void)ino;
+
+    if (handle_fi(fi, &hfi)) {
+        res = busfs_op_poll(NULL, &hfi, ph, &revents);
+    } else {
+        if (ph) {
+            fuse_pollhandle_destroy(ph);
+        }
+        res = -EBADF;
+    }
+
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_poll(req, revents);
+    }
+}
+
+void busfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -handle_release(fi));
+}
+
+void busfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                    struct fuse_file_info *fi)
+{
+    struct fuse_file_info hfi;
+    (void)ino;
+
+    fuse_reply_err(req, -busfs_op_fsync(NULL, datasync,
+                                        handle_fi(fi, &hfi)));
+}
+
+/*
+ * Directories, which are read whole when opened
+ */
+
+typedef struct ll_dirent_st {
+    fuse_ino_t ino;
+    mode_t mode;
+    char name[];
+} *ll_dirent;
+
+static int dir_fill(void *buf, const char *name, const struct stat *stbuf,
+                    off_t off)
+{
+    ll_dirent de = malloc(sizeof(struct ll_dirent_st) + strlen(name) + 1);
+    (void)off;
+
+    de->ino = stbuf ? stbuf->st_ino : 0;
+    de->mode = stbuf ? stbuf->st_mode : 0;
+    strcpy(de->name, name);
+    g_ptr_array_add((GPtrArray*)buf, de);
+    return 0;
+}
+
+void busfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    char path[FILENAME_MAX];
+    GPtrArray *entries;
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    entries = g_ptr_array_new_with_free_func(free);
+    res = busfs_op_readdir(path, entries, dir_fill, 0, fi);
+    if (res != 0) {
+        g_ptr_array_free(entries, TRUE);
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->fh = (uintptr_t)entries;
+    handle_add(path, fi, 1);
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        handle_release(fi);
+    }
+}
+
+void busfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      struct fuse_file_info *fi)
+{
+    ll_handle h = handle_get(fi->fh);
+    GPtrArray *entries;
+    char *buf;
+    size_t used = 0;
+    guint ii;
+    (void)ino;
+
+    if (h == NULL || !h->is_dir) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    entries = h->obj;
+    buf = malloc(size);
+
+    for (ii = off; ii < entries->len; ii++) {
+        ll_dirent de = entries->pdata[ii];
+        struct stat st;
+        size_t len;
+
+        memset(&st, 0, sizeof(st));
+        st.st_ino = de->ino;
+        st.st_mode = de->mode;
+        len = fuse_add_direntry(req, buf + used, size - used, de->name, &st,
+                                ii + 1);
+        if (len > size - used) {
+            break;
+        }
+        used += len;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+void busfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -handle_release(fi));
+}
+
+void busfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    char path[FILENAME_MAX];
+    struct statvfs st;
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0 &&
+            (res = busfs_op_statfs(path, &st)) == 0) {
+        fuse_reply_statfs(req, &st);
+        return;
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0) {
+        res = busfs_op_access(path, mask);
+    }
+    fuse_reply_err(req, -res);
+}
+
+#ifdef HAVE_SETXATTR
+void busfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                       const char *value, size_t size, int flags)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0) {
+        res = busfs_op_setxattr(path, name, value, size, flags);
+    }
+    fuse_reply_err(req, -res);
+}
+
+void busfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                       size_t size)
+{
+    char path[FILENAME_MAX];
+    char *value = size ? malloc(size) : NULL;
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0) {
+        res = busfs_op_getxattr(path, name, value, size);
+    }
+
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else if (size) {
+        fuse_reply_buf(req, value, res);
+    } else {
+        fuse_reply_xattr(req, res);
+    }
+    free(value);
+}
+
+void busfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    char path[FILENAME_MAX];
+    char *list = size ? malloc(size) : NULL;
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0) {
+        res = busfs_op_listxattr(path, list, size);
+    }
+
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else if (size) {
+        fuse_reply_buf(req, list, res);
+    } else {
+        fuse_reply_xattr(req, res);
+    }
+    free(list);
+}
+
+void busfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    char path[FILENAME_MAX];
+    int res;
+
+    ll_init();
+    if ((res = node_path(ino, path, sizeof(path))) == 0) {
+        res = busfs_op_removexattr(path, name);
+    }
+    fuse_reply_err(req, -res);
+}
+#endif /* HAVE_SETXATTR */
+
+/**
+ * The NUMA node of the topic which the request in buf reads or writes, or
+ * -1 for any other request, or a topic which isn't placed. Called by the
+ * worker which read it, to hand it to one on that node.
+ */
+int busfs_ll_node(const char *buf, size_t len)
+{
+    const struct fuse_in_header *in = (const struct fuse_in_header*)buf;
+    busfs_common o;
+    uint64_t fh;
+    ll_handle h;
+    int node = -1;
+
+    /* Both start with the handle */
+    if (in->opcode == FUSE_READ &&
+            len >= sizeof(*in) + sizeof(struct fuse_read_in)) {
+        fh = ((const struct fuse_read_in*)(in + 1))->fh;
+    } else if (in->opcode == FUSE_WRITE &&
+            len >= sizeof(*in) + sizeof(struct fuse_write_in)) {
+        fh = ((const struct fuse_write_in*)(in + 1))->fh;
+    } else {
+        return -1;
+    }
+
+    ll_init();
+    pthread_rwlock_rdlock(&Handles.lock);
+    h = g_hash_table_lookup(Handles.table, &fh);
+    o = (h && !h->is_dir) ? h->obj : NULL;
+    if (o && o->type == BUSFS_INFO_READER) {
+        node = ((busfs_reader)o)->f->numa_node;
+    } else if (o && o->type == BUSFS_INFO_WRITER) {
+        node = ((busfs_writer)o)->f->numa_node;
+    }
+    pthread_rwlock_unlock(&Handles.lock);
+    return node;
+}
+
+/*
+ * Reads which wait
+ */
+
+/**
+ * Answer p with res bytes of buf, or with the error -res, and free it. The
+ * caller must own p, as the thread looking at it.
+ */
+/**
+ * Answer a read taken over from a previous daemon, which has no fuse_req_t,
+ * on the device it was read from
+ */
+static void pending_reply_raw(busfs_pending p, const char *buf, int res)
+{
+    struct fuse_out_header out;
+    struct iovec iov[2];
+
+    out.unique = p->unique;
+    out.error = (res < 0) ? res : 0;
+    out.len = sizeof(out) + ((res > 0) ? res : 0);
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(out);
+    iov[1].iov_base = (void*)buf;
+    iov[1].iov_len = (res > 0) ? res : 0;
+
+    /* ENOENT if the request was interrupted, and is gone */
+    if (writev(p->fd, iov, (res > 0) ? 2 : 1) == -1 && errno != ENOENT) {
+        LOG_MSG("Couldn't answer read %llu: %s",
+                (unsigned long long)p->unique, strerror(errno));
+    }
+}
+
+void busfs_pending_reply(busfs_pending p, const char *buf, int res)
+{
+    pthread_mutex_lock(&Pending.mutex);
+    g_hash_table_remove(Pending.reads, &p->unique);
+    g_hash_table_remove(Pending.lingering, &p->unique);
+    pthread_mutex_unlock(&Pending.mutex);
+
+    if (p->req == NULL) {
+        pending_reply_raw(p, buf, res);
+    } else if (res < 0) {
+        fuse_reply_err(p->req, -res);
+    } else {
+        fuse_reply_buf(p->req, buf, res);
+    }
+    free(p);
+}
+
+/**
+ * Interrupt the read with the given unique, if it is kept, or have it
+ * answered with EINTR when it would be. Interrupts for requests which
+ * haven't been seen yet are remembered for a while.
+ */
+void busfs_ll_interrupt(uint64_t unique)
+{
+    busfs_pending p;
+    int taken = 0;
+
+    ll_init();
+    pthread_mutex_lock(&Pending.mutex);
+    p = g_hash_table_lookup(Pending.reads, &unique);
+    if (p) {
+        /* p can't be answered, and freed, while Pending.mutex is held */
+        taken = p->o->unwait_func(p->o, p, 1);
+    } else {
+        GHashTableIter iter;
+        gpointer value;
+        uint64_t *key = g_new(uint64_t, 1), *when = g_new(uint64_t, 1);
+        uint64_t now = busfs_clock_ns();
+
+        /* Those which were for requests which had already been answered
+         * are dropped eventually */
+        g_hash_table_iter_init(&iter, Pending.early);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            if (*(uint64_t*)value + LL_INTERRUPT_KEEP_NS < now) {
+                g_hash_table_iter_remove(&iter);
+            }
+        }
+        *key = unique;
+        *when = now;
+        g_hash_table_insert(Pending.early, key, when);
+    }
+    pthread_mutex_unlock(&Pending.mutex);
+
+    if (taken) {
+        busfs_pending_reply(p, NULL, -EINTR);
+    }
+}
+
+/**
+ * Look at lingering reads again once their time is up
+ */
+static void *linger_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&Pending.mutex);
+    for (;;) {
+        GHashTableIter iter;
+        gpointer value;
+        GList *expired = NULL, *l;
+        uint64_t now = busfs_clock_ns(), next = 0;
+        struct timespec ts;
+
+        g_hash_table_iter_init(&iter, Pending.lingering);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            busfs_pending p = value;
+
+            if (p->linger_ns > now) {
+                next = (next && next < p->linger_ns) ? next : p->linger_ns;
+            } else if (p->o->unwait_func(p->o, p, 0)) {
+                g_hash_table_iter_remove(&iter);
+                expired = g_list_prepend(expired, p);
+            } else {
+                /* Being looked at; either it is answered, or kept until
+                 * it can be taken */
+                next = now + LL_LINGER_RETRY_NS;
+            }
+        }
+
+        if (expired) {
+            pthread_mutex_unlock(&Pending.mutex);
+            for (l = expired; l; l = l->next) {
+                busfs_pending p = l->data;
+                p->o->wait_func(p->o, p);
+            }
+            g_list_free(expired);
+            pthread_mutex_lock(&Pending.mutex);
+            continue;
+        }
+
+        if (next == 0) {
+            pthread_cond_wait(&Pending.linger_cond, &Pending.mutex);
+        } else {
+            ts.tv_sec = next / 1000000000;
+            ts.tv_nsec = next % 1000000000;
+            pthread_cond_timedwait(&Pending.linger_cond, &Pending.mutex, &ts);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Have p looked at again at p->linger_ns, if it is still kept then. Must
+ * be called by the thread which owns p, before keeping it.
+ */
+void busfs_pending_linger(busfs_pending p)
+{
+    pthread_mutex_lock(&Pending.mutex);
+    if (!Pending.linger_started) {
+        pthread_create(&Pending.linger_thread, NULL, linger_thread, NULL);
+        pthread_detach(Pending.linger_thread);
+        Pending.linger_started = 1;
+    }
+    if (g_hash_table_lookup(Pending.lingering, &p->unique) == NULL) {
+        g_hash_table_insert(Pending.lingering, &p->unique, p);
+        pthread_cond_signal(&Pending.linger_cond);
+    }
+    pthread_mutex_unlock(&Pending.mutex);
+}
+
+/*
+ * Handover
+ */
+
+/**
+ * Take every read which is being kept, so that nothing answers them here
+ * while they are handed over. A read which another thread is looking at is
+ * either answered or kept again shortly, and is waited for. Must be called
+ * with the workers paused.
+ */
+GList *busfs_ll_take_pending(void)
+{
+    GList *taken = NULL, *interrupted = NULL, *l;
+    int busy;
+
+    ll_init();
+    pthread_mutex_lock(&Pending.mutex);
+    do {
+        GHashTableIter iter;
+        gpointer value;
+
+        busy = 0;
+        g_hash_table_iter_init(&iter, Pending.reads);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            busfs_pending p = value;
+
+            if (p->o->unwait_func(p->o, p, 0)) {
+                g_hash_table_iter_remove(&iter);
+                g_hash_table_remove(Pending.lingering, &p->unique);
+                if (p->interrupted) {
+                    interrupted = g_list_prepend(interrupted, p);
+                } else {
+                    taken = g_list_prepend(taken, p);
+                }
+            } else {
+                busy = 1;
+            }
+        }
+
+        if (busy) {
+            pthread_mutex_unlock(&Pending.mutex);
+            usleep(LL_LINGER_RETRY_NS / 1000);
+            pthread_mutex_lock(&Pending.mutex);
+        }
+    } while (busy);
+    pthread_mutex_unlock(&Pending.mutex);
+
+    /* Those are answered here, rather than kept by the new daemon */
+    for (l = interrupted; l; l = l->next) {
+        busfs_pending_reply(l->data, NULL, -EINTR);
+    }
+    g_list_free(interrupted);
+    return taken;
+}
+
+/**
+ * Keep the reads from busfs_ll_take_pending() again, if the handover
+ * didn't happen
+ */
+void busfs_ll_return_pending(GList *taken)
+{
+    GList *l;
+
+    for (l = taken; l; l = l->next) {
+        busfs_pending p = l->data;
+
+        pthread_mutex_lock(&Pending.mutex);
+        g_hash_table_insert(Pending.reads, &p->unique, p);
+        pthread_mutex_unlock(&Pending.mutex);
+        p->o->wait_func(p->o, p);
+    }
+    g_list_free(taken);
+}
+
+static void save_nodes(busfs_hbuf hb)
+{
+    GHashTableIter iter;
+    gpointer value;
+    uint32_t count;
+
+    pthread_mutex_lock(&Nodes.mutex);
+    count = g_hash_table_size(Nodes.inodes);
+    BUSFS_HANDOFF_PUT(hb, count);
+    BUSFS_HANDOFF_PUT(hb, Nodes.next_ino);
+
+    g_hash_table_iter_init(&iter, Nodes.inodes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ll_node n = value;
+        uint8_t linked = n->key != NULL;
+
+        BUSFS_HANDOFF_PUT(hb, n->ino);
+        BUSFS_HANDOFF_PUT(hb, n->nlookup);
+        BUSFS_HANDOFF_PUT(hb, n->parent);
+        BUSFS_HANDOFF_PUT(hb, linked);
+        busfs_handoff_put_str(hb, linked ? n->name : "",
+                              linked ? strlen(n->name) : 0);
+    }
+    pthread_mutex_unlock(&Nodes.mutex);
+}
+
+static int restore_nodes(busfs_hbuf hb)
+{
+    char name[FILENAME_MAX];
+    uint32_t count, ii;
+    fuse_ino_t next_ino;
+
+    if (BUSFS_HANDOFF_GET(hb, count) != 0 ||
+            BUSFS_HANDOFF_GET(hb, next_ino) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&Nodes.mutex);
+    Nodes.next_ino = next_ino;
+    for (ii = 0; ii < count; ii++) {
+        ll_node n = calloc(1, sizeof(struct ll_node_st));
+        uint8_t linked;
+
+        if (BUSFS_HANDOFF_GET(hb, n->ino) != 0 ||
+                BUSFS_HANDOFF_GET(hb, n->nlookup) != 0 ||
+                BUSFS_HANDOFF_GET(hb, n->parent) != 0 ||
+                BUSFS_HANDOFF_GET(hb, linked) != 0 ||
+                busfs_handoff_get_str(hb, name, sizeof(name)) != 0) {
+            free(n);
+            break;
+        }
+        if (n->ino == FUSE_ROOT_ID) {
+            free(n);
+            continue;
+        }
+        if (linked) {
+            n->key = node_key(n->parent, name);
+            n->name = strchr(n->key, '/') + 1;
+            g_hash_table_insert(Nodes.names, n->key, n);
+        }
+        g_hash_table_insert(Nodes.inodes, &n->ino, n);
+    }
+    pthread_mutex_unlock(&Nodes.mutex);
+    return (ii == count) ? 0 : -1;
+}
+
+static void save_handles(busfs_hbuf hb)
+{
+    GHashTableIter iter;
+    gpointer value;
+    uint32_t count;
+
+    pthread_rwlock_rdlock(&Handles.lock);
+    count = g_hash_table_size(Handles.table);
+    BUSFS_HANDOFF_PUT(hb, count);
+    BUSFS_HANDOFF_PUT(hb, Handles.next_fh);
+
+    g_hash_table_iter_init(&iter, Handles.table);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ll_handle h = value;
+        uint8_t is_dir = h->is_dir;
+        off_t mark;
+
+        BUSFS_HANDOFF_PUT(hb, h->fh);
+        BUSFS_HANDOFF_PUT(hb, h->flags);
+        BUSFS_HANDOFF_PUT(hb, is_dir);
+        busfs_handoff_put_str(hb, h->path, strlen(h->path));
+
+        /* Skipped whole if the handle can't be opened again */
+        mark = busfs_handoff_put_begin(hb);
+        if (is_dir) {
+            GPtrArray *entries = h->obj;
+            uint32_t ii, n = entries->len;
+
+            BUSFS_HANDOFF_PUT(hb, n);
+            for (ii = 0; ii < n; ii++) {
+                ll_dirent de = entries->pdata[ii];
+
+                BUSFS_HANDOFF_PUT(hb, de->ino);
+                BUSFS_HANDOFF_PUT(hb, de->mode);
+                busfs_handoff_put_str(hb, de->name, strlen(de->name));
+            }
+        } else {
+            busfs_handoff_put_handle(hb, h->obj);
+        }
+        busfs_handoff_put_end(hb, mark);
+    }
+    pthread_rwlock_unlock(&Handles.lock);
+}
+
+/**
+ * Rebuild the directory handle in part
+ */
+static GPtrArray *restore_dir(busfs_hbuf part)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func(free);
+    char name[FILENAME_MAX];
+    uint32_t ii, n;
+
+    if (BUSFS_HANDOFF_GET(part, n) != 0) {
+        n = 0;
+    }
+    for (ii = 0; ii < n; ii++) {
+        struct stat st;
+        fuse_ino_t ino;
+        mode_t mode;
+
+        if (BUSFS_HANDOFF_GET(part, ino) != 0 ||
+                BUSFS_HANDOFF_GET(part, mode) != 0 ||
+                busfs_handoff_get_str(part, name, sizeof(name)) != 0) {
+            break;
+        }
+        memset(&st, 0, sizeof(st));
+        st.st_ino = ino;
+        st.st_mode = mode;
+        dir_fill(entries, name, &st, 0);
+    }
+    return entries;
+}
+
+static int restore_handles(busfs_hbuf hb)
+{
+    char path[FILENAME_MAX];
+    uint32_t count, ii;
+    uint64_t next_fh;
+
+    if (BUSFS_HANDOFF_GET(hb, count) != 0 ||
+            BUSFS_HANDOFF_GET(hb, next_fh) != 0) {
+        return -1;
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        struct busfs_hbuf_st part;
+        struct fuse_file_info fi;
+        ll_handle h;
+        uint64_t fh;
+        uint8_t is_dir;
+        int flags;
+
+        if (BUSFS_HANDOFF_GET(hb, fh) != 0 ||
+                BUSFS_HANDOFF_GET(hb, flags) != 0 ||
+                BUSFS_HANDOFF_GET(hb, is_dir) != 0 ||
+                busfs_handoff_get_str(hb, path, sizeof(path)) != 0 ||
+                busfs_handoff_get_part(hb, &part) != 0) {
+            return -1;
+        }
+
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = flags;
+        if (is_dir) {
+            fi.fh = (uintptr_t)restore_dir(&part);
+        } else if (busfs_op_reopen(path, &fi) != 0) {
+            /* Its topic is gone, and the kernel is told EBADF for it */
+            LOG_MSG("Couldn't open %s again", path);
+            continue;
+        } else if (busfs_handoff_get_handle(&part,
+                                            (busfs_common)fi.fh) != 0) {
+            LOG_MSG("Couldn't restore the handle on %s", path);
+        }
+
+        h = calloc(1, sizeof(struct ll_handle_st));
+        h->fh = fh;
+        h->path = g_strdup(path);
+        h->flags = flags;
+        h->obj = (void*)(uintptr_t)fi.fh;
+        h->is_dir = is_dir;
+
+        pthread_rwlock_wrlock(&Handles.lock);
+        g_hash_table_insert(Handles.table, &h->fh, h);
+        pthread_rwlock_unlock(&Handles.lock);
+    }
+
+    pthread_rwlock_wrlock(&Handles.lock);
+    Handles.next_fh = next_fh;
+    pthread_rwlock_unlock(&Handles.lock);
+    return 0;
+}
+
+/**
+ * Write the inodes, open handles and the reads in taken to hb. fds are the
+ * devices which are handed over, in the order the new daemon gets them.
+ * Must be called with the workers paused.
+ */
+void busfs_ll_save(busfs_hbuf hb, GList *taken, const int *fds, int nfds)
+{
+    uint32_t count = g_list_length(taken);
+    GList *l;
+
+    ll_init();
+    save_nodes(hb);
+    save_handles(hb);
+
+    BUSFS_HANDOFF_PUT(hb, count);
+    for (l = taken; l; l = l->next) {
+        busfs_pending p = l->data;
+        int32_t idx = 0;
+
+        while (idx < nfds && fds[idx] != p->fd) {
+            idx++;
+        }
+        BUSFS_HANDOFF_PUT(hb, p->fh);
+        BUSFS_HANDOFF_PUT(hb, p->unique);
+        BUSFS_HANDOFF_PUT(hb, p->size);
+        BUSFS_HANDOFF_PUT(hb, p->since_ns);
+        BUSFS_HANDOFF_PUT(hb, p->linger_ns);
+        BUSFS_HANDOFF_PUT(hb, idx);
+    }
+}
+
+/**
+ * Rebuild what busfs_ll_save() wrote, once the topics have been, and take
+ * on the reads which were kept. fds are the devices this daemon was given.
+ * Returns 0, or -1 if hb was cut short.
+ */
+int busfs_ll_restore(busfs_hbuf hb, const int *fds, int nfds)
+{
+    uint32_t count, ii;
+
+    ll_init();
+    if (restore_nodes(hb) != 0 || restore_handles(hb) != 0 ||
+            BUSFS_HANDOFF_GET(hb, count) != 0) {
+        return -1;
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        busfs_pending p = calloc(1, sizeof(struct busfs_pending_st));
+        ll_handle h;
+        int32_t idx;
+
+        if (BUSFS_HANDOFF_GET(hb, p->fh) != 0 ||
+                BUSFS_HANDOFF_GET(hb, p->unique) != 0 ||
+                BUSFS_HANDOFF_GET(hb, p->size) != 0 ||
+                BUSFS_HANDOFF_GET(hb, p->since_ns) != 0 ||
+                BUSFS_HANDOFF_GET(hb, p->linger_ns) != 0 ||
+                BUSFS_HANDOFF_GET(hb, idx) != 0 || idx < 0 || idx >= nfds) {
+            free(p);
+            return -1;
+        }
+        p->fd = fds[idx];
+        p->link.data = p;
+
+        h = handle_get(p->fh);
+        if (h == NULL || h->is_dir ||
+                ((busfs_common)h->obj)->wait_func == NULL) {
+            pending_reply_raw(p, NULL, -EBADF);
+            free(p);
+            continue;
+        }
+        p->o = h->obj;
+
+        pthread_mutex_lock(&Pending.mutex);
+        g_hash_table_insert(Pending.reads, &p->unique, p);
+        pthread_mutex_unlock(&Pending.mutex);
+        p->o->wait_func(p->o, p);
+    }
+
+    LOG_MSG("Took over %u open handles and %u waiting reads",
+            g_hash_table_size(Handles.table), count);
+    return 0;
+}
@@ -0,0 +1,662 @@
+/**
+ * This file contains the worker threads which read requests from the
+ * kernel and pass them to the operations in busfs_ll.c.
+ *
+ * Unlike fuse_session_loop_mt(), a worker never waits with a request, so
+ * a fixed number of them is enough however many reads are waiting for
+ * messages. Interrupts are taken here, since a kept read may be answered
+ * from any thread, and handed to busfs_ll_interrupt().
+ *
+ * Unless noclone_fd is given, each worker reads from its own clone of the
+ * /dev/fuse descriptor, with its own session, so that they don't contend
+ * on the one channel. A session only answers requests once it has seen
+ * INIT, so the INIT answered on the mounted session is passed to each.
+ *
+ * With -o numa, the workers are spread over the NUMA nodes. A worker which
+ * reads a read or write of a topic placed on another node queues it for
+ * the workers there, which answer it on the device it came from, so that
+ * the ring is only touched from its own node (see busfs_numa.c).
+ *
+ * The workers can be paused, with no request in hand, while the daemon is
+ * handed over (see busfs_handoff.c). The new daemon starts its sessions on
+ * the descriptors it was given, with the INIT the old one answered.
+ */
+
+#define _GNU_SOURCE
+#include "busfs.h"
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/fuse.h>
+
+#define _BFG BusFS_Global
+
+/* The unique given to INIT when passing it to a worker's session. Its
+ * answer is for no request, and is dropped by the kernel */
+#define LOOP_INIT_UNIQUE ((uint64_t)-2)
+
+typedef struct loop_worker_st {
+    pthread_t thread;
+    struct fuse_session *se;
+    int fd;
+
+    /* The NUMA node it runs on, or -1 */
+    int node;
+} *loop_worker;
+
+/* A request read by a worker on another node, to be answered on se */
+typedef struct loop_item_st {
+    struct fuse_session *se;
+    size_t len;
+    char buf[];
+} *loop_item;
+
+/* The requests queued for the workers of a node. fd is readable while
+ * there are any */
+typedef struct loop_node_st {
+    int fd;
+    GQueue queue;
+    unsigned workers;
+} *loop_node;
+
+static struct {
+    /* Readable once the workers are to stop */
+    int stopfd;
+
+    /* Readable while the workers are to pause, and once they may go on */
+    int pausefd;
+    int resumefd;
+
+    /* Workers which are running, and which of them are paused. The
+     * mutex also protects the nodes' queues */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned running;
+    unsigned paused;
+
+    /* With -o numa, one entry per node, and the requests queued on all of
+     * them, or being answered from there */
+    loop_node nodes;
+    int nnodes;
+    unsigned queued;
+
+    size_t bufsize;
+    int masterfd;
+    loop_worker workers;
+    unsigned nworkers;
+
+    /* The INIT request answered on the mounted session */
+    char *init;
+    size_t init_len;
+} Loop = {
+    .stopfd = -1,
+    .pausefd = -1,
+    .resumefd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .masterfd = -1
+};
+
+static __thread struct busfs_request_st loop_request;
+static __thread int loop_in_request;
+
+/**
+ * The request the calling thread is handling, or NULL
+ */
+const struct busfs_request_st *busfs_loop_request(void)
+{
+    return loop_in_request ? &loop_request : NULL;
+}
+
+static void loop_exit(void)
+{
+    uint64_t one = 1;
+
+    if (write(Loop.stopfd, &one, sizeof(one)) != sizeof(one)) {
+        /* Already stopping, with the counter at its maximum */
+    }
+}
+
+/**
+ * Stop the workers, as a signal would
+ */
+void busfs_loop_stop(void)
+{
+    loop_exit();
+}
+
+static void loop_eventfd_set(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+        /* Already set */
+    }
+}
+
+static void loop_eventfd_clear(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        /* Already clear */
+    }
+}
+
+/**
+ * Have every worker finish the request it is handling, and those queued
+ * for other nodes, and stop reading the device, until busfs_loop_resume().
+ * Returns once they all have.
+ */
+void busfs_loop_pause(void)
+{
+    loop_eventfd_clear(Loop.resumefd);
+    loop_eventfd_set(Loop.pausefd);
+
+    pthread_mutex_lock(&Loop.mutex);
+    while (Loop.paused < Loop.running || Loop.queued) {
+        pthread_cond_wait(&Loop.cond, &Loop.mutex);
+    }
+    pthread_mutex_unlock(&Loop.mutex);
+}
+
+void busfs_loop_resume(void)
+{
+    loop_eventfd_clear(Loop.pausefd);
+    loop_eventfd_set(Loop.resumefd);
+}
+
+/**
+ * Put the descriptors requests are read from, and answered on, in fds:
+ * the mounted one first, then the workers' clones. Returns their number.
+ */
+int busfs_loop_fds(int *fds, int max)
+{
+    unsigned ii;
+    int n = 0;
+
+    if (n < max) {
+        fds[n++] = Loop.masterfd;
+    }
+    for (ii = 0; ii < Loop.nworkers && n < max; ii++) {
+        if (Loop.workers[ii].fd != Loop.masterfd) {
+            fds[n++] = Loop.workers[ii].fd;
+        }
+    }
+    return n;
+}
+
+/**
+ * The INIT request which was answered when the filesystem was mounted
+ */
+void busfs_loop_init_request(const char **buf, size_t *len)
+{
+    *buf = Loop.init;
+    *len = Loop.init_len;
+}
+
+static void loop_signal_handler(int sig)
+{
+    (void)sig;
+    loop_exit();
+}
+
+static int loop_set_signal_handlers(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = loop_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 ||
+            sigaction(SIGTERM, &sa, NULL) == -1 ||
+            sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Handle one request read from the device of se
+ */
+static void loop_dispatch(struct fuse_session *se, char *mem, size_t len)
+{
+    struct fuse_in_header *in = (struct fuse_in_header*)mem;
+    struct fuse_buf fbuf;
+
+    if (in->opcode == FUSE_INTERRUPT) {
+        struct fuse_interrupt_in *arg = (struct fuse_interrupt_in*)(in + 1);
+        busfs_ll_interrupt(arg->unique);
+        return;
+    }
+
+    memset(&fbuf, 0, sizeof(fbuf));
+    fbuf.mem = mem;
+    fbuf.size = len;
+
+    loop_request.unique = in->unique;
+    loop_request.pid = in->pid;
+    loop_request.fd = fuse_session_fd(se);
+    loop_in_request = 1;
+    fuse_session_process_buf(se, &fbuf);
+    loop_in_request = 0;
+}
+
+/**
+ * The node whose workers should answer the request in buf, rather than w,
+ * or -1
+ */
+static int loop_route(loop_worker w, const char *buf, size_t len)
+{
+    int node;
+
+    if (Loop.nnodes < 2) {
+        return -1;
+    }
+    node = busfs_ll_node(buf, len);
+    if (node < 0 || node == w->node || node >= Loop.nnodes ||
+            Loop.nodes[node].workers == 0) {
+        return -1;
+    }
+    return node;
+}
+
+/**
+ * Queue the request in buf, read from the device of se, for the workers of
+ * node
+ */
+static void loop_forward(int node, struct fuse_session *se,
+                         const char *buf, size_t len)
+{
+    loop_item item = malloc(sizeof(struct loop_item_st) + len);
+    loop_node n = Loop.nodes + node;
+
+    item->se = se;
+    item->len = len;
+    memcpy(item->buf, buf, len);
+
+    pthread_mutex_lock(&Loop.mutex);
+    g_queue_push_tail(&n->queue, item);
+    Loop.queued++;
+    loop_eventfd_set(n->fd);
+    pthread_mutex_unlock(&Loop.mutex);
+}
+
+/**
+ * Answer a request queued for the node of w, if there still is one
+ */
+static void loop_serve(loop_worker w)
+{
+    loop_node n = Loop.nodes + w->node;
+    loop_item item;
+
+    pthread_mutex_lock(&Loop.mutex);
+    item = g_queue_pop_head(&n->queue);
+    if (g_queue_is_empty(&n->queue)) {
+        loop_eventfd_clear(n->fd);
+    }
+    pthread_mutex_unlock(&Loop.mutex);
+
+    if (item == NULL) {
+        return;
+    }
+    loop_dispatch(item->se, item->buf, item->len);
+    free(item);
+
+    pthread_mutex_lock(&Loop.mutex);
+    if (--Loop.queued == 0) {
+        pthread_cond_broadcast(&Loop.cond);
+    }
+    pthread_mutex_unlock(&Loop.mutex);
+}
+
+/**
+ * Wait while the workers are paused, or until they are to stop. Requests
+ * queued for the node of w before the pause are still answered.
+ */
+static void loop_paused(loop_worker w)
+{
+    struct pollfd pfd[3];
+
+    pthread_mutex_lock(&Loop.mutex);
+    Loop.paused++;
+    pthread_cond_broadcast(&Loop.cond);
+    pthread_mutex_unlock(&Loop.mutex);
+
+    pfd[0].fd = Loop.stopfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = Loop.resumefd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = (w->node >= 0) ? Loop.nodes[w->node].fd : -1;
+    pfd[2].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, 3, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[0].revents || pfd[1].revents || pfd[2].revents == 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&Loop.mutex);
+        Loop.paused--;
+        pthread_mutex_unlock(&Loop.mutex);
+
+        loop_serve(w);
+
+        pthread_mutex_lock(&Loop.mutex);
+        Loop.paused++;
+        pthread_cond_broadcast(&Loop.cond);
+        pthread_mutex_unlock(&Loop.mutex);
+    }
+
+    pthread_mutex_lock(&Loop.mutex);
+    Loop.paused--;
+    pthread_mutex_unlock(&Loop.mutex);
+}
+
+/**
+ * Read a request from fd into buf. Returns its length, 0 if there was none
+ * to read, or a negative errno.
+ */
+static ssize_t loop_receive(int fd, char *buf, size_t size)
+{
+    ssize_t res = read(fd, buf, size);
+
+    if (res == -1) {
+        /* ENOENT is a request which was interrupted before it was read,
+         * and EAGAIN one taken by another worker */
+        if (errno == EINTR || errno == EAGAIN || errno == ENOENT) {
+            return 0;
+        }
+        return -errno;
+    }
+    if ((size_t)res < sizeof(struct fuse_in_header)) {
+        return -EIO;
+    }
+    return res;
+}
+
+static void *loop_worker_main(void *arg)
+{
+    loop_worker w = arg;
+    char *buf = malloc(Loop.bufsize);
+    struct pollfd pfd[4];
+    ssize_t res;
+    int node;
+
+    if (w->node >= 0 && busfs_numa_bind(w->node) != 0) {
+        fprintf(stderr, "busfs: couldn't bind a worker to NUMA node %d\n",
+                w->node);
+    }
+
+    pfd[0].fd = w->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = Loop.stopfd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = Loop.pausefd;
+    pfd[2].events = POLLIN;
+    pfd[3].fd = (w->node >= 0) ? Loop.nodes[w->node].fd : -1;
+    pfd[3].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 4, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (pfd[3].revents) {
+            loop_serve(w);
+            continue;
+        }
+        if (pfd[2].revents) {
+            loop_paused(w);
+            continue;
+        }
+
+        res = loop_receive(w->fd, buf, Loop.bufsize);
+        if (res == 0) {
+            continue;
+        }
+        if (res < 0) {
+            /* ENODEV once the filesystem is unmounted */
+            if (res != -ENODEV) {
+                fprintf(stderr, "busfs: reading device: %s\n",
+                        strerror(-res));
+            }
+            break;
+        }
+        node = loop_route(w, buf, res);
+        if (node >= 0) {
+            loop_forward(node, w->se, buf, res);
+            continue;
+        }
+        loop_dispatch(w->se, buf, res);
+    }
+
+    loop_exit();
+    free(buf);
+
+    pthread_mutex_lock(&Loop.mutex);
+    Loop.running--;
+    pthread_cond_broadcast(&Loop.cond);
+    pthread_mutex_unlock(&Loop.mutex);
+    return NULL;
+}
+
+/**
+ * Pass INIT to se, which hasn't seen it on its own device
+ */
+static void loop_replay_init(struct fuse_session *se)
+{
+    char *copy = malloc(Loop.init_len);
+
+    memcpy(copy, Loop.init, Loop.init_len);
+    ((struct fuse_in_header*)copy)->unique = LOOP_INIT_UNIQUE;
+    loop_dispatch(se, copy, Loop.init_len);
+    free(copy);
+}
+
+/**
+ * Give w a session of its own on fd, a clone of the mounted device, which
+ * has seen INIT. Returns 0 or -1.
+ */
+static int loop_session(loop_worker w, int fd,
+                        const struct fuse_lowlevel_ops *ops, int debug)
+{
+    char *argv[] = { "busfs", debug ? "-d" : NULL, NULL };
+    struct fuse_args args = FUSE_ARGS_INIT(debug ? 2 : 1, argv);
+    char devpath[64];
+
+    w->se = fuse_session_new(&args, ops, sizeof(*ops), NULL);
+    if (w->se == NULL) {
+        return -1;
+    }
+    snprintf(devpath, sizeof(devpath), "/dev/fd/%d", fd);
+    if (fuse_session_mount(w->se, devpath) != 0) {
+        fuse_session_destroy(w->se);
+        w->se = NULL;
+        return -1;
+    }
+    w->fd = fd;
+
+    loop_replay_init(w->se);
+    return 0;
+}
+
+/**
+ * Give w a clone of the device of se, with its own session. Returns 0 or
+ * -1.
+ */
+static int loop_clone(loop_worker w, struct fuse_session *se,
+                      const struct fuse_lowlevel_ops *ops, int debug)
+{
+    uint32_t masterfd = fuse_session_fd(se);
+    int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+
+    if (fd == -1) {
+        perror("busfs: opening /dev/fuse");
+        return -1;
+    }
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+        perror("busfs: cloning /dev/fuse");
+        close(fd);
+        return -1;
+    }
+    if (loop_session(w, fd, ops, debug) != 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Answer the requests for the mounted session se, with ops, until the
+ * filesystem is unmounted or a signal asks to stop. Returns 0, or -1 if
+ * the workers couldn't be started.
+ *
+ * If this daemon took over from another, se is on the descriptor that one
+ * mounted, and each of its clones gets a worker.
+ */
+int busfs_loop_run(struct fuse_session *se,
+                   const struct fuse_lowlevel_ops *ops, int debug)
+{
+    unsigned nworkers = _BFG.conf.workers ? _BFG.conf.workers : 1;
+    const int *adopted;
+    const char *init;
+    size_t init_len;
+    int nadopted = busfs_handoff_adopted(&adopted, &init, &init_len);
+    unsigned ii, started = 0;
+    ssize_t res;
+    int ret = -1;
+
+    if (nadopted > 1 && nworkers < (unsigned)nadopted - 1) {
+        nworkers = nadopted - 1;
+    }
+    Loop.masterfd = fuse_session_fd(se);
+    Loop.workers = calloc(nworkers, sizeof(struct loop_worker_st));
+    Loop.nworkers = 0;
+
+    /* Requests are at most max_write bytes of data, with their headers */
+    Loop.bufsize = MAX(_BFG.conf.max_write, 256 * getpagesize()) + 4096;
+    Loop.stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    Loop.pausefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    Loop.resumefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (Loop.stopfd == -1 || Loop.pausefd == -1 || Loop.resumefd == -1 ||
+            loop_set_signal_handlers() != 0) {
+        goto GT_FREE;
+    }
+
+    if (_BFG.conf.numa) {
+        Loop.nnodes = busfs_numa_nodes();
+        Loop.nodes = calloc(Loop.nnodes, sizeof(struct loop_node_st));
+        for (ii = 0; ii < (unsigned)Loop.nnodes; ii++) {
+            Loop.nodes[ii].fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            g_queue_init(&Loop.nodes[ii].queue);
+            if (Loop.nodes[ii].fd == -1) {
+                goto GT_FREE;
+            }
+        }
+    }
+
+    if (nadopted) {
+        /* The kernel has had its answer to INIT from the old daemon */
+        Loop.init = malloc(init_len);
+        Loop.init_len = init_len;
+        memcpy(Loop.init, init, init_len);
+        loop_replay_init(se);
+    } else {
+        /* The first request is INIT */
+        Loop.init = malloc(Loop.bufsize);
+        do {
+            res = loop_receive(Loop.masterfd, Loop.init, Loop.bufsize);
+        } while (res == 0);
+        if (res < 0) {
+            fprintf(stderr, "busfs: reading INIT: %s\n", strerror(-res));
+            goto GT_FREE;
+        }
+        Loop.init_len = res;
+        loop_dispatch(se, Loop.init, Loop.init_len);
+    }
+    if (fuse_session_exited(se)) {
+        goto GT_FREE;
+    }
+
+    for (ii = 0; ii < nworkers; ii++) {
+        loop_worker w = Loop.workers + ii;
+
+        /* Round robin, so every node gets workers if there are enough */
+        w->node = Loop.nnodes ? (int)(ii % Loop.nnodes) : -1;
+        if (w->node >= 0) {
+            Loop.nodes[w->node].workers++;
+        }
+
+        if (ii + 1 < (unsigned)nadopted) {
+            if (loop_session(w, adopted[ii + 1], ops, debug) != 0) {
+                break;
+            }
+        } else if (_BFG.conf.noclone_fd) {
+            w->se = se;
+            w->fd = Loop.masterfd;
+        } else if (loop_clone(w, se, ops, debug) != 0) {
+            break;
+        }
+        Loop.nworkers++;
+
+        /* Workers sharing a descriptor each poll it, and all but one find
+         * nothing to read */
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK);
+        pthread_mutex_lock(&Loop.mutex);
+        if (pthread_create(&w->thread, NULL, loop_worker_main, w) != 0) {
+            pthread_mutex_unlock(&Loop.mutex);
+            break;
+        }
+        Loop.running++;
+        pthread_mutex_unlock(&Loop.mutex);
+        started++;
+    }
+
+    if (started == nworkers) {
+        ret = 0;
+    } else {
+        loop_exit();
+    }
+    for (ii = 0; ii < started; ii++) {
+        pthread_join(Loop.workers[ii].thread, NULL);
+    }
+    /* After a handover, the devices belong to the new daemon, and nothing
+     * is torn down */
+    for (ii = 0; ii < Loop.nworkers && !busfs_handoff_gone(); ii++) {
+        if (Loop.workers[ii].se && Loop.workers[ii].se != se) {
+            fuse_session_destroy(Loop.workers[ii].se);
+        }
+    }
+
+    GT_FREE:
+    for (ii = 0; ii < (unsigned)Loop.nnodes; ii++) {
+        close(Loop.nodes[ii].fd);
+        g_queue_clear_full(&Loop.nodes[ii].queue, free);
+    }
+    free(Loop.nodes);
+    Loop.nodes = NULL;
+    Loop.nnodes = 0;
+    free(Loop.init);
+    Loop.init = NULL;
+    free(Loop.workers);
+    Loop.workers = NULL;
+    Loop.nworkers = 0;
+    return ret;
+}
@@ -0,0 +1,213 @@
+/**
+ * This file contains a small LZ77 codec, used to compress cold messages.
+ * It favours speed over ratio, which is plenty for log-like text.
+ *
+ * The compressed form is a series of sequences, each made of:
+ *
+ *  token       literal count in the high nibble, match length minus
+ *              LZ_MINMATCH in the low nibble. A nibble of 15 means the
+ *              count continues in the following bytes, each adding up to
+ *              255 until one is less than 255.
+ *  literals    copied as they are
+ *  offset      16 bit little-endian distance back to the match
+ *
+ * The last sequence has only literals, and ends the input.
+ */
+
+#include "busfs.h"
+
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAXOFF 65535
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write the remainder of a count which didn't fit in its nibble. Returns
+ * NULL if there isn't room.
+ */
+static uint8_t *lz_put_count(uint8_t *op, const uint8_t *oend, size_t count)
+{
+    count -= 15;
+    while (count >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *(op++) = 255;
+        count -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *(op++) = count;
+    return op;
+}
+
+/**
+ * Write a sequence of literals, followed by a match unless mlen is 0.
+ */
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend,
+                                const uint8_t *lit, size_t nlit,
+                                size_t off, size_t mlen)
+{
+    uint8_t *token = op++;
+    size_t mcode = mlen ? mlen - LZ_MINMATCH : 0;
+
+    if (op > oend) {
+        return NULL;
+    }
+
+    *token = (MIN(nlit, 15) << 4) | MIN(mcode, 15);
+    if (nlit >= 15 && (op = lz_put_count(op, oend, nlit)) == NULL) {
+        return NULL;
+    }
+
+    if ((size_t)(oend - op) < nlit) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *(op++) = off & 0xff;
+    *(op++) = off >> 8;
+
+    if (mcode >= 15 && (op = lz_put_count(op, oend, mcode)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+/**
+ * Compress size bytes of src into dst, which holds cap bytes. Returns the
+ * compressed size, or 0 if it doesn't fit.
+ */
+size_t busfs_lz_compress(const char *src, size_t size, char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *base = (const uint8_t*)src;
+    const uint8_t *ip = base, *anchor = base, *iend = base + size;
+    uint8_t *op = (uint8_t*)dst;
+    const uint8_t *oend = op + cap;
+
+    /* Positions are stored plus one, so that 0 means none */
+    memset(table, 0, sizeof(table));
+
+    while (iend - ip >= LZ_MINMATCH) {
+        uint32_t h = lz_hash(ip);
+        const uint8_t *ref = table[h] ? base + table[h] - 1 : NULL;
+        size_t mlen;
+
+        table[h] = ip - base + 1;
+
+        if (ref == NULL || ip - ref > LZ_MAXOFF ||
+                memcmp(ref, ip, LZ_MINMATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        mlen = LZ_MINMATCH;
+        while (ip + mlen < iend && ref[mlen] == ip[mlen]) {
+            mlen++;
+        }
+
+        op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (uint8_t*)dst;
+}
+
+/**
+ * Read the remainder of a count which didn't fit in its nibble
+ */
+static int lz_get_count(const uint8_t **ipp, const uint8_t *iend,
+                        size_t *count)
+{
+    const uint8_t *ip = *ipp;
+    uint8_t b;
+
+    do {
+        if (ip >= iend) {
+            return -1;
+        }
+        b = *(ip++);
+        *count += b;
+    } while (b == 255);
+
+    *ipp = ip;
+    return 0;
+}
+
+/**
+ * Decompress zlen bytes of src into dst, which must be exactly the size of
+ * the original data. Returns 0, or -1 if src is corrupt.
+ */
+int busfs_lz_decompress(const char *src, size_t zlen, char *dst, size_t size)
+{
+    const uint8_t *ip = (const uint8_t*)src, *iend = ip + zlen;
+    uint8_t *op = (uint8_t*)dst, *oend = op + size;
+
+    while (ip < iend) {
+        uint8_t token = *(ip++);
+        size_t nlit = token >> 4, mlen = token & 15, off;
+        const uint8_t *ref;
+
+        if (nlit == 15 && lz_get_count(&ip, iend, &nlit) != 0) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (mlen == 15 && lz_get_count(&ip, iend, &mlen) != 0) {
+            return -1;
+        }
+        mlen += LZ_MINMATCH;
+
+        if (off == 0 || off > (size_t)(op - (uint8_t*)dst) ||
+                (size_t)(oend - op) < mlen) {
+            return -1;
+        }
+
+        /* Matches may overlap the bytes they produce */
+        ref = op - off;
+        while (mlen--) {
+            *(op++) = *(ref++);
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
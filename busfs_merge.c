@@ -0,0 +1,351 @@
+/**
+ * This file contains handles which read every topic within a directory,
+ * opened through a path whose last component begins with '@', as in
+ *
+ *  cat 'mountpoint/somedir/@'
+ *
+ * Each message is delivered whole, preceded by the name of its topic and
+ * a tab. Topics are picked up as they are created or renamed into the
+ * directory, and dropped as they are unlinked or renamed out of it. A
+ * partitioned topic has a child reader for each partition, and children of
+ * compacted topics start with the topic's snapshot, as other readers do.
+ *
+ * Topics are found in the global table rather than the backing directory,
+ * which may hold files of an earlier daemon that aren't topics of this one.
+ */
+
+#include "busfs.h"
+#include "busfs_util.h"
+
+#define _BFG BusFS_Global
+#define MINIMUM(a, b) ( ((a) < (b)) ? (a) : (b) )
+
+static int busfs_merge_io(busfs_common o, const char *path,
+                          char *buf, size_t size, off_t offset);
+static void busfs_merge_wait(busfs_common o, busfs_pending p);
+static int busfs_merge_unwait(busfs_common o, busfs_pending p, int interrupt);
+
+static int busfs_merge_writefunc(busfs_common o,
+                                 const char *path,
+                                 const char *buf, size_t size, off_t offset)
+{
+    (void)o;
+    (void)path;
+    (void)buf;
+    (void)size;
+    (void)offset;
+    return -EBADF;
+}
+
+static void merge_child_free(gpointer data)
+{
+    busfs_read_detach((busfs_reader)data);
+}
+
+static int busfs_merge_close(busfs_common o, const char *path)
+{
+    busfs_merge m = (busfs_merge)o;
+    (void)path;
+
+    pthread_mutex_lock(&_BFG.merge.mutex);
+    _BFG.merge.readers--;
+    pthread_mutex_unlock(&_BFG.merge.mutex);
+
+    g_ptr_array_free(m->order, TRUE);
+    g_hash_table_destroy(m->children);
+    g_string_free(m->pending, TRUE);
+    busfs_opts_clear(&m->opts);
+    free(m);
+    return 0;
+}
+
+/**
+ * Look at the waiting reads of directory readers again. Called by writers
+ * after adding data, and when topics come and go.
+ */
+void busfs_merge_notify(void)
+{
+    GList *waiting, *l, *next;
+
+    pthread_mutex_lock(&_BFG.merge.mutex);
+    _BFG.merge.seq++;
+    waiting = _BFG.merge.waiting.head;
+    for (l = waiting; l; l = l->next) {
+        ((busfs_pending)l->data)->parked = 0;
+    }
+    g_queue_init(&_BFG.merge.waiting);
+    pthread_mutex_unlock(&_BFG.merge.mutex);
+
+    for (l = waiting; l; l = next) {
+        busfs_pending p = l->data;
+
+        next = l->next;
+        l->prev = l->next = NULL;
+        p->o->wait_func(p->o, p);
+    }
+}
+
+/**
+ * The topic a child reads, which for a partition is its parent
+ */
+static inline busfs_file child_topic(busfs_reader r)
+{
+    return r->f->parent ? r->f->parent : r->f;
+}
+
+/**
+ * Whether the topic at path is directly within the directory of m
+ */
+static int merge_covers(busfs_merge m, const char *path)
+{
+    size_t dirlen = strlen(m->dir);
+    return strncmp(path, m->dir, dirlen) == 0 &&
+            strchr(path + dirlen, '/') == NULL;
+}
+
+/**
+ * Start following f, which may be a partition, unless that is already
+ * done. Takes over the caller's reference on f.
+ */
+static void merge_follow(busfs_merge m, busfs_file f,
+                         struct fuse_file_info *fi,
+                         const struct busfs_openopts_st *opts)
+{
+    busfs_reader r;
+
+    if (g_hash_table_lookup(m->children, f)) {
+        busfs_file_release(f, BUSFS_INFO_NONE);
+        return;
+    }
+
+    /* The reference is dropped when the child is detached */
+    r = busfs_read_new(f, fi, opts);
+    g_hash_table_insert(m->children, f, r);
+    g_ptr_array_add(m->order, r);
+    LOG_MSG("Following %s", f->path);
+}
+
+/**
+ * Bring the set of children in line with the topics in the directory.
+ */
+static void merge_rescan(busfs_merge m, struct fuse_file_info *fi)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *paths = g_ptr_array_new();
+    GPtrArray *gone = g_ptr_array_new();
+    struct busfs_openopts_st child_opts = m->opts;
+    guint ii;
+
+    /* Children share the filters, which remain owned by m */
+    child_opts.rdflags |= BUSFS_RDf_ATOMIC;
+
+    pthread_rwlock_rdlock(&_BFG.lock);
+    m->generation = _BFG.generation;
+
+    /* Find children whose topic went away, or moved elsewhere */
+    for (ii = m->order->len; ii > 0; ii--) {
+        busfs_reader r = m->order->pdata[ii-1];
+        busfs_file f = child_topic(r);
+
+        if (f->unlinked || !merge_covers(m, f->path)) {
+            g_ptr_array_remove_index(m->order, ii-1);
+            g_ptr_array_add(gone, r->f);
+        }
+    }
+
+    g_hash_table_iter_init(&iter, _BFG.ht);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *name = (const char*)key;
+        if (merge_covers(m, name)) {
+            g_ptr_array_add(paths, g_strdup(name));
+        }
+    }
+
+    pthread_rwlock_unlock(&_BFG.lock);
+
+    for (ii = 0; ii < gone->len; ii++) {
+        LOG_MSG("No longer following %s", ((busfs_file)gone->pdata[ii])->path);
+        g_hash_table_remove(m->children, gone->pdata[ii]);
+    }
+    g_ptr_array_free(gone, TRUE);
+
+    for (ii = 0; ii < paths->len; ii++) {
+        busfs_file f = busfs_file_get(paths->pdata[ii], BUSFS_GETf_INC);
+        uint32_t idx;
+
+        if (f == NULL) {
+            continue;
+        }
+
+        if (f->nparts == 0) {
+            merge_follow(m, f, fi, &child_opts);
+            continue;
+        }
+
+        for (idx = 0; idx < f->nparts; idx++) {
+            if (idx) {
+                /* Each partition's reference comes with one on f */
+                pthread_rwlock_wrlock(&f->sync.refs_rwlock);
+                f->refcount++;
+                pthread_rwlock_unlock(&f->sync.refs_rwlock);
+            }
+            merge_follow(m, busfs_file_partition(f, idx), fi, &child_opts);
+        }
+    }
+
+    g_ptr_array_free(paths, TRUE);
+}
+
+busfs_merge busfs_merge_new(const char *dir, struct fuse_file_info *fi,
+                            const struct busfs_openopts_st *opts)
+{
+    busfs_merge m = calloc(1, sizeof(struct busfs_merge_st));
+
+    m->common.read_func = busfs_merge_io;
+    m->common.write_func = busfs_merge_writefunc;
+    m->common.close_func = busfs_merge_close;
+    m->common.wait_func = busfs_merge_wait;
+    m->common.unwait_func = busfs_merge_unwait;
+    m->common.type = BUSFS_INFO_MERGE;
+
+    m->open_flags = fi->flags;
+    m->opts = *opts;
+    snprintf(m->dir, sizeof(m->dir), "%s", dir);
+
+    m->children = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                        NULL, merge_child_free);
+    m->order = g_ptr_array_new();
+    m->pending = g_string_new(NULL);
+
+    pthread_mutex_lock(&_BFG.merge.mutex);
+    _BFG.merge.readers++;
+    pthread_mutex_unlock(&_BFG.merge.mutex);
+
+    merge_rescan(m, fi);
+    return m;
+}
+
+/**
+ * Copy out what is left of a partially delivered message
+ */
+static size_t merge_drain(busfs_merge m, char *dst, size_t size)
+{
+    size_t toCopy = MINIMUM(size, m->pending->len - m->pending_off);
+
+    memcpy(dst, m->pending->str + m->pending_off, toCopy);
+    m->pending_off += toCopy;
+
+    if (m->pending_off == m->pending->len) {
+        g_string_truncate(m->pending, 0);
+        m->pending_off = 0;
+    }
+    return toCopy;
+}
+
+/**
+ * Take messages from each child in turn until size bytes are filled.
+ */
+static size_t merge_fill(busfs_merge m, char *dst, size_t size)
+{
+    unsigned nchildren = m->order->len;
+    unsigned ii, start = m->next++;
+    size_t total = 0, dirlen = strlen(m->dir);
+
+    for (ii = 0; ii < nchildren && total < size; ii++) {
+        busfs_reader r = m->order->pdata[(start + ii) % nchildren];
+
+        busfs_read_pop(r, child_topic(r)->path + dirlen, m->pending,
+                       size - total);
+        total += merge_drain(m, dst + total, size - total);
+
+        if (m->pending->len) {
+            /* The rest is returned by the next read */
+            break;
+        }
+    }
+
+    return total;
+}
+
+static int busfs_merge_io(busfs_common o, const char *path,
+                          char *buf, size_t size, off_t offset)
+{
+    busfs_merge m = (busfs_merge)o;
+    struct fuse_file_info fi;
+    size_t total;
+    (void)path;
+    (void)offset;
+
+    if (m->pending->len) {
+        return merge_drain(m, buf, size);
+    }
+
+    if (m->generation != _BFG.generation) {
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = m->open_flags;
+        merge_rescan(m, &fi);
+    }
+
+    /* Reads which may wait go through busfs_merge_wait() */
+    total = merge_fill(m, buf, size);
+    return total ? (int)total : -EWOULDBLOCK;
+}
+
+/**
+ * Answer the read p, or keep it until any topic is written to, or topics
+ * come or go, see busfs_merge_notify().
+ */
+static void busfs_merge_wait(busfs_common o, busfs_pending p)
+{
+    busfs_merge m = (busfs_merge)o;
+    char *buf = malloc(p->size);
+    unsigned seq;
+    int ret;
+
+    GT_BEGIN:
+    pthread_mutex_lock(&_BFG.merge.mutex);
+    seq = _BFG.merge.seq;
+    pthread_mutex_unlock(&_BFG.merge.mutex);
+
+    ret = busfs_merge_io(o, NULL, buf, p->size, 0);
+    if (ret != -EWOULDBLOCK || (m->open_flags & O_NONBLOCK)) {
+        busfs_pending_reply(p, buf, ret);
+        free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&_BFG.merge.mutex);
+    if (seq != _BFG.merge.seq || m->generation != _BFG.generation) {
+        pthread_mutex_unlock(&_BFG.merge.mutex);
+        goto GT_BEGIN;
+    }
+    if (p->interrupted) {
+        pthread_mutex_unlock(&_BFG.merge.mutex);
+        busfs_pending_reply(p, NULL, -EINTR);
+        free(buf);
+        return;
+    }
+    p->parked = 1;
+    g_queue_push_tail_link(&_BFG.merge.waiting, &p->link);
+    pthread_mutex_unlock(&_BFG.merge.mutex);
+    free(buf);
+}
+
+static int busfs_merge_unwait(busfs_common o, busfs_pending p, int interrupt)
+{
+    int taken;
+    (void)o;
+
+    pthread_mutex_lock(&_BFG.merge.mutex);
+    if (interrupt) {
+        p->interrupted = 1;
+    }
+    taken = p->parked;
+    if (taken) {
+        g_queue_unlink(&_BFG.merge.waiting, &p->link);
+        p->parked = 0;
+    }
+    pthread_mutex_unlock(&_BFG.merge.mutex);
+    return taken;
+}
@@ -0,0 +1,158 @@
+/**
+ * This file contains the NUMA placement of threads and rings. With
+ * -o numa_node=N the whole daemon runs on node N. With -o numa the worker
+ * threads are spread over every node, each topic's ring is placed on a
+ * node, and reads and writes of the topic are handed to the workers there
+ * (see busfs_loop.c), so that the ring's memory is only touched locally.
+ *
+ * A thread bound to a node runs on its CPUs and prefers its memory, so the
+ * slot buffers it allocates, which are first touched when written, are on
+ * that node. Plain syscalls are used, with no dependency on libnuma.
+ */
+
+#define _GNU_SOURCE
+
+#include "busfs.h"
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/**
+ * Parse a list of ranges such as '0-7,16-23' into set. Returns 0 or -1.
+ */
+static int numa_parse_list(const char *list, cpu_set_t *set)
+{
+    const char *cur;
+
+    CPU_ZERO(set);
+    for (cur = list; *cur && *cur != '\n'; ) {
+        char *end;
+        long first = strtol(cur, &end, 10), last = first, ii;
+
+        if (end == cur) {
+            return -1;
+        }
+        if (*end == '-') {
+            cur = end + 1;
+            last = strtol(cur, &end, 10);
+        }
+        for (ii = first; ii <= last && ii < CPU_SETSIZE; ii++) {
+            CPU_SET(ii, set);
+        }
+        cur = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+/**
+ * Put the CPUs of node into cpus. Returns 0, or -1 if there is no such
+ * node, or it has no CPUs.
+ */
+static int numa_node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64], *list = NULL;
+    int ret;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    if (node < 0 || !g_file_get_contents(path, &list, NULL, NULL)) {
+        return -1;
+    }
+    ret = numa_parse_list(list, cpus);
+    g_free(list);
+    return (ret == 0 && CPU_COUNT(cpus)) ? 0 : -1;
+}
+
+/**
+ * The number of NUMA nodes, counting from node 0 to the highest one
+ * online. 1 if the kernel doesn't say.
+ */
+int busfs_numa_nodes(void)
+{
+    static int nodes;
+    char *list = NULL;
+    cpu_set_t set;
+    int ii;
+
+    if (nodes) {
+        return nodes;
+    }
+
+    /* Node numbers are parsed as CPU numbers would be */
+    if (g_file_get_contents("/sys/devices/system/node/online", &list,
+                            NULL, NULL) && numa_parse_list(list, &set) == 0) {
+        for (ii = 0; ii < CPU_SETSIZE; ii++) {
+            if (CPU_ISSET(ii, &set)) {
+                nodes = ii + 1;
+            }
+        }
+    }
+    g_free(list);
+
+    if (nodes == 0) {
+        nodes = 1;
+    }
+    return nodes;
+}
+
+/**
+ * Keep the calling thread on node: it runs on the node's CPUs, and its
+ * allocations prefer the node's memory. Threads it creates later inherit
+ * both. Returns 0 or -1.
+ */
+int busfs_numa_bind(int node)
+{
+    unsigned long nodemask[BUSFS_NUMA_NODES_MAX / (sizeof(long) * 8)];
+    cpu_set_t cpus;
+
+    if (node < 0 || node >= (int)(sizeof(nodemask) * 8) ||
+            numa_node_cpus(node, &cpus) != 0 ||
+            sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return -1;
+    }
+
+    /* Preferred rather than bound, so that a full node doesn't fail
+     * allocations */
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[node / (sizeof(long) * 8)] |= 1UL << (node % (sizeof(long) * 8));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+                sizeof(nodemask) * 8) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * The node of the CPU the process pid last ran on, or -1
+ */
+int busfs_numa_node_of(pid_t pid)
+{
+    char path[64], *stat = NULL, *cur;
+    int node, cpu = -1, field;
+    cpu_set_t cpus;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (pid <= 0 || !g_file_get_contents(path, &stat, NULL, NULL)) {
+        return -1;
+    }
+
+    /* The command may hold spaces, and ends with the last ')'. The CPU is
+     * the 39th field */
+    cur = strrchr(stat, ')');
+    for (field = 2; cur && field < 39; field++) {
+        cur = strchr(cur + 1, ' ');
+    }
+    if (cur) {
+        cpu = atoi(cur + 1);
+    }
+    g_free(stat);
+
+    for (node = 0; cpu >= 0 && node < busfs_numa_nodes(); node++) {
+        if (numa_node_cpus(node, &cpus) == 0 && cpu < CPU_SETSIZE &&
+                CPU_ISSET(cpu, &cpus)) {
+            return node;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,338 @@
+/**
+ * This file contains parsing of per-open options. Options are appended to
+ * the last component of a path, for example:
+ *
+ *  cat 'mountpoint/topic@atomic,truncate'
+ *
+ * Everything from the '@' onwards is ignored when mapping the path to the
+ * backing filesystem or looking up the topic.
+ */
+
+#include "busfs.h"
+
+#define BUSFS_OPTS_SEP '@'
+
+static char *find_opts(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    if (base == NULL) {
+        base = path;
+    }
+    return strchr(base, BUSFS_OPTS_SEP);
+}
+
+/**
+ * Whether the path refers to the reader of a whole directory, i.e. its last
+ * component consists only of options.
+ */
+int busfs_opts_is_merge(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    return base && base[1] == BUSFS_OPTS_SEP;
+}
+
+void busfs_opts_strip(char *path)
+{
+    char *opts = find_opts(path);
+    if (opts) {
+        *opts = '\0';
+    }
+}
+
+static int parse_uint(const char *value, unsigned long max, unsigned long *out)
+{
+    char *end;
+
+    if (value == NULL || *value == '\0') {
+        return -EINVAL;
+    }
+
+    errno = 0;
+    *out = strtoul(value, &end, 10);
+    if (*end != '\0' || errno != 0 || *out > max) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int parse_seconds(const char *value, double *out)
+{
+    char *end;
+
+    if (value == NULL || *value == '\0') {
+        return -EINVAL;
+    }
+
+    errno = 0;
+    *out = strtod(value, &end);
+    if (*end != '\0' || errno != 0 || *out < 0) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int parse_one(struct busfs_openopts_st *opts,
+                     const char *key, const char *value)
+{
+    unsigned long num;
+
+    if (strcmp(key, "atomic") == 0) {
+        opts->rdflags |= BUSFS_RDf_ATOMIC;
+        if (value && strcmp(value, "truncate") == 0) {
+            opts->rdflags |= BUSFS_RDf_TRUNCATE;
+        } else if (value) {
+            return -EINVAL;
+        }
+
+    } else if (strcmp(key, "truncate") == 0) {
+        opts->rdflags |= BUSFS_RDf_ATOMIC|BUSFS_RDf_TRUNCATE;
+
+    } else if (strcmp(key, "nosnapshot") == 0) {
+        opts->rdflags |= BUSFS_RDf_NOSNAPSHOT;
+
+    } else if (strcmp(key, "cursor") == 0) {
+        if (value == NULL || *value == '\0' || strpbrk(value, "\t\n")) {
+            return -EINVAL;
+        }
+        g_free(opts->cursor);
+        opts->cursor = g_strdup(value);
+
+    } else if (strcmp(key, "status") == 0) {
+        opts->status = 1;
+
+    } else if (strcmp(key, "replay") == 0) {
+        opts->replay = 1;
+
+    } else if (strcmp(key, "export") == 0) {
+        opts->export = 1;
+
+    } else if (strcmp(key, "compact") == 0) {
+        opts->configure |= BUSFS_CONFf_COMPACT;
+        opts->compact = 1;
+
+    } else if (strcmp(key, "since") == 0 || strcmp(key, "last") == 0) {
+        double secs;
+        if (parse_seconds(value, &secs) != 0) {
+            return -EINVAL;
+        }
+
+        if (*key == 's') {
+            opts->since_ns = secs * 1e9;
+        } else {
+            opts->last_ns = secs * 1e9;
+        }
+
+    } else if (strcmp(key, "retention_ms") == 0) {
+        if (parse_uint(value, UINT32_MAX, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->configure |= BUSFS_CONFf_RETENTION;
+        opts->retention_ms = num;
+
+    } else if (strcmp(key, "partitions") == 0) {
+        if (parse_uint(value, BUSFS_PARTITIONS_MAX, &num) != 0 || num == 0) {
+            return -EINVAL;
+        }
+        opts->configure |= BUSFS_CONFf_PARTITIONS;
+        opts->partitions = num;
+
+    } else if (strcmp(key, "slots") == 0) {
+        if (parse_uint(value, BUSFS_SLOTS_MAX, &num) != 0 ||
+                num < BUSFS_SLOTS_MIN) {
+            return -EINVAL;
+        }
+        opts->configure |= BUSFS_CONFf_SLOTS;
+        opts->slots = num;
+
+    } else if (strcmp(key, "numa") == 0) {
+        if (parse_uint(value, busfs_numa_nodes() - 1, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->configure |= BUSFS_CONFf_NUMA;
+        opts->numa_node = num;
+
+    } else if (strcmp(key, "compress") == 0) {
+        opts->configure |= BUSFS_CONFf_COMPRESS;
+        opts->compress = 1;
+
+    } else if (strcmp(key, "partition") == 0) {
+        if (parse_uint(value, BUSFS_PARTITIONS_MAX - 1, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->has_partition = 1;
+        opts->partition = num;
+
+    } else if (strcmp(key, "batch_us") == 0) {
+        if (parse_uint(value, UINT32_MAX, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->configure |= BUSFS_CONFf_BATCH;
+        opts->batch_us = num;
+
+    } else if (strcmp(key, "min_bytes") == 0) {
+        if (parse_uint(value, SIZE_MAX, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->min_bytes = num;
+
+    } else if (strcmp(key, "min_msgs") == 0) {
+        if (parse_uint(value, UINT32_MAX, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->min_msgs = num;
+
+    } else if (strcmp(key, "linger_ms") == 0) {
+        if (parse_uint(value, UINT32_MAX, &num) != 0) {
+            return -EINVAL;
+        }
+        opts->linger_ms = num;
+
+    } else if (strcmp(key, "sample") == 0) {
+        if (parse_uint(value, UINT32_MAX, &num) != 0 || num == 0) {
+            return -EINVAL;
+        }
+        opts->sample = num;
+
+    } else if (strcmp(key, "max_rate") == 0) {
+        if (parse_uint(value, 1000000000, &num) != 0 || num == 0) {
+            return -EINVAL;
+        }
+        opts->max_rate = num;
+
+    } else if (strcmp(key, "latest") == 0) {
+        opts->latest = 1;
+
+    } else if (strcmp(key, "prefix") == 0 && value) {
+        g_free(opts->prefix);
+        opts->prefix = g_strdup(value);
+
+    } else if (strcmp(key, "substr") == 0 && value) {
+        g_free(opts->substr);
+        opts->substr = g_strdup(value);
+
+    } else if (strcmp(key, "regex") == 0 && value) {
+        GError *err = NULL;
+        if (opts->regex) {
+            g_regex_unref(opts->regex);
+        }
+
+        opts->regex = g_regex_new(value, G_REGEX_RAW|G_REGEX_OPTIMIZE, 0, &err);
+        if (opts->regex == NULL) {
+            LOG_MSG("Bad regex '%s': %s", value, err->message);
+            g_error_free(err);
+            return -EINVAL;
+        }
+
+    } else if (strcmp(key, "framing") == 0) {
+        opts->configure |= BUSFS_CONFf_FRAMING;
+        if (value && strcmp(value, "length") == 0) {
+            opts->framing = BUSFS_FRAMING_LENGTH;
+        } else if (value && strcmp(value, "delim") == 0) {
+            opts->framing = BUSFS_FRAMING_DELIM;
+        } else if (value && strcmp(value, "fixed") == 0) {
+            opts->framing = BUSFS_FRAMING_FIXED;
+        } else {
+            return -EINVAL;
+        }
+
+    } else if (strcmp(key, "record_size") == 0) {
+        if (parse_uint(value, BUSFS_RECORD_MAXLEN, &num) != 0 || num == 0) {
+            return -EINVAL;
+        }
+        if ((opts->configure & BUSFS_CONFf_FRAMING) == 0) {
+            opts->configure |= BUSFS_CONFf_FRAMING;
+            opts->framing = BUSFS_FRAMING_FIXED;
+        }
+        opts->record_size = num;
+
+    } else {
+        LOG_MSG("Unknown option '%s'", key);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * Free anything allocated while parsing the options
+ */
+void busfs_opts_clear(struct busfs_openopts_st *opts)
+{
+    g_free(opts->prefix);
+    g_free(opts->substr);
+    g_free(opts->cursor);
+    if (opts->regex) {
+        g_regex_unref(opts->regex);
+    }
+
+    opts->prefix = NULL;
+    opts->substr = NULL;
+    opts->cursor = NULL;
+    opts->regex = NULL;
+}
+
+/**
+ * Split path into the topic name (copied into base, which must be at least
+ * FILENAME_MAX bytes) and its options. Returns 0 or a negative errno.
+ */
+int busfs_opts_parse(const char *path, char *base,
+                     struct busfs_openopts_st *opts)
+{
+    char **optv, **cur;
+    int ret = 0;
+
+    memset(opts, 0, sizeof(*opts));
+    snprintf(base, FILENAME_MAX, "%s", path);
+
+    char *optstr = find_opts(base);
+    if (optstr == NULL) {
+        return 0;
+    }
+
+    *optstr = '\0';
+    optstr++;
+
+    optv = g_strsplit(optstr, ",", -1);
+
+    for (cur = optv; *cur && ret == 0; cur++) {
+        char *value = strchr(*cur, '=');
+        if (**cur == '\0') {
+            continue;
+        }
+
+        if (value) {
+            *value = '\0';
+            value = g_uri_unescape_string(value + 1, NULL);
+            if (value == NULL) {
+                ret = -EINVAL;
+                break;
+            }
+        }
+
+        ret = parse_one(opts, *cur, value);
+        g_free(value);
+    }
+
+    g_strfreev(optv);
+
+    if (ret == 0 && opts->latest && (opts->sample || opts->max_rate)) {
+        /* The newest message can't also be a sample of the others */
+        ret = -EINVAL;
+    }
+
+    if (ret == 0 && (opts->configure & BUSFS_CONFf_FRAMING) &&
+            (opts->framing == BUSFS_FRAMING_FIXED) != !!opts->record_size) {
+        /* Fixed framing needs a record size, and nothing else takes one */
+        ret = -EINVAL;
+    }
+
+    if (ret != 0) {
+        busfs_opts_clear(opts);
+        return ret;
+    }
+
+    if ((opts->min_bytes || opts->min_msgs) && opts->linger_ms == 0) {
+        opts->linger_ms = BUSFS_LINGER_DEFAULT_MS;
+    }
+    return ret;
+}
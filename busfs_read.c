@@ -2,21 +2,57 @@
  * This file contains position and data polling for handles opened for reading
  */
 
+#define _GNU_SOURCE
 #include "busfs.h"
 #include "busfs_util.h"
+#include <arpa/inet.h>
 
 #define _BFG BusFS_Global
 #define MINIMUM(a, b) ( ((a) < (b)) ? (a) : (b) )
 
 static void dgram_get_oldest(busfs_file, busfs_dgram **dgramp, uint16_t *idx);
+static int reader_match(busfs_reader r, busfs_dgram *msg);
 
 static int busfs_read_io(busfs_common o, const char *path,
                          char *buf, size_t size, off_t offset);
+static int busfs_read_poll(busfs_common o, struct fuse_pollhandle *ph,
+                           unsigned *reventsp);
+static void busfs_read_wait(busfs_common o, busfs_pending p);
+static int busfs_read_unwait(busfs_common o, busfs_pending p, int interrupt);
+
+/**
+ * Stop listing r in status files, and save its cursor if it has one
+ */
+static void reader_unregister(busfs_reader r)
+{
+    if (r->opts.cursor) {
+        busfs_cursor_detach(r);
+    }
+
+    pthread_rwlock_wrlock(&r->f->sync.refs_rwlock);
+    g_hash_table_remove(r->f->readers, r);
+    pthread_rwlock_unlock(&r->f->sync.refs_rwlock);
+
+    pthread_mutex_lock(&r->f->sync.poll_mutex);
+    if (r->poll_ph) {
+        g_hash_table_remove(r->f->pollers, r);
+        g_atomic_int_add(&r->f->nwaiting, -1);
+        fuse_pollhandle_destroy(r->poll_ph);
+        r->poll_ph = NULL;
+    }
+    pthread_mutex_unlock(&r->f->sync.poll_mutex);
+}
 
 static int busfs_read_close(busfs_common o, const char *path)
 {
     busfs_reader r = (busfs_reader)o;
+    reader_unregister(r);
     busfs_file_release(r->f, BUSFS_INFO_READER);
+    busfs_opts_clear(&r->opts);
+    if (r->snapshot) {
+        g_string_free(r->snapshot, TRUE);
+    }
+    busfs_zcache_clear(&r->zcache);
     free(r);
     return 0;
 }
@@ -32,32 +68,164 @@ static int busfs_read_writefunc(busfs_common o,
     return -EBADF;
 }
 
-busfs_reader busfs_read_new(busfs_file f, struct fuse_file_info *fi)
+static gint latest_cmp(gconstpointer a, gconstpointer b)
+{
+    const busfs_latest *la = *(const busfs_latest**)a;
+    const busfs_latest *lb = *(const busfs_latest**)b;
+
+    if (la->serial == lb->serial) {
+        return 0;
+    }
+    return BUSFS_SERIAL_BEFORE(la->serial, lb->serial) ? -1 : 1;
+}
+
+/**
+ * Collect the latest message for each key of a compacted topic, in the
+ * order they were written. Must be called with buf_rwlock held.
+ */
+static GString *make_snapshot(busfs_reader r)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *entries = g_ptr_array_new();
+    GString *snapshot = g_string_new(NULL);
+    guint ii;
+
+    g_hash_table_iter_init(&iter, r->f->latest);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_ptr_array_add(entries, value);
+    }
+    g_ptr_array_sort(entries, latest_cmp);
+
+    for (ii = 0; ii < entries->len; ii++) {
+        busfs_latest *latest = entries->pdata[ii];
+        busfs_dgram msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.root = latest->root;
+        msg.msgsize = latest->msgsize;
+
+        if (reader_match(r, &msg)) {
+            g_string_append_len(snapshot, latest->root, latest->msgsize);
+        }
+    }
+
+    g_ptr_array_free(entries, TRUE);
+    return snapshot;
+}
+
+/**
+ * Find the first committed message stamped at or after ts, using a binary
+ * search over the ring. Must be called with buf_rwlock held. Returns its
+ * serial, or the current serial if there is no such message.
+ */
+static uint32_t dgram_find_time(busfs_file f, uint64_t ts)
+{
+    size_t lo = 0, hi = f->serial - f->head_serial;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        busfs_dgram *msg = f->dgrams + (f->head_idx + mid) % f->dgram_count;
+
+        if (msg->ts < ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return f->head_serial + lo;
+}
+
+/**
+ * Convert the since/last options to a busfs_clock_ns() timestamp
+ */
+static uint64_t reader_start_time(const struct busfs_openopts_st *opts)
+{
+    uint64_t now = busfs_clock_ns(), start = 0;
+    int64_t since = (int64_t)opts->since_ns - _BFG.clock_offset_ns;
+
+    if (opts->since_ns && since > 0) {
+        start = since;
+    }
+
+    if (opts->last_ns && opts->last_ns < now && now - opts->last_ns > start) {
+        start = now - opts->last_ns;
+    }
+    return start;
+}
+
+busfs_reader busfs_read_new(busfs_file f, struct fuse_file_info *fi,
+                            const struct busfs_openopts_st *opts)
 {
     busfs_reader ret = calloc(1, sizeof(struct busfs_reader_st));
     busfs_dgram *dgram;
+    uint32_t saved;
+    int resume = opts->cursor &&
+            busfs_cursor_lookup(f, opts->cursor, &saved);
 
     ret->common.read_func = busfs_read_io;
     ret->common.write_func = busfs_read_writefunc;
     ret->common.close_func = busfs_read_close;
+    ret->common.poll_func = busfs_read_poll;
+    ret->common.wait_func = busfs_read_wait;
+    ret->common.unwait_func = busfs_read_unwait;
     ret->common.type = BUSFS_INFO_READER;
 
     ret->f = f;
     ret->r_offset = 0;
     ret->open_flags = fi->flags;
+    ret->opts = *opts;
+    ret->pid = busfs_loop_request() ? busfs_loop_request()->pid : 0;
 
     /* Lock the refcount */
     pthread_rwlock_wrlock(&f->sync.refs_rwlock);
 
     f->reader_count++;
+    if (f->readers == NULL) {
+        f->readers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    g_hash_table_insert(f->readers, ret, ret);
 
     pthread_rwlock_unlock(&f->sync.refs_rwlock);
 
-    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
-    dgram_get_oldest(f, &dgram, &ret->r_idx);
-    ret->r_serial = dgram->serial;
+    busfs_write_drain(f);
+    if (f->retention_ns) {
+        pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+        busfs_file_expire(f, busfs_clock_ns());
+    } else {
+        pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+    }
+
+    if (resume) {
+        /* Positions outside the ring are dealt with on the first read */
+        ret->r_serial = saved;
+        ret->r_idx = BUSFS_SERIAL_IDX(f, saved);
+
+    } else if (opts->since_ns || opts->last_ns) {
+        ret->r_serial = dgram_find_time(f, reader_start_time(opts));
+        ret->r_idx = BUSFS_SERIAL_IDX(f, ret->r_serial);
+
+    } else if (f->latest && (opts->rdflags & BUSFS_RDf_NOSNAPSHOT) == 0) {
+        /* Start with the current state, followed by the live tail */
+        ret->snapshot = make_snapshot(ret);
+        if (ret->snapshot->len == 0) {
+            g_string_free(ret->snapshot, TRUE);
+            ret->snapshot = NULL;
+        }
+        ret->r_idx = f->curidx;
+        ret->r_serial = f->serial;
+    } else {
+        dgram_get_oldest(f, &dgram, &ret->r_idx);
+        ret->r_serial = dgram->serial;
+    }
+    ret->ring_gen = f->ring_gen;
+    ret->next_serial = (gint)ret->r_serial;
     pthread_rwlock_unlock(&f->sync.buf_rwlock);
 
+    if (opts->cursor) {
+        busfs_cursor_attach(ret);
+    }
     return ret;
 }
 
@@ -69,10 +237,9 @@ static busfs_dgram *get_next_message(busfs_reader r, busfs_dgram *msg)
 {
     uint16_t nextidx = (r->r_idx+1) % (r->f->dgram_count);
     busfs_dgram *nextmsg = r->f->dgrams + nextidx;
-    uint32_t diff = nextmsg->serial - msg->serial;
 
-    if (diff != 1) {
-        /* Overflow */
+    if (msg->serial == r->f->serial) {
+        /* This is the message currently being written */
         return NULL;
     }
 
@@ -84,6 +251,231 @@ static busfs_dgram *get_next_message(busfs_reader r, busfs_dgram *msg)
     return msg;
 }
 
+static inline int reader_has_filter(busfs_reader r)
+{
+    return r->opts.prefix || r->opts.substr || r->opts.regex;
+}
+
+/**
+ * Whether the reader only wants some of the messages which match: a
+ * sample, those within a rate, or the newest
+ */
+static inline int reader_is_thinned(busfs_reader r)
+{
+    return r->opts.sample || r->opts.max_rate || r->opts.latest;
+}
+
+/**
+ * Whether the reader may only see committed messages. Length-prefixed
+ * topics never expose the message being written, as its length is unknown,
+ * and filters can only be applied to whole messages.
+ */
+static inline int reader_committed_only(busfs_reader r)
+{
+    return (r->opts.rdflags & BUSFS_RDf_ATOMIC) ||
+            r->f->framing != BUSFS_FRAMING_DELIM ||
+            reader_has_filter(r) || reader_is_thinned(r);
+}
+
+/**
+ * Check a committed message against the reader's filters. The delimiter
+ * is not considered part of the message.
+ */
+static int reader_match(busfs_reader r, busfs_dgram *msg)
+{
+    size_t len = msg->msgsize;
+    const char *data;
+
+    if (!reader_has_filter(r)) {
+        return 1;
+    }
+
+    data = busfs_dgram_data(msg, &r->zcache);
+    if (r->f->framing == BUSFS_FRAMING_DELIM &&
+            len && data[len-1] == r->f->delim) {
+        len--;
+    }
+
+    if (r->opts.prefix) {
+        size_t plen = strlen(r->opts.prefix);
+        if (plen > len || memcmp(data, r->opts.prefix, plen) != 0) {
+            return 0;
+        }
+    }
+
+    if (r->opts.substr &&
+            memmem(data, len, r->opts.substr,
+                   strlen(r->opts.substr)) == NULL) {
+        return 0;
+    }
+
+    if (r->opts.regex &&
+            !g_regex_match_full(r->opts.regex, data, len,
+                                0, 0, NULL, NULL)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Whether r should receive a committed message: it must match the filters,
+ * and be picked by sampling and the rate cap. The decision is remembered,
+ * as a message which didn't fit into one read is looked at again by the
+ * next. Dropped messages are never copied.
+ */
+static int reader_wants(busfs_reader r, busfs_dgram *msg)
+{
+    int selected;
+
+    if (!r->opts.sample && !r->opts.max_rate) {
+        return reader_match(r, msg);
+    }
+
+    if (r->sel.valid && r->sel.serial == msg->serial) {
+        return r->sel.selected;
+    }
+
+    selected = reader_match(r, msg);
+
+    if (selected && r->opts.sample) {
+        selected = (r->sel.count++ % r->opts.sample) == 0;
+    }
+
+    if (selected && r->opts.max_rate) {
+        /* Messages are spaced by interval, with bursts of up to a second's
+         * worth after a quiet spell */
+        uint64_t interval = 1000000000 / r->opts.max_rate;
+        uint64_t now = busfs_clock_ns();
+
+        if (r->sel.tat_ns > now + 1000000000 - interval) {
+            selected = 0;
+        } else {
+            r->sel.tat_ns = (r->sel.tat_ns > now ? r->sel.tat_ns : now) +
+                    interval;
+        }
+    }
+
+    r->sel.serial = msg->serial;
+    r->sel.valid = 1;
+    r->sel.selected = selected;
+    return selected;
+}
+
+/**
+ * For readers which only want the newest message, skip the committed
+ * messages before the newest one which matches the filters. A message
+ * which is partly read is finished first. Must be called with buf_rwlock
+ * held. Returns the reader's current message.
+ */
+static busfs_dgram *reader_conflate(busfs_reader r, busfs_dgram *msg)
+{
+    busfs_file f = r->f;
+    uint32_t serial;
+
+    if (r->r_serial == f->serial ||
+            (r->r_offset && r->r_offset < BUSFS_MSG_LENGTH(f, msg))) {
+        return msg;
+    }
+
+    for (serial = f->serial - 1; BUSFS_SERIAL_BEFORE(r->r_serial, serial);
+            serial--) {
+        if (reader_match(r, f->dgrams + BUSFS_SERIAL_IDX(f, serial))) {
+            break;
+        }
+    }
+
+    if (serial != r->r_serial) {
+        r->r_idx = BUSFS_SERIAL_IDX(f, serial);
+        r->r_serial = serial;
+        r->r_offset = 0;
+        msg = f->dgrams + r->r_idx;
+    }
+    return msg;
+}
+
+/**
+ * Copy size bytes of a message to dst, starting at offset. Offsets
+ * include the length header, if the topic has one. Must be called with
+ * buf_rwlock held.
+ */
+void busfs_read_copy(busfs_file f, busfs_dgram *msg, busfs_zcache *zc,
+                     size_t offset, char *dst, size_t size)
+{
+    size_t hdrlen = BUSFS_FRAME_HDRLEN(f);
+
+    if (offset < hdrlen) {
+        uint32_t hdr = htonl(msg->msgsize);
+        size_t toCopy = MINIMUM(size, hdrlen - offset);
+
+        memcpy(dst, (char*)&hdr + offset, toCopy);
+        dst += toCopy;
+        size -= toCopy;
+        offset += toCopy;
+    }
+
+    if (size) {
+        memcpy(dst, busfs_dgram_data(msg, zc) + (offset - hdrlen), size);
+    }
+}
+
+/**
+ * Whether r takes every committed record of a fixed-record topic, which
+ * may then be copied out of the arena in runs
+ */
+static inline int reader_reads_runs(busfs_reader r)
+{
+    return r->f->framing == BUSFS_FRAMING_FIXED &&
+            !reader_has_filter(r) && !reader_is_thinned(r);
+}
+
+/**
+ * Copy committed records of a fixed-record topic, with one memcpy for each
+ * run of slots up to the end of the arena. With atomic, only whole records
+ * are copied. The reader's position is found by arithmetic, rather than by
+ * stepping through the records.
+ */
+static ssize_t read_fixed(busfs_reader r, char *dst, size_t size, int atomic)
+{
+    busfs_file f = r->f;
+    size_t rs = f->record_size, total = 0;
+
+    while (total < size && r->r_serial != f->serial) {
+        size_t nrecs, toCopy, pos;
+
+        if (r->r_offset == rs) {
+            r->r_idx = (r->r_idx + 1) % f->dgram_count;
+            r->r_serial++;
+            r->r_offset = 0;
+            continue;
+        }
+
+        nrecs = MINIMUM(f->serial - r->r_serial, f->dgram_count - r->r_idx);
+        toCopy = MINIMUM(size - total, nrecs * rs - r->r_offset);
+        if (atomic) {
+            toCopy -= toCopy % rs;
+            if (toCopy == 0) {
+                break;
+            }
+        }
+
+        memcpy(dst + total, f->arena + r->r_idx * rs + r->r_offset, toCopy);
+        total += toCopy;
+
+        /* Stay on the last record touched, as get_next_message() would */
+        pos = r->r_offset + toCopy - 1;
+        r->r_idx += pos / rs;
+        r->r_serial += pos / rs;
+        r->r_offset = pos % rs + 1;
+    }
+
+    if (total == 0) {
+        return -EAGAIN;
+    }
+    LOG_MSG("READ: Returning %lu", total);
+    return total;
+}
+
 /**
  * This helper function tries to read size data from the ringbuffer,
  * returning the amount of bytes left to read.
@@ -92,16 +484,27 @@ static ssize_t read_file(busfs_reader r, char *dst, size_t size)
 {
     busfs_dgram *msg = r->f->dgrams + r->r_idx;
     size_t origsize = size, total = 0;
+    int committed_only = reader_committed_only(r);
+
+    if (reader_reads_runs(r)) {
+        return read_fixed(r, dst, size, 0);
+    }
 
     while (size) {
-        char *src = msg->root;
-        size_t toCopy = msg->msgsize;
+        size_t toCopy;
+
+        if (committed_only && msg->serial == r->f->serial) {
+            break;
+        }
+
+        if (r->r_offset == 0 && !reader_wants(r, msg)) {
+            r->r_offset = BUSFS_MSG_LENGTH(r->f, msg);
+        }
 
+        toCopy = BUSFS_MSG_LENGTH(r->f, msg);
         toCopy -= r->r_offset;
         toCopy = MINIMUM(size, toCopy);
 
-        src += r->r_offset;
-
         if (toCopy == 0) {
             msg = get_next_message(r, msg);
             if (msg == NULL) {
@@ -111,7 +514,7 @@ static ssize_t read_file(busfs_reader r, char *dst, size_t size)
             }
         }
 
-        memcpy(dst, src, toCopy);
+        busfs_read_copy(r->f, msg, &r->zcache, r->r_offset, dst, toCopy);
         size -= toCopy;
         dst += toCopy;
         total += toCopy;
@@ -127,196 +530,613 @@ static ssize_t read_file(busfs_reader r, char *dst, size_t size)
 }
 
 /**
- * Get the oldest datagram in the ringbuffer.
+ * Like read_file(), but only copies whole, committed messages. If the first
+ * message does not fit into the buffer, this either fails with EMSGSIZE, or
+ * (with BUSFS_RDf_TRUNCATE) returns the head of the message and discards
+ * the remainder.
  */
-static void dgram_get_oldest(busfs_file f, busfs_dgram **dgramp, uint16_t *idx)
+static ssize_t read_file_atomic(busfs_reader r, char *dst, size_t size)
 {
-    uint16_t diff = f->curidx - (f->dgram_count-1);
-    *idx = f->curidx - diff;
-    *dgramp = f->dgrams + (size_t)(*idx);
+    busfs_dgram *msg = r->f->dgrams + r->r_idx;
+    size_t total = 0;
+
+    if (reader_reads_runs(r) && size >= r->f->record_size) {
+        return read_fixed(r, dst, size, 1);
+    }
 
-    if ( (*dgramp)->msgsize == 0) {
-        uint16_t idx_start = *idx;
-        do {
+    while (msg->serial != r->f->serial) {
+        size_t toCopy = BUSFS_MSG_LENGTH(r->f, msg) - r->r_offset;
 
-            *dgramp = f->dgrams + (size_t)(*idx);
-            if ( (*dgramp)->msgsize) {
+        if (r->r_offset == 0 && !reader_wants(r, msg)) {
+            r->r_offset = BUSFS_MSG_LENGTH(r->f, msg);
+            msg = get_next_message(r, msg);
+            continue;
+        }
+
+        if (toCopy > size - total) {
+            if (total) {
                 break;
             }
 
-            *(idx) += 1;
-            *idx %= (f->dgram_count);
+            if ((r->opts.rdflags & BUSFS_RDf_TRUNCATE) == 0) {
+                LOG_MSG("Message of %lu bytes too large for %lu",
+                        toCopy, size);
+                return -EMSGSIZE;
+            }
+            toCopy = size;
+        }
 
-        } while(*idx != idx_start);
+        busfs_read_copy(r->f, msg, &r->zcache, r->r_offset,
+                        dst + total, toCopy);
+        total += toCopy;
 
-        if (*idx == idx_start) {
-            *idx = f->curidx;
-            *dgramp = f->dgrams;
-        }
+        r->r_offset = BUSFS_MSG_LENGTH(r->f, msg);
+        msg = get_next_message(r, msg);
     }
 
+    if (total == 0) {
+        return -EAGAIN;
+    }
+    LOG_MSG("READ: Returning %lu", total);
+    return total;
 }
 
 /**
- * Signal handler, to increase the current thread's iowait sequence.
+ * Return data from the reader's snapshot. Messages in a snapshot always
+ * end with the delimiter, which is used to honour BUSFS_RDf_ATOMIC.
  */
-void busfs_read_interrupt_handler(int sig)
+static ssize_t read_snapshot(busfs_reader r, char *dst, size_t size)
 {
-    /* Set the cancellation key */
-    unsigned int *curseqp =
-            (unsigned int*)pthread_getspecific(_BFG.iowait_seq_key);
+    const char *src = r->snapshot->str + r->snap_off;
+    size_t toCopy = MINIMUM(size, r->snapshot->len - r->snap_off);
+    size_t skip = 0;
 
-    if (curseqp == NULL) {
-        LOG_MSG("No current seq_key");
-        return;
+    if (r->opts.rdflags & BUSFS_RDf_ATOMIC) {
+        const char *end = memrchr(src, r->f->delim, toCopy);
+
+        if (end) {
+            toCopy = end - src + 1;
+
+        } else if (toCopy < r->snapshot->len - r->snap_off) {
+            /* The first message doesn't fit */
+            if ((r->opts.rdflags & BUSFS_RDf_TRUNCATE) == 0) {
+                return -EMSGSIZE;
+            }
+            end = memchr(src, r->f->delim, r->snapshot->len - r->snap_off);
+            skip = (end - src + 1) - toCopy;
+        }
+    }
+
+    memcpy(dst, src, toCopy);
+    r->snap_off += toCopy + skip;
+
+    if (r->snap_off == r->snapshot->len) {
+        g_string_free(r->snapshot, TRUE);
+        r->snapshot = NULL;
+        r->snap_off = 0;
+    }
+    return toCopy;
+}
+
+/**
+ * Whether there is nothing for the reader to consume at its current
+ * position.
+ */
+static int reader_at_end(busfs_reader r, busfs_dgram *msg)
+{
+    if (reader_committed_only(r)) {
+        if (r->r_serial == r->f->serial) {
+            return 1;
+        }
+        return r->r_offset == BUSFS_MSG_LENGTH(r->f, msg) &&
+                r->r_serial + 1 == r->f->serial;
     }
 
-    *curseqp += 1;
-    LOG_MSG("Increasing iowait sequence: %d => %d", *curseqp-1, *curseqp);
+    return r->r_serial == r->f->serial && msg->msgsize == r->r_offset;
+}
+
+/**
+ * Number of bytes the reader could consume from its current position.
+ * This may be called without holding buf_rwlock, in which case the result
+ * is only a hint.
+ */
+static uint64_t reader_bytes_pending(busfs_reader r, busfs_dgram *msg)
+{
+    busfs_dgram *cur = r->f->dgrams + r->f->curidx;
+    uint64_t end = cur->boff, pos = msg->boff + r->r_offset;
+
+    if (!reader_committed_only(r)) {
+        end += cur->msgsize;
+    }
+    return (end > pos) ? end - pos : 0;
 }
 
-static inline void mk_condwait_tmo(struct timespec *timeout)
+/**
+ * Number of committed messages the reader has not fully consumed
+ */
+static uint32_t reader_msgs_pending(busfs_reader r, busfs_dgram *msg)
 {
-    struct timeval now, offset, result;
-    gettimeofday(&now, NULL);
-    offset.tv_sec = 0;
-    offset.tv_usec = 250000;
-    busfs_timeval_add(&result, &now, &offset);
-    timeout->tv_sec = result.tv_sec;
-    timeout->tv_nsec = result.tv_usec * 1000;
+    uint32_t count = r->f->serial - r->r_serial;
+
+    if (count && r->r_offset == BUSFS_MSG_LENGTH(r->f, msg)) {
+        count--;
+    }
+    return count;
 }
 
 /**
- * Wait for more data arrives in the ringbuffer, or the operation is interrupted
+ * Whether enough data has accumulated to satisfy the reader's min_bytes or
+ * min_msgs threshold.
  */
-static inline int wait_for_more_data(busfs_reader r,
-                                     busfs_dgram *msg,
-                                     uint32_t current_serial, size_t current_size)
+static int reader_batch_ready(busfs_reader r, busfs_dgram *msg)
 {
-    int status;
-    int ret = 0;
+    if (BUSFS_SERIAL_BEFORE(r->r_serial, r->f->head_serial)) {
+        return 1;
+    }
 
-    unsigned int waitseq = 42;
-    unsigned int start_seq = waitseq;
-    int do_loop = 1;
+    if (r->opts.min_msgs &&
+            reader_msgs_pending(r, msg) >= r->opts.min_msgs) {
+        return 1;
+    }
+
+    if (r->opts.min_bytes &&
+            reader_bytes_pending(r, msg) >= r->opts.min_bytes) {
+        return 1;
+    }
 
-    pthread_setspecific(_BFG.iowait_seq_key, &waitseq);
+    return 0;
+}
 
-    LOG_MSG("Will try and wait for updates... (wait=%u,start=%u)",
-            waitseq,start_seq);
-    status = -1;
+/**
+ * Get the oldest datagram in the ringbuffer. The head is maintained by the
+ * writer, so this is constant time.
+ */
+static void dgram_get_oldest(busfs_file f, busfs_dgram **dgramp, uint16_t *idx)
+{
+    *idx = f->head_idx;
+    *dgramp = f->dgrams + (size_t)(*idx);
+}
 
-#define _HAVE_NEW_DATA \
-    (r->f->serial != current_serial || msg->msgsize != current_size \
-            || (r->f->unlinked && r->f->writer_count == 0) )
+/**
+ * If the reader has been overtaken by the writer, move it to the oldest
+ * message. Must be called with buf_rwlock held. Returns the reader's
+ * current message.
+ */
+static busfs_dgram *reader_check_overrun(busfs_reader r)
+{
+    busfs_dgram *msg;
 
-    while(do_loop) {
-        struct timespec timeout;
+    if (r->ring_gen != r->f->ring_gen) {
+        /* The ring was rebuilt while empty, so r is either at its end,
+         * or behind it and rolls over below */
+        r->ring_gen = r->f->ring_gen;
+        r->r_idx = r->f->head_idx;
+    }
+    msg = r->f->dgrams + r->r_idx;
 
-        if (waitseq != start_seq) {
-            LOG_MSG("Detected interrupt");
-            ret = -EINTR;
-            /* Not locked yet */
-            goto GT_RET;
+    if (BUSFS_SERIAL_BEFORE(r->r_serial, r->f->head_serial) ||
+            BUSFS_SERIAL_BEFORE(r->f->serial, r->r_serial)) {
+        /* We've had a ringbuffer wrap-around.
+         * This obviously means we've skipped some messages,
+         *
+         * A replica may also have jumped back after its leader restarted.
+         */
+        dgram_get_oldest(r->f, &msg, &r->r_idx);
+        LOG_MSG("Rollover index: %d", r->r_idx);
+        if (BUSFS_SERIAL_BEFORE(r->r_serial, msg->serial)) {
+            BUSFS_STAT_ADD(r->stats.skipped, msg->serial - r->r_serial);
         }
+        r->r_serial = msg->serial;
+        r->r_offset = 0;
+    }
+    return msg;
+}
 
-        pthread_mutex_lock(&r->f->sync.iowait_mutex);
+/**
+ * Record where r should resume, for its cursor and status files: the
+ * message being read, unless it has been read whole. Must be called with
+ * buf_rwlock held.
+ */
+static void reader_save_position(busfs_reader r)
+{
+    busfs_dgram *msg = r->f->dgrams + r->r_idx;
+    uint32_t next = r->r_serial;
 
-        /* We already have data, no need to wait for cond signal */
+    if (msg->serial != r->f->serial &&
+            r->r_offset >= BUSFS_MSG_LENGTH(r->f, msg)) {
+        next++;
+    }
+    g_atomic_int_set(&r->next_serial, (gint)next);
+}
 
-        if (_HAVE_NEW_DATA) {
-            ret = 0;
-            goto GT_UNLOCK;
+/**
+ * Append whole, committed messages for r to out, each preceded by tag and a
+ * tab, while out stays within max bytes. At least one message is appended
+ * if any is available. Returns the number of messages appended.
+ *
+ * This is used by directory readers, and only supports delimited topics.
+ * A snapshot comes first, as it does for read(2).
+ */
+size_t busfs_read_pop(busfs_reader r, const char *tag,
+                      GString *out, size_t max)
+{
+    busfs_file f = r->f;
+    busfs_dgram *msg;
+    size_t count = 0, taglen = strlen(tag);
+
+    while (r->snapshot) {
+        const char *src = r->snapshot->str + r->snap_off;
+        const char *end = memchr(src, f->delim,
+                                 r->snapshot->len - r->snap_off);
+        size_t len = end - src + 1;
+
+        if (count && out->len + taglen + 1 + len > max) {
+            return count;
         }
 
-        mk_condwait_tmo(&timeout);
-        status = pthread_cond_timedwait(&r->f->sync.iowait_cond,
-                                        &r->f->sync.iowait_mutex,
-                                        &timeout);
+        g_string_append_len(out, tag, taglen);
+        g_string_append_c(out, '\t');
+        g_string_append_len(out, src, len);
+        count++;
 
-        if (_HAVE_NEW_DATA) {
-            ret = 0;
-            goto GT_UNLOCK;
+        r->snap_off += len;
+        if (r->snap_off == r->snapshot->len) {
+            g_string_free(r->snapshot, TRUE);
+            r->snapshot = NULL;
+            r->snap_off = 0;
+        }
+    }
+
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+
+    if (f->framing != BUSFS_FRAMING_DELIM) {
+        goto GT_RET;
+    }
+
+    msg = reader_check_overrun(r);
+    if (r->opts.latest) {
+        msg = reader_conflate(r, msg);
+    }
+
+    while (msg->serial != f->serial) {
+        if (r->r_offset == 0 && reader_wants(r, msg)) {
+            if (count && out->len + taglen + 1 + msg->msgsize > max) {
+                break;
+            }
+
+            g_string_append_len(out, tag, taglen);
+            g_string_append_c(out, '\t');
+            g_string_append_len(out, busfs_dgram_data(msg, &r->zcache),
+                                msg->msgsize);
+            count++;
         }
-        pthread_mutex_unlock(&r->f->sync.iowait_mutex);
+
+        r->r_offset = msg->msgsize;
+        msg = get_next_message(r, msg);
     }
 
-#undef _HAVE_NEW_DATA
+    reader_save_position(r);
+
+    GT_RET:
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    return count;
+}
+
+/**
+ * Free a reader which doesn't own its options
+ */
+void busfs_read_detach(busfs_reader r)
+{
+    reader_unregister(r);
+    busfs_file_release(r->f, BUSFS_INFO_READER);
+    busfs_zcache_clear(&r->zcache);
+    free(r);
+}
+
+/**
+ * Append a line for each open reader of f to out, with the number of
+ * messages between it and the newest message of the topic (tail).
+ */
+void busfs_read_dump(busfs_file f, uint32_t tail, GString *out)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    pthread_rwlock_rdlock(&f->sync.refs_rwlock);
+    if (f->readers == NULL) {
+        goto GT_RET;
+    }
 
-    GT_UNLOCK:
-    pthread_mutex_unlock(&r->f->sync.iowait_mutex);
+    g_hash_table_iter_init(&iter, f->readers);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        busfs_reader r = key;
+        uint32_t next = (uint32_t)g_atomic_int_get(&r->next_serial);
+
+        g_string_append_printf(out, "reader %d %u %u %llu %llu %s\n",
+                (int)r->pid, next,
+                BUSFS_SERIAL_BEFORE(next, tail) ? tail - next : 0,
+                (unsigned long long)BUSFS_STAT_GET(r->stats.skipped),
+                (unsigned long long)
+                        (BUSFS_STAT_GET(r->stats.blocked_ns) / 1000000),
+                r->opts.cursor ? r->opts.cursor : "-");
+    }
 
     GT_RET:
-    pthread_setspecific(_BFG.iowait_seq_key, NULL);
-    LOG_MSG("Returning %d", ret);
+    pthread_rwlock_unlock(&f->sync.refs_rwlock);
+}
+
+/**
+ * Keep p on the topic's list of waiting reads, to be looked at again after
+ * the next commit. Must be called with buf_rwlock held, so that nothing is
+ * committed between the reader finding nothing to read and p being kept.
+ * Returns -EAGAIN if p was kept, -EINTR if it has been interrupted, or 0 if
+ * the topic has been unlinked and has no writers left.
+ */
+static int reader_park(busfs_reader r, busfs_pending p)
+{
+    busfs_file f = r->f;
+    int ret = -EAGAIN;
+
+    pthread_mutex_lock(&f->sync.poll_mutex);
+    if (p->interrupted) {
+        ret = -EINTR;
+    } else if (f->unlinked && f->writer_count == 0) {
+        ret = 0;
+    } else {
+        if (p->since_ns == 0) {
+            p->since_ns = busfs_clock_ns();
+        }
+        p->parked = 1;
+        g_queue_push_tail_link(&f->waiting, &p->link);
+        g_atomic_int_add(&f->nwaiting, 1);
+    }
+    pthread_mutex_unlock(&f->sync.poll_mutex);
     return ret;
 }
 
-static int busfs_read_io(busfs_common o, const char *path,
-                         char *buf, size_t size, off_t offset)
+/**
+ * Read for r without waiting. While lingering, a batching reader only
+ * takes a complete batch. If there is nothing to take, p is kept to be
+ * answered later, if given. Returns the number of bytes read, 0 at the end
+ * of an unlinked topic, -EAGAIN if there was nothing to read (and p was
+ * kept), or another negative errno.
+ */
+static int reader_read(busfs_reader r, char *buf, size_t size, int lingering,
+                       busfs_pending p)
 {
-    int ret, my_errno = 0;
-    int status;
-    busfs_reader r = (busfs_reader)o;
-    (void)offset;
+    busfs_file f = r->f;
+    busfs_dgram *msg;
+    int ret, ended;
 
+    if (r->snapshot) {
+        return read_snapshot(r, buf, size);
+    }
 
     GT_BEGIN:
-    pthread_rwlock_rdlock(&r->f->sync.buf_rwlock);
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
 
-    busfs_dgram *msg = r->f->dgrams + r->r_idx;
+    if (f->retention_ns && busfs_file_expired(f, busfs_clock_ns())) {
+        /* Messages have aged out since the topic was last written */
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+        pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+        busfs_file_expire(f, busfs_clock_ns());
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+        goto GT_BEGIN;
+    }
+
+    msg = reader_check_overrun(r);
     LOG_MSG("Current index is %d", r->r_idx);
     LOG_MSG("Current serial is %lu", r->r_serial);
 
-    if (msg->serial == r->r_serial && msg->msgsize == r->r_offset) {
-        /* No change since last read */
+    if (r->opts.latest) {
+        msg = reader_conflate(r, msg);
+    }
 
-        uint32_t current_serial = r->f->serial;
-        size_t current_size = msg->msgsize;
-        pthread_rwlock_unlock(&r->f->sync.buf_rwlock);
+    /* Nothing more is coming to an unlinked topic without writers, so
+     * there is no point in waiting for a batch */
+    ended = f->unlinked && f->writer_count == 0;
 
-        if (r->open_flags & O_NONBLOCK) {
-            return -EWOULDBLOCK;
+    if (reader_at_end(r, msg) ||
+            (lingering && !ended && !reader_batch_ready(r, msg))) {
+        /* No change since last read, or not enough to make a batch */
+        if (reader_at_end(r, msg) && ended) {
+            ret = 0;
+        } else if (p == NULL) {
+            ret = -EAGAIN;
+        } else if ((ret = reader_park(r, p)) == 0 && !reader_at_end(r, msg)) {
+            /* The last writer went while lingering; take what there is */
+            pthread_rwlock_unlock(&f->sync.buf_rwlock);
+            lingering = 0;
+            goto GT_BEGIN;
         }
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+        return ret;
+    }
 
-        status = wait_for_more_data(r, msg, current_serial, current_size);
-
-        if (status == 0) {
-            LOG_MSG("Size(%lu,%lu), Serial(%lu,%lu)",
-                    msg->msgsize, current_size,
-                    r->f->serial, msg->serial);
-            /* Check which condition has changed:
-             * if the serial has changed, increase the reader's serial (and index).
-             * Otherwise, assume more data has trickled into the current
-             * offset.
-             */
-            goto GT_BEGIN;
+    /* So we have more data */
+    if (r->opts.rdflags & BUSFS_RDf_ATOMIC) {
+        ret = read_file_atomic(r, buf, size);
+    } else {
+        ret = read_file(r, buf, size);
+    }
+
+    if (ret != -EAGAIN) {
+        reader_save_position(r);
+    }
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    if (ret == -EAGAIN) {
+        /* Everything available was filtered out */
+        goto GT_BEGIN;
+    }
+    return ret;
+}
+
+static int busfs_read_io(busfs_common o, const char *path,
+                         char *buf, size_t size, off_t offset)
+{
+    (void)path;
+    (void)offset;
+
+    /* Reads which may wait go through busfs_read_wait() */
+    return reader_read((busfs_reader)o, buf, size, 0, NULL);
+}
+
+/**
+ * Answer the read p, or keep it until a writer commits, see
+ * busfs_read_wake(). A batching reader lingers from the start of the read
+ * until min_bytes or min_msgs are there, or linger_ms have passed; the
+ * read is then looked at again by the thread in busfs_ll.c.
+ */
+static void busfs_read_wait(busfs_common o, busfs_pending p)
+{
+    busfs_reader r = (busfs_reader)o;
+    char *buf = malloc(p->size);
+    uint64_t now = busfs_clock_ns();
+    int ret, lingering = 0;
+
+    if (r->open_flags & O_NONBLOCK) {
+        busfs_pending_reply(p, buf, reader_read(r, buf, p->size, 0, NULL));
+        free(buf);
+        return;
+    }
+
+    if ((r->opts.min_bytes || r->opts.min_msgs) && r->snapshot == NULL) {
+        if (p->linger_ns == 0) {
+            p->linger_ns = now + (uint64_t)r->opts.linger_ms * 1000000;
+        }
+        if (now < p->linger_ns) {
+            /* Before p can be kept, and answered by someone else */
+            busfs_pending_linger(p);
+            lingering = 1;
+        }
+    }
+
+    ret = reader_read(r, buf, p->size, lingering, p);
+    if (ret == -EAGAIN) {
+        /* p has been kept, and may already be answered */
+        free(buf);
+        return;
+    }
+
+    if (p->since_ns) {
+        BUSFS_STAT_ADD(r->stats.blocked_ns, busfs_clock_ns() - p->since_ns);
+    }
+    busfs_pending_reply(p, buf, ret);
+    free(buf);
+}
+
+static int busfs_read_unwait(busfs_common o, busfs_pending p, int interrupt)
+{
+    busfs_file f = ((busfs_reader)o)->f;
+    int taken;
+
+    pthread_mutex_lock(&f->sync.poll_mutex);
+    if (interrupt) {
+        p->interrupted = 1;
+    }
+    taken = p->parked;
+    if (taken) {
+        g_queue_unlink(&f->waiting, &p->link);
+        g_atomic_int_add(&f->nwaiting, -1);
+        p->parked = 0;
+    }
+    pthread_mutex_unlock(&f->sync.poll_mutex);
+    return taken;
+}
+
+/**
+ * poll(2) support. A reader waiting in poll(2) is answered from the write
+ * path through its poll handle, as blocking reads are, so idle subscribers
+ * don't occupy a worker thread.
+ *
+ * The handle is registered before the ring is checked, so a message
+ * committed in between is either seen here or followed by a notification.
+ */
+static int busfs_read_poll(busfs_common o, struct fuse_pollhandle *ph,
+                           unsigned *reventsp)
+{
+    busfs_reader r = (busfs_reader)o;
+    busfs_file f = r->f;
+    busfs_dgram *msg;
+
+    if (ph) {
+        pthread_mutex_lock(&f->sync.poll_mutex);
+        if (r->poll_ph) {
+            fuse_pollhandle_destroy(r->poll_ph);
         } else {
-            return status;
+            if (f->pollers == NULL) {
+                f->pollers = g_hash_table_new(g_direct_hash, g_direct_equal);
+            }
+            g_hash_table_insert(f->pollers, r, r);
+            g_atomic_int_add(&f->nwaiting, 1);
         }
+        r->poll_ph = ph;
+        pthread_mutex_unlock(&f->sync.poll_mutex);
     }
 
-    my_errno = 0;
-    /* So we have more data */
-    if (msg->serial == r->r_serial) {
-        goto GT_RET;
+    if (r->snapshot) {
+        *reventsp |= POLLIN;
+        return 0;
+    }
 
-    } else {
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+    msg = reader_check_overrun(r);
+    if (!reader_at_end(r, msg) || (f->unlinked && f->writer_count == 0)) {
+        *reventsp |= POLLIN;
+    }
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    return 0;
+}
 
-        /* We've had a ringbuffer wrap-around.
-         * This obviously means we've skipped some messages,
-         *
-         */
-        dgram_get_oldest(r->f, &msg, &r->r_idx);
-        LOG_MSG("Rollover index: %d", r->r_idx);
-        r->r_serial = msg->serial;
-        r->r_offset = 0;
-        goto GT_RET;
+/**
+ * Notify the readers of f which are waiting in poll(2), and look at the
+ * reads kept by reader_park() again. Called by writers after committing
+ * messages, without holding buf_rwlock.
+ */
+void busfs_read_wake(busfs_file f)
+{
+    GHashTableIter iter;
+    gpointer key;
+    GList *handles = NULL, *waiting, *l, *next;
+
+    if (g_atomic_int_get(&f->nwaiting) == 0) {
+        return;
     }
 
+    pthread_mutex_lock(&f->sync.poll_mutex);
+    if (f->pollers) {
+        g_hash_table_iter_init(&iter, f->pollers);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            busfs_reader r = key;
+            handles = g_list_prepend(handles, r->poll_ph);
+            r->poll_ph = NULL;
+        }
+        g_hash_table_remove_all(f->pollers);
+    }
+    waiting = f->waiting.head;
+    for (l = waiting; l; l = l->next) {
+        ((busfs_pending)l->data)->parked = 0;
+    }
+    g_queue_init(&f->waiting);
+    g_atomic_int_set(&f->nwaiting, 0);
+    pthread_mutex_unlock(&f->sync.poll_mutex);
 
-    GT_RET:
-    ret = read_file(r, buf, size);
-    pthread_rwlock_unlock(&r->f->sync.buf_rwlock);
-    return ret;
+    for (l = handles; l; l = l->next) {
+        fuse_lowlevel_notify_poll(l->data);
+        fuse_pollhandle_destroy(l->data);
+    }
+    g_list_free(handles);
+
+    for (l = waiting; l; l = next) {
+        busfs_pending p = l->data;
+
+        /* p may be answered, and freed, by wait_func */
+        next = l->next;
+        l->prev = l->next = NULL;
+        p->o->wait_func(p->o, p);
+    }
 }
@@ -0,0 +1,891 @@
+/**
+ * This file contains replication of topics between two busfs instances. A
+ * leader, mounted with -o repl_listen=ADDR, streams committed messages to
+ * followers mounted with -o repl_follow=ADDR. Followers keep the serials and
+ * timestamps given by the leader, and their replicated topics are read-only.
+ *
+ * ADDR is either unix:/path/to/socket or host:port.
+ *
+ * Each frame is a one byte type and a 32 bit body length, followed by the
+ * body. All integers are big-endian.
+ *
+ *  'H' (follower) Sent on connecting, one entry per topic already held:
+ *      u16 pathlen, path, u32 serial of the next message wanted
+ *
+ *  'M' (leader) A batch of consecutive messages from one topic:
+ *      u16 pathlen, path, u8 framing, u8 compact, u32 record size (only for
+ *      fixed-record topics), u32 count, and per message: u32 serial, u64
+ *      timestamp (ns since the epoch), u32 length, data
+ *
+ *  'A' (follower) Total bytes of 'M' bodies applied on this connection:
+ *      u64 bytes
+ *
+ * The leader keeps sending while less than REPL_WINDOW bytes are
+ * unacknowledged, so batches are pipelined. After a reconnect, a follower
+ * continues from the serials it sends in 'H'.
+ */
+
+#include "busfs.h"
+#include "busfs_util.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#define _BFG BusFS_Global
+
+#define REPL_HDRLEN 5
+
+/* A batch is closed once it reaches this size */
+#define REPL_BATCH_MAX (256 * 1024)
+
+/* How much the leader sends ahead of acknowledgements */
+#define REPL_WINDOW (4 * 1024 * 1024)
+
+/* Largest frame accepted from a peer */
+#define REPL_FRAME_MAX (16 * 1024 * 1024)
+
+/* Connection to a follower, on the leader */
+typedef struct {
+    int fd;
+
+    /* Protects the fields below, signalled on acknowledgement */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t sent;
+    uint64_t acked;
+    int closed;
+
+    /* Next serial to send for each topic, keyed by path */
+    GHashTable *cursors;
+} repl_peer;
+
+/* Bounds-checked reader for a received frame body */
+typedef struct {
+    const char *p;
+    size_t left;
+} repl_cursor;
+
+/* Topics created by the follower, keyed by path. Each holds a reference */
+static GHashTable *Replicas;
+
+static int repl_selected(const char *path)
+{
+    const char *prefix = _BFG.conf.repl_topics;
+    return prefix == NULL || strncmp(path, prefix, strlen(prefix)) == 0;
+}
+
+/**
+ * Whether path is a topic mirrored from a leader, which may not be written
+ * to locally.
+ */
+int busfs_repl_is_replica(const char *path)
+{
+    return _BFG.conf.repl_follow != NULL && repl_selected(path);
+}
+
+/**
+ * Open a socket listening on, or connected to, addr. An empty host means
+ * the loopback address. Returns -1 on error, with errno set.
+ */
+static int repl_socket(const char *addr, int listening)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    char *host, *port;
+    int fd = -1, rc, one = 1;
+
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (listening) {
+            unlink(sun.sun_path);
+            rc = bind(fd, (struct sockaddr*)&sun, sizeof(sun));
+            if (rc == 0) {
+                rc = listen(fd, 8);
+            }
+        } else {
+            rc = connect(fd, (struct sockaddr*)&sun, sizeof(sun));
+        }
+
+        if (rc != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    host = g_strdup(addr);
+    port = strrchr(host, ':');
+    if (port == NULL) {
+        g_free(host);
+        errno = EINVAL;
+        return -1;
+    }
+    *(port++) = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    /* Without AI_PASSIVE no host is loopback; other interfaces are named */
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &res) != 0) {
+        g_free(host);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            rc = bind(fd, ai->ai_addr, ai->ai_addrlen);
+            if (rc == 0) {
+                rc = listen(fd, 8);
+            }
+        } else {
+            rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        }
+
+        if (rc == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    g_free(host);
+    return fd;
+}
+
+static int repl_write_full(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t nw = send(fd, buf, len, MSG_NOSIGNAL);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+static int repl_read_full(int fd, char *buf, size_t len)
+{
+    while (len) {
+        ssize_t nr = recv(fd, buf, len, 0);
+        if (nr < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            return -1;
+        }
+        buf += nr;
+        len -= nr;
+    }
+    return 0;
+}
+
+static void put_u16(GString *out, uint16_t v)
+{
+    v = htons(v);
+    g_string_append_len(out, (const char*)&v, sizeof(v));
+}
+
+static void put_u32(GString *out, uint32_t v)
+{
+    v = htonl(v);
+    g_string_append_len(out, (const char*)&v, sizeof(v));
+}
+
+static void put_u64(GString *out, uint64_t v)
+{
+    v = htobe64(v);
+    g_string_append_len(out, (const char*)&v, sizeof(v));
+}
+
+static void put_path(GString *out, const char *path)
+{
+    size_t len = strlen(path);
+    put_u16(out, len);
+    g_string_append_len(out, path, len);
+}
+
+static int get_span(repl_cursor *c, size_t len, const char **p)
+{
+    if (c->left < len) {
+        return -1;
+    }
+    *p = c->p;
+    c->p += len;
+    c->left -= len;
+    return 0;
+}
+
+static int get_u8(repl_cursor *c, uint8_t *v)
+{
+    const char *p;
+    if (get_span(c, sizeof(*v), &p) != 0) {
+        return -1;
+    }
+    *v = (uint8_t)*p;
+    return 0;
+}
+
+static int get_u16(repl_cursor *c, uint16_t *v)
+{
+    const char *p;
+    if (get_span(c, sizeof(*v), &p) != 0) {
+        return -1;
+    }
+    memcpy(v, p, sizeof(*v));
+    *v = ntohs(*v);
+    return 0;
+}
+
+static int get_u32(repl_cursor *c, uint32_t *v)
+{
+    const char *p;
+    if (get_span(c, sizeof(*v), &p) != 0) {
+        return -1;
+    }
+    memcpy(v, p, sizeof(*v));
+    *v = ntohl(*v);
+    return 0;
+}
+
+static int get_u64(repl_cursor *c, uint64_t *v)
+{
+    const char *p;
+    if (get_span(c, sizeof(*v), &p) != 0) {
+        return -1;
+    }
+    memcpy(v, p, sizeof(*v));
+    *v = be64toh(*v);
+    return 0;
+}
+
+static int get_path(repl_cursor *c, char path[FILENAME_MAX])
+{
+    uint16_t len;
+    const char *p;
+
+    if (get_u16(c, &len) != 0 || len >= FILENAME_MAX ||
+            get_span(c, len, &p) != 0) {
+        return -1;
+    }
+    memcpy(path, p, len);
+    path[len] = '\0';
+    return 0;
+}
+
+static void frame_begin(GString *out, char type)
+{
+    g_string_truncate(out, 0);
+    g_string_append_c(out, type);
+    put_u32(out, 0);
+}
+
+static int frame_send(int fd, GString *out)
+{
+    uint32_t len = htonl(out->len - REPL_HDRLEN);
+    memcpy(out->str + 1, &len, sizeof(len));
+    return repl_write_full(fd, out->str, out->len);
+}
+
+static int frame_recv(int fd, char *type, GString *body)
+{
+    char hdr[REPL_HDRLEN];
+    uint32_t len;
+
+    if (repl_read_full(fd, hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+
+    *type = hdr[0];
+    memcpy(&len, hdr + 1, sizeof(len));
+    len = ntohl(len);
+
+    if (len > REPL_FRAME_MAX) {
+        LOG_MSG("Oversized frame (%u bytes)", len);
+        return -1;
+    }
+
+    g_string_set_size(body, len);
+    return repl_read_full(fd, body->str, len);
+}
+
+/**
+ * Paths of the topics to replicate, as of the current generation.
+ */
+static GPtrArray *leader_topics(unsigned *generation)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+
+    pthread_rwlock_rdlock(&_BFG.lock);
+    *generation = _BFG.generation;
+
+    g_hash_table_iter_init(&iter, _BFG.ht);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (repl_selected(key)) {
+            g_ptr_array_add(paths, g_strdup(key));
+        }
+    }
+
+    pthread_rwlock_unlock(&_BFG.lock);
+    return paths;
+}
+
+/**
+ * Build an 'M' frame in out from the committed messages of f, starting at
+ * *next. If *next is no longer in the ring (or was never sent), the batch
+ * starts at the oldest message. Returns the number of messages added.
+ */
+static uint32_t leader_batch(busfs_file f, uint32_t *next, int known,
+                             GString *out)
+{
+    uint32_t serial, count = 0, ncount;
+    size_t countpos;
+    busfs_zcache zc;
+
+    memset(&zc, 0, sizeof(zc));
+    frame_begin(out, 'M');
+    put_path(out, f->path);
+
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+
+    g_string_append_c(out, (char)f->framing);
+    g_string_append_c(out, f->latest != NULL);
+    if (f->framing == BUSFS_FRAMING_FIXED) {
+        put_u32(out, f->record_size);
+    }
+    countpos = out->len;
+    put_u32(out, 0);
+
+    serial = *next;
+    if (!known || BUSFS_SERIAL_BEFORE(serial, f->head_serial) ||
+            BUSFS_SERIAL_BEFORE(f->serial, serial)) {
+        serial = f->head_serial;
+    }
+
+    while (serial != f->serial && out->len < REPL_BATCH_MAX) {
+        busfs_dgram *msg = f->dgrams + BUSFS_SERIAL_IDX(f, serial);
+
+        put_u32(out, msg->serial);
+        put_u64(out, msg->ts + _BFG.clock_offset_ns);
+        put_u32(out, msg->msgsize);
+        g_string_append_len(out, busfs_dgram_data(msg, &zc), msg->msgsize);
+        serial++;
+        count++;
+    }
+
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    busfs_zcache_clear(&zc);
+
+    ncount = htonl(count);
+    memcpy(out->str + countpos, &ncount, sizeof(ncount));
+    *next = serial;
+    return count;
+}
+
+static int leader_hello(repl_peer *p)
+{
+    GString *body = g_string_new(NULL);
+    repl_cursor c;
+    char type, path[FILENAME_MAX];
+    uint32_t serial;
+    int ret = -1;
+
+    if (frame_recv(p->fd, &type, body) != 0 || type != 'H') {
+        goto GT_RET;
+    }
+
+    c.p = body->str;
+    c.left = body->len;
+    while (c.left) {
+        if (get_path(&c, path) != 0 || get_u32(&c, &serial) != 0) {
+            goto GT_RET;
+        }
+        g_hash_table_replace(p->cursors, g_strdup(path),
+                             GUINT_TO_POINTER(serial));
+    }
+    ret = 0;
+
+    GT_RET:
+    g_string_free(body, TRUE);
+    return ret;
+}
+
+static void *leader_ack_thread(void *arg)
+{
+    repl_peer *p = arg;
+    GString *body = g_string_new(NULL);
+    char type;
+
+    while (frame_recv(p->fd, &type, body) == 0) {
+        repl_cursor c = { body->str, body->len };
+        uint64_t acked;
+
+        if (type != 'A' || get_u64(&c, &acked) != 0) {
+            LOG_MSG("Unexpected frame from follower");
+            break;
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        p->acked = acked;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->closed = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    g_string_free(body, TRUE);
+    return NULL;
+}
+
+/**
+ * Send one batch for each topic with new messages. Returns 1 if anything
+ * was sent, 0 if not, and -1 if the follower went away.
+ */
+static int leader_send_round(repl_peer *p, GPtrArray *paths, GString *out)
+{
+    int progress = 0;
+    guint ii;
+
+    for (ii = 0; ii < paths->len; ii++) {
+        const char *path = paths->pdata[ii];
+        gpointer val = NULL;
+        uint32_t next;
+        int known, closed;
+        busfs_file f = busfs_file_get(path, BUSFS_GETf_INC);
+
+        if (f == NULL) {
+            continue;
+        }
+
+        known = g_hash_table_lookup_extended(p->cursors, path, NULL, &val);
+        next = GPOINTER_TO_UINT(val);
+
+        if (leader_batch(f, &next, known, out) == 0) {
+            busfs_file_release(f, BUSFS_INFO_NONE);
+            continue;
+        }
+        busfs_file_release(f, BUSFS_INFO_NONE);
+
+        g_hash_table_replace(p->cursors, g_strdup(path),
+                             GUINT_TO_POINTER(next));
+
+        if (frame_send(p->fd, out) != 0) {
+            return -1;
+        }
+        progress = 1;
+
+        pthread_mutex_lock(&p->mutex);
+        p->sent += out->len - REPL_HDRLEN;
+        while (!p->closed && p->sent - p->acked > REPL_WINDOW) {
+            pthread_cond_wait(&p->cond, &p->mutex);
+        }
+        closed = p->closed;
+        pthread_mutex_unlock(&p->mutex);
+
+        if (closed) {
+            return -1;
+        }
+    }
+
+    return progress;
+}
+
+/**
+ * Wake up the leader's peer threads after a topic has changed
+ */
+void busfs_repl_notify(void)
+{
+    pthread_mutex_lock(&_BFG.repl.mutex);
+    _BFG.repl.seq++;
+    pthread_cond_broadcast(&_BFG.repl.cond);
+    pthread_mutex_unlock(&_BFG.repl.mutex);
+}
+
+static void *leader_peer_thread(void *arg)
+{
+    repl_peer *p = arg;
+    pthread_t ack_thr;
+    GPtrArray *paths = NULL;
+    GString *out = g_string_new(NULL);
+    unsigned generation = 0, seq;
+    int rc;
+
+    /* Writers only wake up replication if asked */
+    pthread_mutex_lock(&_BFG.repl.mutex);
+    _BFG.repl.peers++;
+    pthread_mutex_unlock(&_BFG.repl.mutex);
+
+    if (leader_hello(p) != 0) {
+        LOG_MSG("Bad handshake from follower");
+        goto GT_DONE;
+    }
+
+    pthread_create(&ack_thr, NULL, leader_ack_thread, p);
+
+    while (1) {
+        pthread_mutex_lock(&_BFG.repl.mutex);
+        seq = _BFG.repl.seq;
+        pthread_mutex_unlock(&_BFG.repl.mutex);
+
+        if (paths == NULL || generation != _BFG.generation) {
+            if (paths) {
+                g_ptr_array_free(paths, TRUE);
+            }
+            paths = leader_topics(&generation);
+        }
+
+        rc = leader_send_round(p, paths, out);
+        if (rc < 0) {
+            break;
+        } else if (rc > 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        rc = p->closed;
+        pthread_mutex_unlock(&p->mutex);
+        if (rc) {
+            break;
+        }
+
+        /* Wait for a write, or time out to notice a new topic or a
+         * disconnect */
+        pthread_mutex_lock(&_BFG.repl.mutex);
+        if (seq == _BFG.repl.seq) {
+            struct timespec timeout;
+            mk_condwait_tmo(&timeout, NULL);
+            pthread_cond_timedwait(&_BFG.repl.cond, &_BFG.repl.mutex,
+                                   &timeout);
+        }
+        pthread_mutex_unlock(&_BFG.repl.mutex);
+    }
+
+    shutdown(p->fd, SHUT_RDWR);
+    pthread_join(ack_thr, NULL);
+
+    GT_DONE:
+    LOG_MSG("Follower disconnected");
+
+    pthread_mutex_lock(&_BFG.repl.mutex);
+    _BFG.repl.peers--;
+    pthread_mutex_unlock(&_BFG.repl.mutex);
+
+    if (paths) {
+        g_ptr_array_free(paths, TRUE);
+    }
+    g_string_free(out, TRUE);
+    g_hash_table_destroy(p->cursors);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+    close(p->fd);
+    free(p);
+    return NULL;
+}
+
+static void *leader_listen_thread(void *arg)
+{
+    int lfd = (int)(intptr_t)arg;
+
+    while (1) {
+        pthread_t thr;
+        repl_peer *p;
+        int fd = accept(lfd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno != EINTR) {
+                LOG_MSG("accept: %s", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        LOG_MSG("Follower connected");
+        p = calloc(1, sizeof(*p));
+        p->fd = fd;
+        pthread_mutex_init(&p->mutex, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        p->cursors = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
+
+        pthread_create(&thr, NULL, leader_peer_thread, p);
+        pthread_detach(thr);
+    }
+    return NULL;
+}
+
+/**
+ * Create the file backing path, along with any missing directories, and
+ * the topic itself.
+ */
+static busfs_file follower_create(const char *path)
+{
+    char dir[FILENAME_MAX];
+    char *sep;
+    int fd;
+    busfs_file f;
+    BUSFS_CONVERT_PATH_EX(path, real);
+
+    snprintf(dir, sizeof(dir), "%s", real);
+    for (sep = strchr(dir + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        mkdir(dir, 0777);
+        *sep = '/';
+    }
+
+    fd = open(real, O_CREAT|O_WRONLY, 0644);
+    if (fd < 0) {
+        LOG_MSG("Couldn't create %s: %s", real, strerror(errno));
+        return NULL;
+    }
+    close(fd);
+
+    f = busfs_file_get(path, BUSFS_GETf_CREATE|BUSFS_GETf_INC);
+    if (f) {
+        g_hash_table_insert(Replicas, g_strdup(path), f);
+    }
+    return f;
+}
+
+/**
+ * Look up (or create) the replica of a topic, with the leader's settings.
+ * A replica holding messages under different settings is emptied first.
+ */
+static busfs_file follower_topic(const char *path, int framing, int compact,
+                                 uint32_t record_size)
+{
+    struct busfs_openopts_st opts;
+    busfs_file f = g_hash_table_lookup(Replicas, path);
+
+    if (f == NULL && (f = follower_create(path)) == NULL) {
+        return NULL;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.configure = BUSFS_CONFf_FRAMING|BUSFS_CONFf_COMPACT;
+    opts.framing = framing;
+    opts.record_size = record_size;
+    opts.compact = compact;
+
+    if (busfs_file_configure(f, &opts) == -EBUSY) {
+        /* Replicas are read-only, so no message is half written */
+        busfs_file_truncate(f, 0);
+        if (busfs_file_configure(f, &opts) != 0) {
+            /* Only while the replica is being exported */
+            LOG_MSG("Can't reconfigure replica %s", path);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+/**
+ * Apply a batch of messages from the leader.
+ */
+static int follower_apply(repl_cursor *c)
+{
+    char path[FILENAME_MAX];
+    uint8_t framing, compact;
+    uint32_t record_size = 0, count, ii;
+    uint64_t now;
+    busfs_file f;
+    int ret = 0;
+
+    if (get_path(c, path) != 0 || get_u8(c, &framing) != 0 ||
+            get_u8(c, &compact) != 0) {
+        return -1;
+    }
+    if (framing == BUSFS_FRAMING_FIXED &&
+            (get_u32(c, &record_size) != 0 || record_size == 0 ||
+             record_size > BUSFS_RECORD_MAXLEN)) {
+        return -1;
+    }
+    if (get_u32(c, &count) != 0) {
+        return -1;
+    }
+
+    /* Topics are created and written, so not while being handed over */
+    if (busfs_handoff_enter() != 0) {
+        return -1;
+    }
+
+    f = follower_topic(path, framing, compact, record_size);
+    if (f == NULL || f->record_size != record_size) {
+        busfs_handoff_leave();
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+
+    for (ii = 0; ii < count; ii++) {
+        uint32_t serial, len;
+        uint64_t ts;
+        const char *data;
+
+        if (get_u32(c, &serial) != 0 || get_u64(c, &ts) != 0 ||
+                get_u32(c, &len) != 0 || get_span(c, len, &data) != 0 ||
+                (record_size && len != record_size)) {
+            ret = -1;
+            break;
+        }
+
+        busfs_write_replicated(f, serial, ts - _BFG.clock_offset_ns,
+                               data, len);
+    }
+
+    now = busfs_clock_ns();
+    busfs_file_expire(f, now);
+    f->mtime = BUSFS_CLOCK_TO_TIME(now);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    busfs_file_notify(f);
+    busfs_handoff_leave();
+
+    return ret;
+}
+
+/**
+ * Build the 'H' frame, telling the leader where each replica left off
+ */
+static void follower_hello(GString *out)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    frame_begin(out, 'H');
+
+    g_hash_table_iter_init(&iter, Replicas);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        busfs_file f = value;
+
+        put_path(out, key);
+        pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+        put_u32(out, f->serial);
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    }
+}
+
+static void *follower_thread(void *arg)
+{
+    GString *body = g_string_new(NULL), *out = g_string_new(NULL);
+    (void)arg;
+
+    while (1) {
+        uint64_t applied = 0;
+        char type;
+        int fd = repl_socket(_BFG.conf.repl_follow, 0);
+
+        if (fd < 0) {
+            LOG_MSG("Couldn't connect to %s: %s",
+                    _BFG.conf.repl_follow, strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        LOG_MSG("Following %s", _BFG.conf.repl_follow);
+
+        follower_hello(out);
+        if (frame_send(fd, out) != 0) {
+            goto GT_CLOSE;
+        }
+
+        while (frame_recv(fd, &type, body) == 0) {
+            repl_cursor c = { body->str, body->len };
+
+            if (type != 'M' || follower_apply(&c) != 0) {
+                LOG_MSG("Bad frame from leader");
+                break;
+            }
+
+            applied += body->len;
+            frame_begin(out, 'A');
+            put_u64(out, applied);
+            if (frame_send(fd, out) != 0) {
+                break;
+            }
+        }
+
+        GT_CLOSE:
+        LOG_MSG("Lost connection to %s", _BFG.conf.repl_follow);
+        close(fd);
+        sleep(1);
+    }
+    return NULL;
+}
+
+/**
+ * Start the replication threads requested on the command line. Called once
+ * the filesystem is initialized.
+ */
+void busfs_repl_start(void)
+{
+    pthread_t thr;
+
+    if (_BFG.conf.repl_listen) {
+        int fd = repl_socket(_BFG.conf.repl_listen, 1);
+        if (fd < 0) {
+            LOG_MSG("Couldn't listen on %s: %s",
+                    _BFG.conf.repl_listen, strerror(errno));
+        } else {
+            pthread_create(&thr, NULL, leader_listen_thread,
+                           (void*)(intptr_t)fd);
+            pthread_detach(thr);
+        }
+    }
+
+    if (_BFG.conf.repl_follow) {
+        GHashTableIter iter;
+        gpointer key, value;
+
+        Replicas = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free, NULL);
+
+        /* Replicas handed over by a previous daemon continue from the
+         * serials they hold */
+        pthread_rwlock_rdlock(&_BFG.lock);
+        g_hash_table_iter_init(&iter, _BFG.ht);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            busfs_file f = value;
+
+            if (f->unlinked || !repl_selected(key)) {
+                continue;
+            }
+            pthread_rwlock_wrlock(&f->sync.refs_rwlock);
+            f->refcount++;
+            pthread_rwlock_unlock(&f->sync.refs_rwlock);
+            g_hash_table_insert(Replicas, g_strdup(key), f);
+        }
+        pthread_rwlock_unlock(&_BFG.lock);
+
+        pthread_create(&thr, NULL, follower_thread, NULL);
+        pthread_detach(thr);
+    }
+}
@@ -0,0 +1,199 @@
+/**
+ * This file contains replay files, opened as 'topic@replay'. A replay file
+ * holds the committed messages of a topic at fixed offsets: byte N is byte
+ * N of everything ever written to the topic, as counted by each message's
+ * boff. As those bytes never change, replay files are opened without
+ * direct_io, and the kernel keeps them in its page cache. Readers going
+ * over the same history are then served from the cache rather than each
+ * copying it out of the daemon. The live tail is left to ordinary readers,
+ * which bypass the cache.
+ *
+ * The size of a replay file is the end of the committed messages, rounded
+ * down to a page, so that the kernel never caches a page which will grow.
+ * Messages which have left the ring read as zeros, unless still cached, so
+ * that the kernel's readahead around the oldest message doesn't fail.
+ */
+
+#include "busfs.h"
+#include "busfs_util.h"
+
+static long PageSize;
+
+/**
+ * Get the offsets of the oldest message in the ring and of the end of the
+ * committed messages. Must be called with buf_rwlock held.
+ */
+static void replay_range(busfs_file f, uint64_t *first, uint64_t *end)
+{
+    *first = f->dgrams[f->head_idx].boff;
+    *end = f->dgrams[f->curidx].boff;
+}
+
+void busfs_replay_range(busfs_file f, uint64_t *first, uint64_t *end)
+{
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+    replay_range(f, first, end);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+}
+
+/**
+ * Get the size of the replay file of f, as reported by stat(2)
+ */
+off_t busfs_replay_size(busfs_file f)
+{
+    uint64_t first, end;
+
+    if (PageSize == 0) {
+        PageSize = sysconf(_SC_PAGESIZE);
+    }
+
+    busfs_replay_range(f, &first, &end);
+    return end - end % PageSize;
+}
+
+/**
+ * Find the committed message holding offset, which must be within the
+ * ring, using a binary search, or arithmetic for fixed-record topics. Must
+ * be called with buf_rwlock held.
+ */
+static uint32_t replay_find(busfs_file f, uint64_t offset)
+{
+    size_t lo = 0, hi = f->serial - f->head_serial;
+
+    if (f->framing == BUSFS_FRAMING_FIXED) {
+        uint64_t first = f->dgrams[f->head_idx].boff;
+        return f->head_serial + (offset - first) / f->record_size;
+    }
+
+    /* Find the first message starting after offset */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        busfs_dgram *msg = f->dgrams + (f->head_idx + mid) % f->dgram_count;
+
+        if (msg->boff <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return f->head_serial + lo - 1;
+}
+
+static int busfs_replay_read(busfs_common o, const char *path,
+                             char *buf, size_t size, off_t offset)
+{
+    busfs_replay rp = (busfs_replay)o;
+    busfs_file f = rp->f;
+    uint64_t first, end;
+    uint32_t serial;
+    size_t total = 0;
+    int ret;
+    (void)path;
+
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    busfs_write_drain(f);
+    pthread_mutex_lock(&rp->mutex);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+
+    replay_range(f, &first, &end);
+    if ((uint64_t)offset >= end) {
+        ret = 0;
+        goto GT_RET;
+    }
+
+    size = MIN(size, end - offset);
+    if ((uint64_t)offset < first) {
+        total = MIN(size, first - offset);
+        memset(buf, 0, total);
+    }
+    serial = replay_find(f, offset + total);
+
+    while (total < size) {
+        busfs_dgram *msg = f->dgrams + BUSFS_SERIAL_IDX(f, serial);
+        size_t msgoff = offset + total - msg->boff;
+        size_t toCopy = MIN(size - total,
+                            BUSFS_MSG_LENGTH(f, msg) - msgoff);
+
+        busfs_read_copy(f, msg, &rp->zcache, msgoff, buf + total, toCopy);
+        total += toCopy;
+        serial++;
+    }
+    ret = total;
+
+    GT_RET:
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    pthread_mutex_unlock(&rp->mutex);
+    return ret;
+}
+
+static int busfs_replay_write(busfs_common o, const char *path,
+                              const char *buf, size_t size, off_t offset)
+{
+    (void)o;
+    (void)path;
+    (void)buf;
+    (void)size;
+    (void)offset;
+    return -EBADF;
+}
+
+static int busfs_replay_close(busfs_common o, const char *path)
+{
+    busfs_replay rp = (busfs_replay)o;
+    (void)path;
+
+    busfs_file_release(rp->f, BUSFS_INFO_READER);
+    busfs_zcache_clear(&rp->zcache);
+    pthread_mutex_destroy(&rp->mutex);
+    free(rp);
+    return 0;
+}
+
+/**
+ * Open the replay file of f under path, taking over the caller's reference
+ * on f. The kernel keeps what it has cached for path, unless this is the
+ * first open of path since f was created: anything cached then belongs to
+ * an earlier topic of the same name.
+ */
+busfs_replay busfs_replay_new(busfs_file f, const char *path,
+                              struct fuse_file_info *fi)
+{
+    busfs_replay rp = calloc(1, sizeof(struct busfs_replay_st));
+
+    rp->common.read_func = busfs_replay_read;
+    rp->common.write_func = busfs_replay_write;
+    rp->common.close_func = busfs_replay_close;
+    rp->common.type = BUSFS_INFO_REPLAY;
+    rp->f = f;
+    pthread_mutex_init(&rp->mutex, NULL);
+
+    pthread_rwlock_wrlock(&f->sync.refs_rwlock);
+    f->reader_count++;
+    pthread_rwlock_unlock(&f->sync.refs_rwlock);
+
+    if (f->retention_ns) {
+        pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+        busfs_file_expire(f, busfs_clock_ns());
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    }
+
+    pthread_mutex_lock(&f->sync.attr_mutex);
+    if (f->replay_paths == NULL) {
+        f->replay_paths = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    }
+    fi->keep_cache = g_hash_table_lookup_extended(f->replay_paths, path,
+                                                  NULL, NULL);
+    if (!fi->keep_cache) {
+        g_hash_table_insert(f->replay_paths, g_strdup(path), NULL);
+    }
+    pthread_mutex_unlock(&f->sync.attr_mutex);
+
+    fi->direct_io = 0;
+    return rp;
+}
@@ -0,0 +1,115 @@
+/**
+ * This file contains status files, opened as 'topic@status'. Each open
+ * renders the state of the topic as text, one item per line:
+ *
+ *  head SERIAL             the oldest message in the ring
+ *  tail SERIAL             the next message to be written
+ *  cursor NAME SERIAL LAG  a named cursor, and how many messages it is
+ *                          behind the tail
+ *  partition N HEAD TAIL   for partitioned topics, the serials of each
+ *                          partition
+ *  compressed RAW BYTES    for topics with compression, the size of the
+ *                          compressed messages before and after
+ *  replay FIRST END        the offsets of the replay file which can be read
+ *  reader PID SERIAL LAG SKIPPED BLOCKED_MS CURSOR
+ *                          an open reader: the next message it will see,
+ *                          its lag, messages it lost to overruns, time it
+ *                          spent waiting for data and its cursor, or '-'
+ */
+
+#include "busfs.h"
+
+#define MINIMUM(a, b) ( ((a) < (b)) ? (a) : (b) )
+
+static int busfs_status_read(busfs_common o, const char *path,
+                             char *buf, size_t size, off_t offset)
+{
+    busfs_status st = (busfs_status)o;
+    (void)path;
+
+    if (offset < 0 || (size_t)offset >= st->text->len) {
+        return 0;
+    }
+
+    size = MINIMUM(size, st->text->len - offset);
+    memcpy(buf, st->text->str + offset, size);
+    return size;
+}
+
+static int busfs_status_write(busfs_common o, const char *path,
+                              const char *buf, size_t size, off_t offset)
+{
+    (void)o;
+    (void)path;
+    (void)buf;
+    (void)size;
+    (void)offset;
+    return -EBADF;
+}
+
+static int busfs_status_close(busfs_common o, const char *path)
+{
+    busfs_status st = (busfs_status)o;
+    (void)path;
+
+    g_string_free(st->text, TRUE);
+    free(st);
+    return 0;
+}
+
+busfs_status busfs_status_new(busfs_file f)
+{
+    busfs_status st = calloc(1, sizeof(struct busfs_status_st));
+    uint32_t head, tail, ii;
+    uint64_t zraw, zbytes, rfirst, rend;
+
+    st->common.read_func = busfs_status_read;
+    st->common.write_func = busfs_status_write;
+    st->common.close_func = busfs_status_close;
+    st->common.type = BUSFS_INFO_CTL;
+    st->text = g_string_new(NULL);
+
+    busfs_write_drain(f);
+    pthread_rwlock_rdlock(&f->sync.buf_rwlock);
+    head = f->head_serial;
+    tail = f->serial;
+    zraw = f->z.raw_bytes;
+    zbytes = f->z.z_bytes;
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+    busfs_replay_range(f, &rfirst, &rend);
+
+    g_string_append_printf(st->text, "head %u\ntail %u\n", head, tail);
+    for (ii = 0; ii < f->nparts; ii++) {
+        busfs_file part = f->parts[ii];
+        uint32_t phead, ptail;
+
+        pthread_rwlock_rdlock(&part->sync.buf_rwlock);
+        phead = part->head_serial;
+        ptail = part->serial;
+        zraw += part->z.raw_bytes;
+        zbytes += part->z.z_bytes;
+        pthread_rwlock_unlock(&part->sync.buf_rwlock);
+        g_string_append_printf(st->text, "partition %u %u %u\n",
+                               ii, phead, ptail);
+    }
+
+    if (f->z.enabled) {
+        g_string_append_printf(st->text, "compressed %llu %llu\n",
+                               (unsigned long long)zraw,
+                               (unsigned long long)zbytes);
+    }
+
+    if (f->numa_node >= 0) {
+        g_string_append_printf(st->text, "node %d\n", f->numa_node);
+    }
+
+    if (!f->nparts) {
+        g_string_append_printf(st->text, "replay %llu %llu\n",
+                               (unsigned long long)rfirst,
+                               (unsigned long long)rend);
+    }
+
+    busfs_cursor_dump(f, tail, st->text);
+    busfs_read_dump(f, tail, st->text);
+    return st;
+}
@@ -47,3 +47,46 @@ static inline int busfs_timeval_add(struct timeval *res, const struct timeval *x
 
     return 0;
 }
+
+static inline void mk_condwait_deadline(struct timespec *timeout,
+                                        unsigned long msec)
+{
+    struct timeval now, offset, result;
+    gettimeofday(&now, NULL);
+    offset.tv_sec = msec / 1000;
+    offset.tv_usec = (msec % 1000) * 1000;
+    busfs_timeval_add(&result, &now, &offset);
+    timeout->tv_sec = result.tv_sec;
+    timeout->tv_nsec = result.tv_usec * 1000;
+}
+
+static inline int timespec_before(const struct timespec *a,
+                                  const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+            (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * Periodic wakeup for the wait loop, so interrupts are noticed. This is
+ * capped at the deadline, if there is one.
+ */
+static inline void mk_condwait_tmo(struct timespec *timeout,
+                                   const struct timespec *deadline)
+{
+    mk_condwait_deadline(timeout, 250);
+    if (deadline && timespec_before(deadline, timeout)) {
+        *timeout = *deadline;
+    }
+}
+
+/**
+ * Monotonic time in nanoseconds, used to stamp messages. Add
+ * BusFS_Global.clock_offset_ns to get the time since the epoch.
+ */
+static inline uint64_t busfs_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -3,10 +3,26 @@
  */
 
 #include "busfs.h"
+#include "busfs_util.h"
+#include <arpa/inet.h>
+
+#define MINIMUM(a, b) ( ((a) < (b)) ? (a) : (b) )
+
+/* Topics with queued writes, and the thread which commits them once their
+ * batch window has passed */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    GQueue topics;
+} Batcher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, G_QUEUE_INIT };
+
+static pthread_once_t batcher_once = PTHREAD_ONCE_INIT;
 
 static int busfs_write_io(busfs_common o,
                    const char *path,
                    const char *buf, size_t size, off_t offset);
+static int partition_write(busfs_writer w, const char *buf, size_t size);
+static void sub_drain(busfs_file f, int wait);
 
 static int busfs_write_readfunc(busfs_common o, const char *path,
                                 char *buf, size_t size, off_t offset)
@@ -19,10 +35,59 @@ static int busfs_write_readfunc(busfs_common o, const char *path,
     return -EBADF;
 }
 
+/**
+ * Count a writer on each partition of f as well, so their readers know
+ * when the last one goes away.
+ */
+static void partitions_count_writer(busfs_file f, int delta)
+{
+    uint32_t ii;
+    for (ii = 0; ii < f->nparts; ii++) {
+        busfs_file part = f->parts[ii];
+        pthread_rwlock_wrlock(&part->sync.refs_rwlock);
+        part->writer_count += delta;
+        pthread_rwlock_unlock(&part->sync.refs_rwlock);
+    }
+}
+
 static int busfs_write_close(busfs_common o, const char *path)
 {
+    busfs_writer w = (busfs_writer)o;
+    size_t ii;
     (void)path;
-    busfs_file_release((busfs_file)o, BUSFS_INFO_WRITER);
+
+    if (w->frame_len && w->f->nparts && busfs_handoff_enter() == 0) {
+        /* A partial line still has a key, so it is delivered whole */
+        char delim = w->f->delim;
+        partition_write(w, &delim, 1);
+        busfs_handoff_leave();
+
+    } else if (w->frame_len) {
+        LOG_MSG("Discarding %lu bytes of incomplete record", w->frame_len);
+    }
+    partitions_count_writer(w->f, -1);
+
+    /* Whatever was written is visible once the writer is closed */
+    if (w->f->pubq.window_ns) {
+        busfs_write_flush(w->f);
+    }
+    while (__atomic_load_n(&w->sub_head, __ATOMIC_ACQUIRE) != w->sub_tail) {
+        /* Writes before one of another writer's go in after it */
+        sub_drain(w->f, 1);
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&w->f->sync.sub_mutex);
+    g_ptr_array_remove_fast(w->f->sub.writers, w);
+    pthread_mutex_unlock(&w->f->sync.sub_mutex);
+
+    busfs_file_release(w->f, BUSFS_INFO_WRITER);
+    for (ii = 0; ii < BUSFS_SUBRING_SLOTS; ii++) {
+        free(w->sub[ii].buf);
+    }
+    pthread_mutex_destroy(&w->sub_mutex);
+    free(w->frame);
+    free(w);
     return 0;
 }
 
@@ -30,10 +95,26 @@ busfs_writer busfs_write_new(busfs_file f, struct fuse_file_info *fi)
 {
     (void)fi;
 
-    busfs_writer w = (busfs_writer)f;
+    busfs_writer w = calloc(1, sizeof(struct busfs_writer_st));
+    w->f = f;
+
+    /* A ring which isn't placed yet goes on the first writer's node */
+    if (BusFS_Global.conf.numa && f->numa_node == -1 && busfs_loop_request()) {
+        busfs_file_place(f, busfs_numa_node_of(busfs_loop_request()->pid));
+    }
+
     pthread_rwlock_wrlock(&f->sync.refs_rwlock);
     f->writer_count++;
     pthread_rwlock_unlock(&f->sync.refs_rwlock);
+    partitions_count_writer(f, 1);
+
+    pthread_mutex_init(&w->sub_mutex, NULL);
+    pthread_mutex_lock(&f->sync.sub_mutex);
+    if (f->sub.writers == NULL) {
+        f->sub.writers = g_ptr_array_new();
+    }
+    g_ptr_array_add(f->sub.writers, w);
+    pthread_mutex_unlock(&f->sync.sub_mutex);
 
     w->common.close_func = busfs_write_close;
     w->common.read_func = busfs_write_readfunc;
@@ -43,56 +124,791 @@ busfs_writer busfs_write_new(busfs_file f, struct fuse_file_info *fi)
     return w;
 }
 
+/**
+ * Remember msg as the latest value for its key. The key is everything up
+ * to the first space; a message consisting of only a key removes it.
+ */
+static void compact_update(busfs_file f, busfs_dgram *msg)
+{
+    size_t keylen, len = msg->msgsize;
+    const char *sep;
+    busfs_latest *latest;
+
+    if (len && msg->root[len-1] == f->delim) {
+        len--;
+    }
+
+    sep = memchr(msg->root, ' ', len);
+    keylen = sep ? (size_t)(sep - msg->root) : len;
+
+    if (sep == NULL) {
+        char *key = g_strndup(msg->root, keylen);
+        g_hash_table_remove(f->latest, key);
+        g_free(key);
+        return;
+    }
+
+    latest = g_malloc(sizeof(*latest) + msg->msgsize);
+    latest->serial = msg->serial;
+    latest->msgsize = msg->msgsize;
+    memcpy(latest->root, msg->root, msg->msgsize);
+
+    g_hash_table_replace(f->latest, g_strndup(msg->root, keylen), latest);
+}
+
+/**
+ * Commit the current datagram and move on to the next slot. If the ring is
+ * full, the oldest datagram is evicted by advancing the head.
+ */
+static busfs_dgram *msgs_advance(busfs_file f)
+{
+    busfs_dgram *msg = f->dgrams + f->curidx;
+    uint64_t boff = msg->boff + BUSFS_MSG_LENGTH(f, msg);
+
+    msg->ts = f->pub_ts;
+
+    if (f->latest) {
+        compact_update(f, msg);
+    }
+
+    f->serial++;
+    f->curidx++;
+    f->curidx %= f->dgram_count;
+
+    if (f->curidx == f->head_idx) {
+        busfs_file_evict(f, f->head_serial + 1);
+    }
+
+    msg = f->dgrams + f->curidx;
+    busfs_dgram_prepare(f, msg);
+    msg->serial = f->serial;
+    msg->msgsize = 0;
+    msg->boff = boff;
+    return msg;
+}
+
+/**
+ * Append delimited messages, a run of bytes at a time. A message which
+ * outgrows its slot is cut short, ending with the delimiter in place of its
+ * last byte, and the byte which didn't fit is dropped.
+ */
 static void msgs_add_delimited(busfs_file f, const char *buf, size_t size)
 {
-    char c;
     busfs_dgram *msg = f->dgrams + (size_t)f->curidx;
 
-    while(size) {
-        c = *(buf);
-
-        buf++;
-        size--;
+    while (size) {
+        const char *nl;
+        size_t n;
 
         if (msg->msgsize >= f->dgram_maxlen) {
-            msg->msgsize = (f->dgram_maxlen-1);
-            c = f->delim;
+            msg->msgsize = f->dgram_maxlen;
+            msg->root[msg->msgsize - 1] = f->delim;
+            buf++;
+            size--;
+            msg = msgs_advance(f);
+            continue;
         }
 
-        msg->root[msg->msgsize++] = c;
+        n = MINIMUM(size, f->dgram_maxlen - msg->msgsize);
+        nl = memchr(buf, f->delim, n);
+        if (nl) {
+            n = nl - buf + 1;
+        }
 
-        if (c == f->delim) {
-            f->serial++;
-            f->curidx++;
-            f->curidx %= f->dgram_count;
-            msg = f->dgrams + f->curidx;
-            msg->serial = f->serial;
-            msg->msgsize = 0;
+        memcpy(msg->root + msg->msgsize, buf, n);
+        msg->msgsize += n;
+        buf += n;
+        size -= n;
+
+        if (nl) {
+            msg = msgs_advance(f);
         }
     }
 }
 
-static int busfs_write_io(busfs_common o,
-                   const char *path,
-                   const char *buf, size_t size, off_t offset)
+/**
+ * Append whole records to a fixed-record topic. Each run of slots up to the
+ * end of the arena is filled with one copy, and then committed. Returns
+ * -EINVAL, writing nothing, unless size is a multiple of the record size.
+ */
+static ssize_t msgs_add_fixed(busfs_file f, const char *buf, size_t size)
 {
-    (void)path;
-    (void)offset;
+    size_t rs = f->record_size;
+    size_t nrecs = size / rs;
+
+    if (size % rs) {
+        LOG_MSG("Rejecting write of %lu bytes, not a multiple of %lu",
+                size, rs);
+        return -EINVAL;
+    }
+
+    while (nrecs) {
+        size_t run = MINIMUM(nrecs, f->dgram_count - f->curidx), ii;
+
+        if (f->exports) {
+            /* Slots are kept for exports as they become the hot slot, so
+             * only that one may be overwritten */
+            run = 1;
+        }
+
+        memcpy(f->arena + f->curidx * rs, buf, run * rs);
+        for (ii = 0; ii < run; ii++) {
+            f->dgrams[f->curidx].msgsize = rs;
+            msgs_advance(f);
+        }
+        buf += run * rs;
+        nrecs -= run;
+    }
+    return size;
+}
+
+/**
+ * Store a complete record in the current slot, growing it if needed, and
+ * commit it.
+ */
+static void msgs_add_record(busfs_file f, const char *buf, size_t size)
+{
+    busfs_dgram *msg = f->dgrams + (size_t)f->curidx;
+
+    if (size > msg->msgalloc ||
+            (msg->msgalloc > f->dgram_maxlen && size <= f->dgram_maxlen)) {
+        /* Grow for a large record, or give back memory from a previous one */
+        size_t newalloc = size > f->dgram_maxlen ? size : f->dgram_maxlen;
+        msg->root = realloc(msg->root, newalloc);
+        msg->msgalloc = newalloc;
+    }
+
+    memcpy(msg->root, buf, size);
+    msg->msgsize = size;
+    msgs_advance(f);
+}
+
+/**
+ * Commit a message received from a replication leader, keeping its serial
+ * and timestamp. If the serial doesn't follow on from the last message, the
+ * ring is emptied and continues from it, and a compacted topic forgets its
+ * keys, whose values may have changed in the gap. Must be called with
+ * buf_rwlock held for writing.
+ */
+void busfs_write_replicated(busfs_file f, uint32_t serial, uint64_t ts,
+                            const char *buf, size_t size)
+{
+    busfs_dgram *msg = f->dgrams + (size_t)f->curidx;
+
+    if (serial != f->serial) {
+        LOG_MSG("%s jumps from serial %u to %u", f->path, f->serial, serial);
+        busfs_file_evict(f, f->serial);
+        f->serial = serial;
+        f->head_serial = serial;
+        msg->serial = serial;
+        msg->msgsize = 0;
+        if (f->latest) {
+            g_hash_table_remove_all(f->latest);
+        }
+    }
+
+    f->pub_ts = ts;
+    msgs_add_record(f, buf, size);
+}
+
+/**
+ * Commit the writes queued for f in one go. Must be called with buf_rwlock
+ * held for writing.
+ */
+void busfs_write_commit_queued(busfs_file f)
+{
+    GString *batch;
+
+    pthread_mutex_lock(&f->sync.pubq_mutex);
+    batch = f->pubq.buf;
+    if (batch->len == 0) {
+        pthread_mutex_unlock(&f->sync.pubq_mutex);
+        return;
+    }
+    f->pubq.buf = f->pubq.spare;
+    pthread_mutex_unlock(&f->sync.pubq_mutex);
+
+    f->pub_ts = busfs_clock_ns();
+    msgs_add_delimited(f, batch->str, batch->len);
+    busfs_file_expire(f, f->pub_ts);
+    f->mtime = BUSFS_CLOCK_TO_TIME(f->pub_ts);
+
+    g_string_truncate(batch, 0);
+    f->pubq.spare = batch;
+}
+
+/**
+ * Commit the writes queued for f now, rather than at the end of the batch
+ * window.
+ */
+void busfs_write_flush(busfs_file f)
+{
+    pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+    busfs_write_commit_queued(f);
+    pthread_rwlock_unlock(&f->sync.buf_rwlock);
+
+    busfs_file_notify(f);
+}
+
+static void *batcher_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&Batcher.mutex);
+    while (1) {
+        uint64_t now = busfs_clock_ns(), next = 0;
+        busfs_file due = NULL;
+        GList *l;
+
+        /* Find a topic whose window has passed, or when the next one will */
+        for (l = Batcher.topics.head; l; l = l->next) {
+            busfs_file f = l->data;
+            uint64_t deadline = now;
+
+            pthread_mutex_lock(&f->sync.pubq_mutex);
+            if (f->pubq.buf->len) {
+                deadline = f->pubq.first_ns + f->pubq.window_ns;
+            }
+            pthread_mutex_unlock(&f->sync.pubq_mutex);
+
+            if (deadline <= now) {
+                due = f;
+                g_queue_delete_link(&Batcher.topics, l);
+                break;
+            }
+            if (next == 0 || deadline < next) {
+                next = deadline;
+            }
+        }
+
+        if (due) {
+            due->pubq.scheduled = 0;
+            pthread_mutex_unlock(&Batcher.mutex);
+
+            busfs_write_flush(due);
+            busfs_file_release(due, BUSFS_INFO_NONE);
+
+            pthread_mutex_lock(&Batcher.mutex);
+
+        } else if (next) {
+            struct timespec timeout;
+            timeout.tv_sec = next / 1000000000;
+            timeout.tv_nsec = next % 1000000000;
+            pthread_cond_timedwait(&Batcher.cond, &Batcher.mutex, &timeout);
+
+        } else {
+            pthread_cond_wait(&Batcher.cond, &Batcher.mutex);
+        }
+    }
+    pthread_mutex_unlock(&Batcher.mutex);
+    return NULL;
+}
+
+static void batcher_start(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thr;
+
+    /* Deadlines are on the same clock as busfs_clock_ns() */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Batcher.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_create(&thr, NULL, batcher_thread, NULL);
+    pthread_detach(thr);
+}
+
+/**
+ * Have the batch thread commit the writes queued for f when its window has
+ * passed. The thread holds a reference on f until then.
+ */
+static void batch_schedule(busfs_file f)
+{
+    pthread_once(&batcher_once, batcher_start);
+
+    pthread_mutex_lock(&Batcher.mutex);
+    if (!f->pubq.scheduled) {
+        f->pubq.scheduled = 1;
+
+        pthread_rwlock_wrlock(&f->sync.refs_rwlock);
+        f->refcount++;
+        pthread_rwlock_unlock(&f->sync.refs_rwlock);
+
+        g_queue_push_tail(&Batcher.topics, f);
+        pthread_cond_signal(&Batcher.cond);
+    }
+    pthread_mutex_unlock(&Batcher.mutex);
+}
+
+/**
+ * Queue a write to a topic with a batch window. The queue is committed
+ * straight away if it has grown too large.
+ */
+static int batch_write(busfs_file f, const char *buf, size_t size)
+{
+    int first, full;
+
+    pthread_mutex_lock(&f->sync.pubq_mutex);
+    first = f->pubq.buf->len == 0;
+    if (first) {
+        f->pubq.first_ns = busfs_clock_ns();
+    }
+    g_string_append_len(f->pubq.buf, buf, size);
+    full = f->pubq.buf->len >= BUSFS_BATCH_MAX_BYTES;
+    pthread_mutex_unlock(&f->sync.pubq_mutex);
+
+    if (full) {
+        busfs_write_flush(f);
+    } else if (first) {
+        batch_schedule(f);
+    }
+    return size;
+}
+
+/**
+ * The write queued by w with the given ticket, if it is the next one in
+ * w's sub-ring. Only the holder of sync.sub_mutex takes writes out of
+ * sub-rings, so the entry stays put until it moves the head.
+ */
+static busfs_subent *sub_peek(busfs_writer w, guint ticket)
+{
+    unsigned head = w->sub_head;
+    busfs_subent *e;
+
+    if (head == __atomic_load_n(&w->sub_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    e = w->sub + head % BUSFS_SUBRING_SLOTS;
+    return (guint)e->ticket == ticket ? e : NULL;
+}
 
+/**
+ * Apply queued writes to the ring in ticket order, stopping at a ticket
+ * which hasn't been queued yet; its writer drains again once it has. Must
+ * be called with sync.sub_mutex, and buf_rwlock held for writing. Returns
+ * the number of writes applied.
+ */
+static unsigned sub_apply(busfs_file f)
+{
+    busfs_writer w = NULL;
+    unsigned applied = 0;
+
+    while (1) {
+        busfs_subent *e = NULL;
+        guint ii;
+
+        /* The writer of the last write is likely to have the next one */
+        if (w == NULL || (e = sub_peek(w, f->sub.next)) == NULL) {
+            for (ii = 0; ii < f->sub.writers->len && e == NULL; ii++) {
+                w = g_ptr_array_index(f->sub.writers, ii);
+                e = sub_peek(w, f->sub.next);
+            }
+        }
+        if (e == NULL) {
+            break;
+        }
+
+        /* Clocks were read without the lock, but must not go backwards */
+        if (e->ts > f->pub_ts) {
+            f->pub_ts = e->ts;
+        }
+        if (f->framing == BUSFS_FRAMING_DELIM) {
+            msgs_add_delimited(f, e->buf, e->len);
+        } else {
+            LOG_MSG("Dropping a write queued before %s was reframed",
+                    f->path);
+        }
+
+        __atomic_store_n(&w->sub_head, w->sub_head + 1, __ATOMIC_RELEASE);
+        f->sub.next++;
+        g_atomic_int_add(&f->sub.pending, -1);
+        applied++;
+    }
+    return applied;
+}
+
+/**
+ * Apply the writes queued in the sub-rings of f. Without wait, this gives
+ * up if another thread is already at it. That thread looks again after
+ * letting go, if anything was queued in the meantime, so no write is left
+ * behind.
+ */
+static void sub_drain(busfs_file f, int wait)
+{
+    gint queued;
+
+    do {
+        unsigned applied;
+
+        if (wait) {
+            pthread_mutex_lock(&f->sync.sub_mutex);
+        } else if (pthread_mutex_trylock(&f->sync.sub_mutex) != 0) {
+            return;
+        }
+        queued = g_atomic_int_get(&f->sub.queued);
+
+        pthread_rwlock_wrlock(&f->sync.buf_rwlock);
+        applied = sub_apply(f);
+        if (applied) {
+            busfs_file_expire(f, f->pub_ts);
+            f->mtime = BUSFS_CLOCK_TO_TIME(f->pub_ts);
+        }
+        pthread_rwlock_unlock(&f->sync.buf_rwlock);
+        pthread_mutex_unlock(&f->sync.sub_mutex);
+
+        if (applied) {
+            busfs_file_notify(f);
+        }
+        wait = 0;
+    } while (queued != g_atomic_int_get(&f->sub.queued));
+}
+
+/**
+ * Make the writes queued by concurrent writers of f visible. Called before
+ * looking at the ring, without holding buf_rwlock, by anything which
+ * should see every write which has returned.
+ */
+void busfs_write_drain(busfs_file f)
+{
+    if (g_atomic_int_get(&f->sub.pending)) {
+        sub_drain(f, 1);
+    }
+}
+
+/**
+ * Queue a write in the writer's own sub-ring, taking no lock shared with
+ * other writers, and then apply the queue unless another thread is at it.
+ * The ticket is taken once the data has been copied, so a drainer is
+ * rarely held up by a ticket whose write isn't there yet.
+ */
+static int sub_write(busfs_writer w, const char *buf, size_t size)
+{
+    busfs_file f = w->f;
+    busfs_subent *e;
+
+    /* Only for threads writing through the same handle */
+    pthread_mutex_lock(&w->sub_mutex);
+
+    while (w->sub_tail - __atomic_load_n(&w->sub_head, __ATOMIC_ACQUIRE) ==
+            BUSFS_SUBRING_SLOTS) {
+        sub_drain(f, 1);
+    }
+
+    e = w->sub + w->sub_tail % BUSFS_SUBRING_SLOTS;
+    if (size > e->alloc) {
+        e->buf = realloc(e->buf, size);
+        e->alloc = size;
+    }
+    memcpy(e->buf, buf, size);
+    e->len = size;
+    e->ts = busfs_clock_ns();
+
+    g_atomic_int_inc(&f->sub.pending);
+    e->ticket = g_atomic_int_add(&f->sub.ticket, 1);
+    __atomic_store_n(&w->sub_tail, w->sub_tail + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&w->sub_mutex);
+
+    g_atomic_int_inc(&f->sub.queued);
+    sub_drain(f, 0);
+    return size;
+}
+
+/**
+ * Whether w may write to the ring directly: it is the only writer, and has
+ * nothing queued which would have to go first.
+ */
+static inline int sub_bypass(busfs_writer w)
+{
+    return BUSFS_STAT_GET(w->f->writer_count) == 1 &&
+            __atomic_load_n(&w->sub_head, __ATOMIC_ACQUIRE) == w->sub_tail;
+}
+
+/**
+ * Pick the partition for a line: a hash of its key, which is everything up
+ * to the first space, as for compacted topics.
+ */
+static uint32_t partition_of(busfs_file f, const char *line, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    size_t ii;
+
+    for (ii = 0; ii < len && line[ii] != ' ' && line[ii] != f->delim; ii++) {
+        hash ^= (uint8_t)line[ii];
+        hash *= 16777619u;
+    }
+    return hash % f->nparts;
+}
+
+/**
+ * Commit whole lines to a partition
+ */
+static void partition_commit(busfs_file part, const char *buf, size_t size)
+{
+    pthread_rwlock_wrlock(&part->sync.buf_rwlock);
+    part->pub_ts = busfs_clock_ns();
+    msgs_add_delimited(part, buf, size);
+    busfs_file_expire(part, part->pub_ts);
+    part->mtime = BUSFS_CLOCK_TO_TIME(part->pub_ts);
+    pthread_rwlock_unlock(&part->sync.buf_rwlock);
+
+    busfs_file_notify(part);
+}
+
+/**
+ * Route each line to the partition for its key. Consecutive lines for the
+ * same partition are committed together. The end of a line which is still
+ * being written is kept in the writer, as its key may not be known yet.
+ */
+static int partition_write(busfs_writer w, const char *buf, size_t size)
+{
+    busfs_file f = w->f;
+    const char *end = buf + size, *run = buf, *nl;
+    uint32_t runpart = 0;
+
+    while (buf < end) {
+        uint32_t part;
+
+        nl = memchr(buf, f->delim, end - buf);
+        if (nl == NULL) {
+            break;
+        }
+        nl++;
+
+        if (w->frame_len) {
+            /* Complete the line left over from the last write */
+            size_t len = nl - buf;
+            if (w->frame_len + len > w->frame_alloc) {
+                w->frame_alloc = w->frame_len + len;
+                w->frame = realloc(w->frame, w->frame_alloc);
+            }
+            memcpy(w->frame + w->frame_len, buf, len);
+            w->frame_len += len;
+
+            part = partition_of(f, w->frame, w->frame_len);
+            partition_commit(f->parts[part], w->frame, w->frame_len);
+            w->frame_len = 0;
+            run = buf = nl;
+            continue;
+        }
+
+        part = partition_of(f, buf, nl - buf);
+        if (buf != run && part != runpart) {
+            partition_commit(f->parts[runpart], run, buf - run);
+            run = buf;
+        }
+        runpart = part;
+        buf = nl;
+    }
+
+    if (buf != run) {
+        partition_commit(f->parts[runpart], run, buf - run);
+    }
+
+    if (buf < end) {
+        size_t len = end - buf;
+        if (w->frame_len + len > w->frame_alloc) {
+            w->frame_alloc = w->frame_len + len;
+            w->frame = realloc(w->frame, w->frame_alloc);
+        }
+        memcpy(w->frame + w->frame_len, buf, len);
+        w->frame_len += len;
+    }
+
+    f->mtime = BUSFS_CLOCK_TO_TIME(busfs_clock_ns());
+    return size;
+}
+
+/**
+ * Decode the length header at the start of a record, returning -1 if the
+ * record is too large.
+ */
+static ssize_t record_length(const char *hdr)
+{
+    uint32_t len;
+    memcpy(&len, hdr, sizeof(len));
+    len = ntohl(len);
+
+    if (len > BUSFS_FRAME_MAXLEN) {
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * Buffer up to size bytes of a partial record. Returns the amount of bytes
+ * consumed. If they complete the header of a record which is too large, the
+ * record is dropped and w->frame_err set to -EMSGSIZE.
+ */
+static ssize_t frame_append(busfs_writer w, const char *buf, size_t size)
+{
+    const size_t hdrlen = sizeof(uint32_t);
+    size_t want = hdrlen;
+    ssize_t reclen;
+
+    if (w->frame_len >= hdrlen) {
+        want += record_length(w->frame);
+    }
+
+    size = MINIMUM(size, want - w->frame_len);
+    if (w->frame_len + size > w->frame_alloc) {
+        w->frame_alloc = w->frame_len + size;
+        w->frame = realloc(w->frame, w->frame_alloc);
+    }
+
+    memcpy(w->frame + w->frame_len, buf, size);
+    w->frame_len += size;
+
+    if (w->frame_len == hdrlen) {
+        reclen = record_length(w->frame);
+        if (reclen < 0) {
+            w->frame_len = 0;
+            w->frame_err = -EMSGSIZE;
+        }
+    }
+    return size;
+}
+
+/**
+ * Add length-prefixed records. Complete records are copied straight from
+ * the caller's buffer; anything left over is kept in the writer until the
+ * next write.
+ *
+ * An oversized record fails the write with -EMSGSIZE, unless the write
+ * used up bytes before getting to it, in which case it returns how many,
+ * and the next write fails. That includes the end of a header split across
+ * writes, which has been taken by the time the record is rejected.
+ */
+static ssize_t msgs_add_framed(busfs_writer w, const char *buf, size_t size)
+{
+    const size_t hdrlen = sizeof(uint32_t);
+    size_t origsize = size;
+    ssize_t reclen, nused;
+
+    if (w->frame_err) {
+        nused = w->frame_err;
+        w->frame_err = 0;
+        return nused;
+    }
+
+    while (size) {
+        if (w->frame_len) {
+            nused = frame_append(w, buf, size);
+            buf += nused;
+            size -= nused;
+            if (w->frame_err) {
+                goto GT_ERR;
+            }
+
+            if (w->frame_len >= hdrlen &&
+                    w->frame_len - hdrlen == record_length(w->frame)) {
+                msgs_add_record(w->f, w->frame + hdrlen, w->frame_len - hdrlen);
+                w->frame_len = 0;
+            }
+            continue;
+        }
+
+        if (size < hdrlen) {
+            nused = frame_append(w, buf, size);
+            buf += nused;
+            size -= nused;
+            continue;
+        }
+
+        reclen = record_length(buf);
+        if (reclen < 0) {
+            goto GT_ERR;
+        }
+
+        if (size - hdrlen < (size_t)reclen) {
+            nused = frame_append(w, buf, size);
+            buf += nused;
+            size -= nused;
+            continue;
+        }
+
+        msgs_add_record(w->f, buf + hdrlen, reclen);
+        buf += hdrlen + reclen;
+        size -= hdrlen + reclen;
+    }
+
+    return origsize;
+
+    GT_ERR:
+    LOG_MSG("Rejecting oversized record");
+    if (size == origsize) {
+        w->frame_err = 0;
+        return -EMSGSIZE;
+    }
+    return origsize - size;
+}
+
+static int write_commit(busfs_writer w, const char *buf, size_t size)
+{
     int res;
-    busfs_file f = (busfs_file)o;
+    ssize_t nwritten = size;
+    uint64_t now;
+    busfs_file f = w->f;
+
+    if (f->nparts) {
+        return partition_write(w, buf, size);
+    }
+
+    if (f->pubq.window_ns && f->framing == BUSFS_FRAMING_DELIM) {
+        return batch_write(f, buf, size);
+    }
+
+    if (f->framing == BUSFS_FRAMING_DELIM && !sub_bypass(w)) {
+        return sub_write(w, buf, size);
+    }
+    /* Writes queued by writers which have just gone come first */
+    busfs_write_drain(f);
+
+    /* Read the clock before taking the lock; timestamps must still never
+     * go backwards, as readers binary search them */
+    now = busfs_clock_ns();
 
     if ( (res = pthread_rwlock_wrlock(&f->sync.buf_rwlock)) != 0) {
         return -res;
     }
 
-    msgs_add_delimited(f, buf, size);
-    pthread_cond_broadcast(&f->sync.iowait_cond);
+    if (now > f->pub_ts) {
+        f->pub_ts = now;
+    }
+
+    if (f->framing == BUSFS_FRAMING_LENGTH) {
+        nwritten = msgs_add_framed(w, buf, size);
+    } else if (f->framing == BUSFS_FRAMING_FIXED) {
+        nwritten = msgs_add_fixed(f, buf, size);
+    } else {
+        msgs_add_delimited(f, buf, size);
+    }
+    busfs_file_expire(f, f->pub_ts);
+    f->mtime = BUSFS_CLOCK_TO_TIME(f->pub_ts);
 
     pthread_rwlock_unlock(&f->sync.buf_rwlock);
 
-    f->mtime = time(NULL);
+    busfs_file_notify(f);
 
-    return size;
+    return nwritten;
 }
 
+static int busfs_write_io(busfs_common o,
+                   const char *path,
+                   const char *buf, size_t size, off_t offset)
+{
+    (void)path;
+    (void)offset;
+
+    int res;
+
+    /* Held back while topics are handed to a new daemon */
+    if ((res = busfs_handoff_enter()) != 0) {
+        return res;
+    }
+    res = write_commit((busfs_writer)o, buf, size);
+    busfs_handoff_leave();
+    return res;
+}
@@ -9,37 +9,133 @@
 #include <stdlib.h>
 #include "busfs.h"
 
-int busfs_op_getattr(const char *path, struct stat *stbuf)
+/**
+ * Give stbuf the size of the replay file or export of f, if path names one.
+ * An open export has the size of its copy.
+ */
+static void view_stat(const char *path, busfs_file f,
+                      struct fuse_file_info *fi, struct stat *stbuf)
+{
+    busfs_common o = fi ? (busfs_common)fi->fh : NULL;
+    struct busfs_openopts_st opts;
+    char topic[FILENAME_MAX];
+
+    if (busfs_opts_parse(path, topic, &opts) != 0) {
+        return;
+    }
+    busfs_opts_clear(&opts);
+
+    if (!opts.replay && !opts.export) {
+        return;
+    }
+    if (opts.has_partition) {
+        if (opts.partition >= f->nparts) {
+            return;
+        }
+        f = f->parts[opts.partition];
+    }
+
+    if (o && o->type == BUSFS_INFO_EXPORT) {
+        stbuf->st_size = ((busfs_export)o)->size;
+    } else if (opts.export) {
+        stbuf->st_size = busfs_export_size(f);
+    } else {
+        stbuf->st_size = busfs_replay_size(f);
+    }
+    stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+}
+
+int busfs_op_getattr(const char *path, struct stat *stbuf,
+                 struct fuse_file_info *fi)
 {
     int res;
+    const char *orig_path = path;
     BUSFS_CONVERT_PATH_EX(path, fqpath);
+    BUSFS_STRIP_OPTS(path);
+    busfs_file f = NULL;
 
-    res = lstat(fqpath, stbuf);
-    if (res == -1) {
-        return -errno;
+    /* Topics keep the attributes of their backing file, so a stat(2) of
+     * a topic doesn't need an lstat() */
+    if (!busfs_opts_is_merge(orig_path)) {
+        f = busfs_file_get(path, BUSFS_GETf_INC);
+    }
+
+    if (f) {
+        res = busfs_file_stat(f, fqpath, stbuf);
+    } else {
+        res = (lstat(fqpath, stbuf) == -1) ? -errno : 0;
+    }
+    if (res != 0) {
+        goto GT_RET;
+    }
+
+    if (busfs_opts_is_merge(orig_path) && S_ISDIR(stbuf->st_mode)) {
+        /* Directory reader */
+        stbuf->st_mode = S_IFREG | (stbuf->st_mode & 0444);
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0;
+        goto GT_RET;
+    }
+
+    if (!S_ISREG(stbuf->st_mode)) {
+        goto GT_RET;
     }
 
-    busfs_file f = busfs_file_get(path, BUSFS_GETf_INC);
     if (f) {
         stbuf->st_mtime = f->mtime;
         stbuf->st_blksize = f->dgram_maxlen;
-        stbuf->st_blocks = f->dgram_count;
+        stbuf->st_blocks = BUSFS_FILE_FILL(f);
         stbuf->st_size = f->dgram_count * f->dgram_maxlen;
-        busfs_file_release(f, BUSFS_INFO_NONE);
+        view_stat(orig_path, f, fi, stbuf);
     } else {
-        return -ENOENT;
+        res = -ENOENT;
     }
 
-    return 0;
+    GT_RET:
+    if (f) {
+        busfs_file_release(f, BUSFS_INFO_NONE);
+    }
+    return res;
 }
 
-int busfs_op_open(const char *path, struct fuse_file_info *fi)
+/**
+ * access(2) on the file backing path, answered from the topic's cache if
+ * path is a topic.
+ */
+static int backing_access(const char *path, const char *fqpath, int mask)
+{
+    int res;
+    BUSFS_STRIP_OPTS(path);
+    busfs_file f = busfs_file_get(path, BUSFS_GETf_INC);
+
+    if (f == NULL) {
+        return (access(fqpath, mask) == -1) ? -errno : 0;
+    }
+
+    res = busfs_file_access(f, fqpath, mask);
+    busfs_file_release(f, BUSFS_INFO_NONE);
+    return res;
+}
+
+int busfs_op_access(const char *path, int mask)
+{
+    BUSFS_CONVERT_PATH_EX(path, fqpath);
+    return backing_access(path, fqpath, mask);
+}
+
+/**
+ * Open path for fi. With reopen, the handle is being rebuilt after a
+ * handover, and settings given in path aren't applied again, as the topic
+ * may have been reconfigured since.
+ */
+static int op_open(const char *path, struct fuse_file_info *fi, int reopen)
 {
     int res;
-    int my_errno;
     BUSFS_CONVERT_PATH_EX(path, fqpath);
 
     busfs_file f;
+    struct busfs_openopts_st opts;
+    char topic[FILENAME_MAX];
 
     int acc_flags = 0;
     int accmode = (fi->flags & O_ACCMODE);
@@ -57,34 +153,136 @@ int busfs_op_open(const char *path, struct fuse_file_info *fi)
     }
 
 
-    LOG_MSG("access(%s,%d)", fqpath, acc_flags);
-    res = access(fqpath, acc_flags);
-    my_errno = errno;
-    LOG_MSG("access() returned %d", res);
+    res = backing_access(path, fqpath, acc_flags);
+    if (res != 0) {
+        LOG_MSG("access(%s,%d) returned %d", fqpath, acc_flags, res);
+        return res;
+    }
 
+    res = busfs_opts_parse(path, topic, &opts);
     if (res != 0) {
-        LOG_MSG("Access returned nonzero");
-        return -my_errno;
+        return res;
+    }
+
+    if (acc_flags == W_OK && busfs_repl_is_replica(topic)) {
+        busfs_opts_clear(&opts);
+        return -EROFS;
+    }
+
+    fi->keep_cache = 0;
+    fi->direct_io = 1;
+
+    if (busfs_opts_is_merge(path)) {
+        busfs_merge m;
+        if (acc_flags != R_OK || opts.status) {
+            busfs_opts_clear(&opts);
+            return (acc_flags != R_OK) ? -EISDIR : -EINVAL;
+        }
+
+        /* The directory reader takes ownership of the options */
+        m = busfs_merge_new(topic, fi, &opts);
+        LOG_MSG("Setting merge=%p", m);
+        BUSFS_SET_FI(m, fi);
+        return 0;
     }
 
     /* Figure out which kind of object we should provide */
 
     LOG_MSG("About to request file object");
-    f = busfs_file_get(path, BUSFS_GETf_INC);
+    f = busfs_file_get(topic, BUSFS_GETf_INC);
     LOG_MSG("Have f=%p", f);
 
     if (!f) {
+        busfs_opts_clear(&opts);
         return -ENOENT;
     }
 
-    fi->keep_cache = 0;
-    fi->direct_io = 1;
+    if (reopen) {
+        opts.configure = 0;
+    }
+    if (opts.configure && (res = busfs_handoff_enter()) == 0) {
+        res = busfs_file_configure(f, &opts);
+        busfs_handoff_leave();
+    }
+    if (res != 0) {
+        busfs_file_release(f, BUSFS_INFO_NONE);
+        busfs_opts_clear(&opts);
+        return res;
+    }
+
+    if (opts.has_partition) {
+        /* Partitions are only read; writes to the topic are routed */
+        busfs_file part = NULL;
+        if (acc_flags == R_OK) {
+            part = busfs_file_partition(f, opts.partition);
+        }
+        if (part == NULL) {
+            busfs_file_release(f, BUSFS_INFO_NONE);
+            busfs_opts_clear(&opts);
+            return -EINVAL;
+        }
+        f = part;
+
+    } else if (f->nparts && acc_flags == R_OK && !opts.status) {
+        busfs_file_release(f, BUSFS_INFO_NONE);
+        busfs_opts_clear(&opts);
+        return -EINVAL;
+    }
+
+    if (opts.replay && !opts.export) {
+        /* Offsets are fixed, so reader options have nothing to act on */
+        busfs_replay rp = NULL;
+        if (acc_flags == R_OK && !opts.status && !opts.rdflags &&
+                !opts.cursor && !opts.prefix && !opts.substr &&
+                !opts.regex && !opts.since_ns && !opts.last_ns) {
+            rp = busfs_replay_new(f, path, fi);
+            BUSFS_SET_FI(rp, fi);
+        }
+        busfs_opts_clear(&opts);
+        if (rp == NULL) {
+            busfs_file_release(f, BUSFS_INFO_NONE);
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (opts.export) {
+        /* A copy of the whole ring, like the replay file */
+        busfs_export ex = NULL;
+        int ok = acc_flags == R_OK && !opts.replay && !opts.status &&
+                !opts.rdflags && !opts.cursor && !opts.prefix &&
+                !opts.substr && !opts.regex && !opts.since_ns &&
+                !opts.last_ns;
+
+        busfs_opts_clear(&opts);
+        if (ok && (ex = busfs_export_new(f)) != NULL) {
+            BUSFS_SET_FI(ex, fi);
+        }
+        busfs_file_release(f, BUSFS_INFO_NONE);
+        if (!ok) {
+            return -EINVAL;
+        }
+        return ex ? 0 : -ENOMEM;
+    }
+
+    if (opts.status) {
+        busfs_status st = NULL;
+        busfs_opts_clear(&opts);
+        if (acc_flags == R_OK) {
+            st = busfs_status_new(f);
+            BUSFS_SET_FI(st, fi);
+        }
+        busfs_file_release(f, BUSFS_INFO_NONE);
+        return st ? 0 : -EACCES;
+    }
 
     if (acc_flags == R_OK) {
-        busfs_reader r = busfs_read_new(f, fi);
+        /* The reader takes ownership of the options */
+        busfs_reader r = busfs_read_new(f, fi, &opts);
         LOG_MSG("Setting reader=%p", r);
         BUSFS_SET_RDR(r, fi);
     } else {
+        busfs_opts_clear(&opts);
         busfs_writer w = busfs_write_new(f, fi);
         LOG_MSG("Setting writer=%p", w);
         BUSFS_SET_WR(w, fi);
@@ -93,22 +291,56 @@ int busfs_op_open(const char *path, struct fuse_file_info *fi)
     return 0;
 }
 
+int busfs_op_open(const char *path, struct fuse_file_info *fi)
+{
+    return op_open(path, fi, 0);
+}
+
+/**
+ * Open path again for a handle taken over from a previous daemon
+ */
+int busfs_op_reopen(const char *path, struct fuse_file_info *fi)
+{
+    return op_open(path, fi, 1);
+}
+
 /* Same behavior as creating the file, and opening for write-only (manpage) */
-int busfs_op_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     BUSFS_CONVERT_PATH_EX(path, fqpath);
     LOG_MSG("Create requested for %s", path);
 
-    int res = creat(fqpath, mode);
+    struct busfs_openopts_st opts;
+    char topic[FILENAME_MAX];
+    int res = busfs_opts_parse(path, topic, &opts);
     busfs_file f;
 
+    if (res != 0) {
+        return res;
+    }
+
+    if (busfs_repl_is_replica(topic)) {
+        busfs_opts_clear(&opts);
+        return -EROFS;
+    }
+
+    res = creat(fqpath, mode);
     if (res == -1) {
         return -errno;
     }
+    close(res);
 
-    f = busfs_file_get(path, BUSFS_GETf_CREATE|BUSFS_GETf_INC);
+    f = busfs_file_get(topic, BUSFS_GETf_CREATE|BUSFS_GETf_INC);
     if (f == NULL) {
+        busfs_opts_clear(&opts);
         return -ENOMEM;
+    }
+
+    res = busfs_file_configure(f, &opts);
+    busfs_opts_clear(&opts);
+    if (res != 0) {
+        busfs_file_release(f, BUSFS_INFO_NONE);
+        return res;
     } else {
         busfs_writer w = busfs_write_new(f, fi);
         BUSFS_SET_WR(w, fi);
@@ -116,6 +348,17 @@ int busfs_op_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     }
 }
 
+int busfs_op_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    int res = busfs_handoff_enter();
+
+    if (res == 0) {
+        res = op_create(path, mode, fi);
+        busfs_handoff_leave();
+    }
+    return res;
+}
+
 int busfs_op_read(const char *path, char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi)
 {
@@ -138,6 +381,24 @@ int busfs_op_write(const char *path, const char *buf, size_t size,
     return o->write_func(o, path, buf, size, offset);
 }
 
+int busfs_op_poll(const char *path, struct fuse_file_info *fi,
+                  struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+    busfs_common o = BUSFS_GET_COMMON(fi);
+    (void)path;
+
+    if (o && o->poll_func) {
+        return o->poll_func(o, ph, reventsp);
+    }
+
+    /* Anything else never blocks */
+    if (ph) {
+        fuse_pollhandle_destroy(ph);
+    }
+    *reventsp |= POLLIN | POLLOUT;
+    return 0;
+}
+
 int busfs_op_release(const char *path, struct fuse_file_info *fi)
 {
     busfs_common o = BUSFS_GET_COMMON(fi);
@@ -148,12 +409,20 @@ int busfs_op_release(const char *path, struct fuse_file_info *fi)
 }
 
 
-int busfs_op_rename(const char *from, const char *to)
+static int op_rename(const char *from, const char *to, unsigned int flags)
 {
     BUSFS_CONVERT_PATH_EX(from, fq_from);
     BUSFS_CONVERT_PATH_EX(to, fq_to);
+    BUSFS_STRIP_OPTS(from);
+    BUSFS_STRIP_OPTS(to);
 
     int ret = 0;
+
+    /* RENAME_EXCHANGE and RENAME_NOREPLACE aren't supported */
+    if (flags) {
+        return -EINVAL;
+    }
+
     ret = rename(fq_from, fq_to);
 
     if (ret != 0) {
@@ -167,10 +436,50 @@ int busfs_op_rename(const char *from, const char *to)
 
     ret = busfs_file_rename(f, to);
     busfs_file_release(f, BUSFS_INFO_NONE);
+    if (ret != 0) {
+        /* Put the backing file back where the topic still is */
+        rename(fq_to, fq_from);
+    }
 
     return ret;
 }
 
+int busfs_op_rename(const char *from, const char *to, unsigned int flags)
+{
+    int res = busfs_handoff_enter();
+
+    if (res == 0) {
+        res = op_rename(from, to, flags);
+        busfs_handoff_leave();
+    }
+    return res;
+}
+
+int busfs_op_truncate(const char *path, off_t size,
+                  struct fuse_file_info *fi)
+{
+    int res;
+    busfs_file f;
+    BUSFS_STRIP_OPTS(path);
+    (void)fi;
+
+    if (busfs_repl_is_replica(path)) {
+        return -EROFS;
+    }
+
+    f = busfs_file_get(path, BUSFS_GETf_INC);
+    if (!f) {
+        return -ENOENT;
+    }
+
+    if ((res = busfs_handoff_enter()) == 0) {
+        res = busfs_file_truncate(f, size);
+        busfs_handoff_leave();
+    }
+    busfs_file_release(f, BUSFS_INFO_NONE);
+    return res;
+}
+
 int busfs_op_link(const char *from, const char *to)
 {
     (void)from;
@@ -178,10 +487,11 @@ int busfs_op_link(const char *from, const char *to)
     return -EINVAL;
 }
 
-int busfs_op_unlink(const char *path)
+static int op_unlink(const char *path)
 {
     int res;
     BUSFS_CONVERT_PATH_EX(path, fqpath);
+    BUSFS_STRIP_OPTS(path);
 
     res = unlink(fqpath);
     if (res != 0) {
@@ -200,3 +510,13 @@ int busfs_op_unlink(const char *path)
     return res;
 }
 
+int busfs_op_unlink(const char *path)
+{
+    int res = busfs_handoff_enter();
+
+    if (res == 0) {
+        res = op_unlink(path);
+        busfs_handoff_leave();
+    }
+    return res;
+}
@@ -5,9 +5,10 @@
   This program can be distributed under the terms of the GNU GPL.
   See the file COPYING.
 
-  gcc -Wall `pkg-config fuse --cflags --libs` fusexmp.c -o fusexmp
+  gcc -Wall `pkg-config fuse3 --cflags --libs` fusexmp.c -o fusexmp
 */
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <string.h>
@@ -19,15 +20,20 @@
 #include <sys/stat.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "busfs.h"
 #include "busfs_fops.h"
 
 
-static void *busfs_fuse_init(struct fuse_conn_info *conn)
+/**
+ * Set up the daemon, once the kernel has answered the mount
+ */
+static void busfs_daemon_init(void)
 {
     struct stat sb;
     int ret;
+    const char *realfs = BusFS_Global.conf.realfs;
 
     busfs_log_output = fopen(BUSFS_LOGFILE, "a+");
     if(busfs_log_output == NULL) {
@@ -38,70 +44,249 @@ static void *busfs_fuse_init(struct fuse_conn_info *conn)
 
 
     LOG_MSG("Initializing...");
-    LOG_MSG("Checking if %s exists", BUSFS_REALFS);
+    LOG_MSG("Checking if %s exists", realfs);
 
     GT_BEGIN:
 
-    ret = stat(BUSFS_REALFS, &sb);
+    ret = stat(realfs, &sb);
     if (ret == -1) {
         LOG_MSG("It doesn't: (stat: %s)", strerror(errno));
-        ret = mkdir(BUSFS_REALFS, 0777);
+        ret = mkdir(realfs, 0777);
         if (ret == -1) {
-            LOG_MSG("Couldn't create %s: %s", BUSFS_REALFS, strerror(errno));
-        } else {
-            return NULL;
+            LOG_MSG("Couldn't create %s: %s", realfs, strerror(errno));
         }
     } else {
         if (S_ISDIR(sb.st_mode) == 0) {
-            unlink(BUSFS_REALFS);
+            unlink(realfs);
             goto GT_BEGIN;
         }
     }
     busfs_init();
-    return NULL;
+    busfs_cursor_init();
+    busfs_handoff_restore();
+    busfs_repl_start();
+    busfs_handoff_start();
 }
 
-static void busfs_fuse_destroy(void *unused)
+/**
+ * Called for INIT on each session, see busfs_loop.c. The daemon itself is
+ * only set up once.
+ */
+static void busfs_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    (void)userdata;
+
+    pthread_once(&once, busfs_daemon_init);
+
+    /* Large writes, and large direct reads, arrive in one request. The
+     * library lowers this if its buffers are smaller */
+    conn->max_write = BusFS_Global.conf.max_write;
+    LOG_MSG("Requested max_write=%u", conn->max_write);
+
+    /* Have O_TRUNC passed to open(), which ignores it, so that writers
+     * opening with '>' don't purge the topic through truncate() */
+    if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC) {
+        conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+    }
+
+    /* Replay files only grow, and what was cached of them stays valid, so
+     * the kernel shouldn't drop its cache when their size or mtime
+     * changes. Nothing else is cached */
+    conn->want &= ~FUSE_CAP_AUTO_INVAL_DATA;
+#ifdef FUSE_CAP_EXPLICIT_INVAL_DATA
+    if (conn->capable & FUSE_CAP_EXPLICIT_INVAL_DATA) {
+        conn->want |= FUSE_CAP_EXPLICIT_INVAL_DATA;
+    }
+#endif
+}
+
+static void busfs_daemon_destroy(void)
 {
     LOG_MSG("Destroying filesystem");
+    busfs_cursor_flush();
 }
 
-static struct fuse_operations busfs_ops = {
-	.getattr	= busfs_op_getattr,
-	.access		= busfs_op_access,
-	.readlink	= busfs_op_readlink,
-	.readdir	= busfs_op_readdir,
-	.mknod		= busfs_op_mknod,
-	.mkdir		= busfs_op_mkdir,
-	.symlink	= busfs_op_symlink,
-	.unlink		= busfs_op_unlink,
-	.rmdir		= busfs_op_rmdir,
-	.rename		= busfs_op_rename,
-	.link		= busfs_op_link,
-	.chmod		= busfs_op_chmod,
-	.chown		= busfs_op_chown,
-	.truncate	= busfs_op_truncate,
-	.utimens	= busfs_op_utimens,
-	.open		= busfs_op_open,
-	.read		= busfs_op_read,
-	.write		= busfs_op_write,
-	.statfs		= busfs_op_statfs,
-	.release	= busfs_op_release,
-	.fsync		= busfs_op_fsync,
-	.create     = busfs_op_create,
+/**
+ * Called as each session is destroyed
+ */
+static void busfs_fuse_destroy(void *unused)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    (void)unused;
+
+    pthread_once(&once, busfs_daemon_destroy);
+}
+
+static struct fuse_lowlevel_ops busfs_ops = {
+	.lookup		= busfs_ll_lookup,
+	.forget		= busfs_ll_forget,
+	.forget_multi	= busfs_ll_forget_multi,
+	.getattr	= busfs_ll_getattr,
+	.setattr	= busfs_ll_setattr,
+	.access		= busfs_ll_access,
+	.readlink	= busfs_ll_readlink,
+	.opendir	= busfs_ll_opendir,
+	.readdir	= busfs_ll_readdir,
+	.releasedir	= busfs_ll_releasedir,
+	.mknod		= busfs_ll_mknod,
+	.mkdir		= busfs_ll_mkdir,
+	.symlink	= busfs_ll_symlink,
+	.unlink		= busfs_ll_unlink,
+	.rmdir		= busfs_ll_rmdir,
+	.rename		= busfs_ll_rename,
+	.link		= busfs_ll_link,
+	.open		= busfs_ll_open,
+	.read		= busfs_ll_read,
+	.write		= busfs_ll_write,
+	.statfs		= busfs_ll_statfs,
+	.release	= busfs_ll_release,
+	.fsync		= busfs_ll_fsync,
+	.poll		= busfs_ll_poll,
+	.create     = busfs_ll_create,
 
 	.init       = busfs_fuse_init,
-	.destroy    = busfs_fuse_destroy
+	.destroy    = busfs_fuse_destroy,
 #ifdef HAVE_SETXATTR
-	.setxattr	= busfs_op_setxattr,
-	.getxattr	= busfs_op_getxattr,
-	.listxattr	= busfs_op_listxattr,
-	.removexattr	= busfs_op_removexattr,
+	.setxattr	= busfs_ll_setxattr,
+	.getxattr	= busfs_ll_getxattr,
+	.listxattr	= busfs_ll_listxattr,
+	.removexattr	= busfs_ll_removexattr,
 #endif
 };
 
+#define BUSFS_FUSE_OPT(templ, field, value) \
+    { templ, offsetof(struct busfs_conf_st, field), value }
+
+static struct fuse_opt busfs_fuse_opts[] = {
+	BUSFS_FUSE_OPT("realfs=%s", realfs, 0),
+	BUSFS_FUSE_OPT("repl_listen=%s", repl_listen, 0),
+	BUSFS_FUSE_OPT("repl_follow=%s", repl_follow, 0),
+	BUSFS_FUSE_OPT("repl_topics=%s", repl_topics, 0),
+	BUSFS_FUSE_OPT("max_write=%u", max_write, 0),
+	BUSFS_FUSE_OPT("noclone_fd", noclone_fd, 1),
+	BUSFS_FUSE_OPT("workers=%u", workers, 0),
+	BUSFS_FUSE_OPT("entry_timeout=%lf", entry_timeout, 0),
+	BUSFS_FUSE_OPT("attr_timeout=%lf", attr_timeout, 0),
+	BUSFS_FUSE_OPT("negative_timeout=%lf", negative_timeout, 0),
+	BUSFS_FUSE_OPT("cursor_file=%s", cursor_file, 0),
+	BUSFS_FUSE_OPT("numa_node=%d", numa_node, 0),
+	BUSFS_FUSE_OPT("numa", numa, 1),
+	BUSFS_FUSE_OPT("handoff=%s", handoff, 0),
+	/* Reads can always be interrupted */
+	FUSE_OPT_KEY("intr", FUSE_OPT_KEY_DISCARD),
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[])
 {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	const int *adopted;
+	char devpath[32];
+	int ret = 1;
+
+	BusFS_Global.conf.realfs = BUSFS_REALFS;
+	BusFS_Global.conf.max_write = BUSFS_MAX_WRITE_DEFAULT;
+	BusFS_Global.conf.numa_node = -1;
+	BusFS_Global.conf.workers = BUSFS_WORKERS_DEFAULT;
+
+	/* Names only change through the daemon, so the kernel may cache
+	 * lookups for a long time. Attributes change on every write, so they
+	 * are only cached briefly */
+	BusFS_Global.conf.entry_timeout = BUSFS_ENTRY_TIMEOUT;
+	BusFS_Global.conf.attr_timeout = BUSFS_ATTR_TIMEOUT;
+	BusFS_Global.conf.negative_timeout = BUSFS_NEGATIVE_TIMEOUT;
+
+	if (fuse_opt_parse(&args, &BusFS_Global.conf, busfs_fuse_opts, NULL) == -1) {
+		return 1;
+	}
+
+	if (BusFS_Global.conf.numa_node != -1 && BusFS_Global.conf.numa) {
+		fprintf(stderr, "numa and numa_node can't be used together\n");
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	/* Threads created later, including the workers, inherit the node */
+	if (BusFS_Global.conf.numa_node != -1 &&
+			busfs_numa_bind(BusFS_Global.conf.numa_node) != 0) {
+		fprintf(stderr, "Couldn't bind to NUMA node %d\n",
+				BusFS_Global.conf.numa_node);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	if (fuse_parse_cmdline(&args, &opts) != 0) {
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	if (opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		ret = 0;
+		goto GT_ARGS;
+	}
+
+	if (opts.show_help || opts.mountpoint == NULL) {
+		printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = !opts.show_help;
+		goto GT_ARGS;
+	}
+
+	if (opts.singlethread) {
+		BusFS_Global.conf.workers = 1;
+	}
+
 	umask(0);
-	return fuse_main(argc, argv, &busfs_ops, NULL);
+
+	/* A daemon already mounted with the same handoff socket passes the
+	 * mount over, with its topics and open files, and exits */
+	if (BusFS_Global.conf.handoff &&
+			busfs_handoff_request(BusFS_Global.conf.handoff) != 0) {
+		fprintf(stderr, "Couldn't take over from the daemon on %s\n",
+				BusFS_Global.conf.handoff);
+		goto GT_ARGS;
+	}
+
+	se = fuse_session_new(&args, &busfs_ops, sizeof(busfs_ops), NULL);
+	if (se == NULL) {
+		goto GT_ARGS;
+	}
+	if (busfs_handoff_adopted(&adopted, NULL, NULL)) {
+		/* The library takes over a /dev/fuse descriptor given this way */
+		snprintf(devpath, sizeof(devpath), "/dev/fd/%d", adopted[0]);
+		if (fuse_session_mount(se, devpath) != 0) {
+			goto GT_DESTROY;
+		}
+	} else if (fuse_session_mount(se, opts.mountpoint) != 0) {
+		goto GT_DESTROY;
+	}
+	if (fuse_daemonize(opts.foreground) != 0) {
+		goto GT_UNMOUNT;
+	}
+
+	ret = busfs_loop_run(se, &busfs_ops, opts.debug);
+	if (busfs_handoff_gone()) {
+		/* The mount is the new daemon's */
+		goto GT_ARGS;
+	}
+
+	GT_UNMOUNT:
+	fuse_session_unmount(se);
+	if (busfs_handoff_adopted(NULL, NULL, NULL)) {
+		busfs_handoff_unmount(opts.mountpoint);
+	}
+
+	GT_DESTROY:
+	fuse_session_destroy(se);
+
+	GT_ARGS:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
 }
@@ -8,9 +8,9 @@ fi
 BUSFS_PID=
 set -e
 
-fusermount -u $MOUNTPOINT || true;
-./busfs -f -o intr -o nonempty -d $MOUNTPOINT & BUSFS_PID=$!
-trap "kill -9 $BUSFS_PID; fusermount -u $MOUNTPOINT" EXIT
+fusermount3 -u $MOUNTPOINT || true;
+./busfs -f -o intr -d $MOUNTPOINT & BUSFS_PID=$!
+trap "kill -9 $BUSFS_PID; fusermount3 -u $MOUNTPOINT" EXIT
 sleep 0.5
 
 
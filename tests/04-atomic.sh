@@ -0,0 +1,10 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+truncate -s 0 $FILE
+echo "first line" > $FILE
+LINE=$(timeout 1 head -c 11 "$FILE@atomic" || true)
+[ "$LINE" = "first line" ]
+rm $FILE
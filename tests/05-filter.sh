@@ -0,0 +1,9 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+printf "INFO hello\nERROR broken\nINFO world\n" > $FILE
+LINE=$(timeout 1 head -n 1 "$FILE@prefix=ERROR" || true)
+[ "$LINE" = "ERROR broken" ]
+rm $FILE
@@ -0,0 +1,12 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+printf "old\n" > $FILE
+truncate -s 0 $FILE
+printf "b\n" > $FILE
+printf "c\n" > $FILE
+LINES=$(timeout 1 head -n 2 $FILE | tr '\n' ' ' || true)
+[ "$LINES" = "b c " ]
+rm $FILE
@@ -0,0 +1,29 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+# Cursors are saved across runs, so each run uses its own
+C=t$$
+
+touch $FILE
+printf "a\nb\n" > $FILE
+A=$(timeout 1 dd if="$FILE@cursor=$C" bs=2 count=1 2>/dev/null)
+B=$(timeout 1 dd if="$FILE@cursor=$C" bs=2 count=1 2>/dev/null)
+[ "$A" = "a" ] && [ "$B" = "b" ]
+grep -q "^cursor $C 258 0$" "$FILE@status"
+
+exec 3<"$FILE@cursor=u$$"
+grep -q "^reader [0-9]* 256 2 0 0 u$$$" "$FILE@status"
+exec 3<&-
+
+# A cursor follows its topic when it is renamed
+printf "c\n" > $FILE
+mv $FILE $FILE.moved
+[ "$(timeout 1 dd if="$FILE.moved@cursor=$C" bs=2 count=1 2>/dev/null)" = "c" ]
+
+# and goes with it when it is unlinked, so it doesn't skip into a new topic
+# of the same name
+rm $FILE.moved
+touch $FILE
+printf "d\ne\nf\ng\n" > $FILE
+[ "$(timeout 1 dd if="$FILE@cursor=$C" bs=2 count=1 2>/dev/null)" = "d" ]
+rm $FILE
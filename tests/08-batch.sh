@@ -0,0 +1,9 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch "$FILE@batch_us=1000000"
+for i in 1 2 3; do echo $i; done > $FILE
+LINES=$(timeout 1 head -n 3 $FILE | tr '\n' ' ' || true)
+[ "$LINES" = "1 2 3 " ]
+rm $FILE
@@ -0,0 +1,11 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch "$FILE@partitions=2"
+printf "a 1\nb 1\na 2\nb 2\n" > $FILE
+P0=$(timeout 1 dd if="$FILE@partition=0" bs=4096 count=1 2>/dev/null)
+P1=$(timeout 1 dd if="$FILE@partition=1" bs=4096 count=1 2>/dev/null)
+[ "$(printf "%s\n%s\n" "$P0" "$P1" | grep '^a' | tr '\n' ' ')" = "a 1 a 2 " ]
+[ "$(printf "%s\n%s\n" "$P0" "$P1" | grep -c .)" = "4" ]
+rm $FILE
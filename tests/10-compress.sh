@@ -0,0 +1,11 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch "$FILE@slots=4096,compress"
+seq 1 3000 | sed 's/$/ level=info service=api status=200/' > $FILE
+sleep 2
+grep -q '^compressed [1-9]' "$FILE@status"
+[ "$(timeout 1 cat "$FILE@atomic" | md5sum)" = \
+  "$(seq 1 3000 | sed 's/$/ level=info service=api status=200/' | md5sum)" ]
+rm $FILE
@@ -0,0 +1,11 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+# Wrap the ring, so that lines 1 to 953 have left it
+touch "$FILE@slots=2048"
+seq 1 3000 > $FILE
+[ "$(stat -c %s "$FILE@replay")" = "12288" ]
+[ "$(cat "$FILE@replay" | md5sum)" = "$( (head -c 3704 /dev/zero; seq 954 3000) | head -c 12288 | md5sum)" ]
+[ "$(tail -c 5 "$FILE@replay")" = "$(seq 1 3000 | head -c 12288 | tail -c 5)" ]
+rm $FILE
@@ -0,0 +1,9 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+seq 1 10 > $FILE
+[ "$(timeout 1 dd if="$FILE@sample=3" bs=4096 count=1 2>/dev/null | tr '\n' ' ')" = "1 4 7 10 " ]
+[ "$(timeout 1 dd if="$FILE@latest" bs=4096 count=1 2>/dev/null)" = "10" ]
+rm $FILE
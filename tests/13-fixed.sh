@@ -0,0 +1,11 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch "$FILE@record_size=4"
+# One write of a record and a bit, which stdio would split into records
+if printf 'abcde' | dd of=$FILE bs=5 2>/dev/null; then exit 1; fi
+printf 'abcdefghijkl' > $FILE
+[ "$(timeout 1 dd if=$FILE bs=4096 count=1 2>/dev/null)" = "abcdefghijkl" ]
+[ "$(timeout 1 dd if="$FILE@atomic" bs=6 count=1 2>/dev/null)" = "abcd" ]
+rm $FILE
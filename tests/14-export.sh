@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+seq 1 500 > $FILE
+[ "$(stat -c %s "$FILE@export")" = "$(seq 1 500 | wc -c)" ]
+[ "$(cat "$FILE@export" | md5sum)" = "$(seq 1 500 | md5sum)" ]
+exec 3< "$FILE@export"
+seq 501 510 > $FILE
+[ "$(cat <&3 | md5sum)" = "$(seq 1 500 | md5sum)" ]
+exec 3<&-
+rm $FILE
@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch "$FILE@framing=length"
+# A length split across writes is put back together
+{ printf '\0\0'; printf '\0\5hello'; } > $FILE
+[ "$(timeout 1 dd if=$FILE bs=4096 count=1 2>/dev/null | od -An -c | tr -d ' \n')" = '\0\0\0005hello' ]
+# An oversized one is taken by the write which completes it, and the next
+# write fails
+if { printf '\0\0\0\1a\177'; printf '\377\377\377'; printf 'body'; } > $FILE; then exit 1; fi
+[ "$(timeout 1 dd if=$FILE bs=4096 count=1 2>/dev/null | od -An -c | tr -d ' \n')" = '\0\0\0005hello\0\0\0001a' ]
+rm $FILE
@@ -0,0 +1,20 @@
+#!/bin/bash
+set -e
+DIR=$1/$2.d
+
+mkdir $DIR
+touch "$DIR/plain" "$DIR/keyed@compact" "$DIR/parts@partitions=2"
+echo one > $DIR/plain
+printf 'a 1\na 2\nb 1\n' > $DIR/keyed
+printf 'x 1\ny 1\n' > $DIR/parts
+# Compacted topics start with their snapshot, and every partition is read
+exec 3<"$DIR/@"
+[ "$(timeout 1 cat <&3 | sort)" = "$(printf 'keyed\ta 2\nkeyed\tb 1\nparts\tx 1\nparts\ty 1\nplain\tone')" ]
+# A topic renamed out of the directory is no longer followed
+mv $DIR/plain $1/$2.moved
+echo two > $1/$2.moved
+echo 'c 3' > $DIR/keyed
+[ "$(timeout 1 cat <&3)" = "$(printf 'keyed\tc 3')" ]
+exec 3<&-
+rm $1/$2.moved $DIR/keyed $DIR/parts
+rmdir $DIR
@@ -0,0 +1,25 @@
+#!/bin/bash
+set -e
+# Runs its own leader and follower, next to the daemon under test
+TMP=$(mktemp -d)
+mkdir $TMP/a $TMP/b $TMP/ra $TMP/rb
+./busfs -f -o realfs=$TMP/ra,repl_listen=unix:$TMP/sock $TMP/a & LEADER=$!
+sleep 0.5
+./busfs -f -o realfs=$TMP/rb,repl_follow=unix:$TMP/sock $TMP/b & FOLLOWER=$!
+trap "kill -9 $LEADER $FOLLOWER; fusermount3 -u $TMP/a; fusermount3 -u $TMP/b; rm -rf $TMP" EXIT
+sleep 0.5
+
+echo one > $TMP/a/t
+for i in $(seq 20); do [ -e $TMP/b/t ] && break; sleep 0.1; done
+exec 3<$TMP/b/t
+[ "$(timeout 2 head -n 1 <&3)" = "one" ]
+# A blocked reader on the follower is woken by the leader's writes
+(sleep 0.2; echo two > $TMP/a/t) &
+[ "$(timeout 2 head -n 1 <&3)" = "two" ]
+# The leader's topic is emptied and changed to fixed records, so the
+# replica is rebuilt under its open reader
+truncate -s 0 $TMP/a/t
+touch "$TMP/a/t@record_size=4"
+printf 'abcdefgh' > $TMP/a/t
+[ "$(timeout 2 head -c 8 <&3)" = "abcdefgh" ]
+exec 3<&-
@@ -0,0 +1,17 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+# Concurrent writers each keep their own order, and no line is lost. All
+# of them fit in the default ring
+for w in 1 2 3 4; do
+    (for i in $(seq 250); do echo "w$w $i"; done > $FILE) &
+done
+wait
+OUT=$(timeout 1 cat $FILE || true)
+[ "$(echo "$OUT" | wc -l)" = 1000 ]
+for w in 1 2 3 4; do
+    [ "$(echo "$OUT" | grep "^w$w " | cut -d' ' -f2)" = "$(seq 250)" ]
+done
+rm $FILE
@@ -0,0 +1,23 @@
+#!/bin/bash
+set -e
+# Runs its own daemon with two workers, next to the daemon under test
+TMP=$(mktemp -d)
+mkdir $TMP/m $TMP/r
+./busfs -f -o realfs=$TMP/r,workers=2 $TMP/m & BUSFS=$!
+trap "kill -9 $BUSFS; fusermount3 -u $TMP/m; rm -rf $TMP" EXIT
+sleep 0.5
+
+touch $TMP/m/t
+# More readers wait for messages than there are workers
+PIDS=
+for i in $(seq 5); do
+    timeout 5 head -n 1 $TMP/m/t > $TMP/out$i & PIDS="$PIDS $!"
+done
+sleep 0.5
+# Other requests are still answered, and a waiting read can be interrupted
+timeout 2 ls $TMP/m > /dev/null
+timeout 2 stat $TMP/m/t > /dev/null
+timeout 0.5 cat $TMP/m/t || [ $? = 124 ]
+echo hello > $TMP/m/t
+for pid in $PIDS; do wait $pid; done
+for i in $(seq 5); do [ "$(cat $TMP/out$i)" = "hello" ]; done
@@ -0,0 +1,39 @@
+#!/bin/bash
+set -e
+# Runs its own daemon, and hands its mount over to a second one
+TMP=$(mktemp -d)
+mkdir $TMP/m $TMP/r
+OPTS=realfs=$TMP/r,handoff=$TMP/sock
+./busfs -f -o $OPTS $TMP/m & A=$!
+B=
+trap 'kill -9 $A $B 2>/dev/null; fusermount3 -u $TMP/m; rm -rf $TMP' EXIT
+sleep 0.5
+
+# Only the daemon's user may take over
+[ "$(stat -c %a $TMP/sock)" = "600" ]
+
+touch $TMP/m/t
+printf "1\n2\n3\n" > $TMP/m/t
+TAIL=$(grep "^tail " $TMP/m/t@status)
+
+# An open reader, a cursor, and a read waiting for the next message
+exec 3<$TMP/m/t
+[ "$(dd bs=2 count=1 status=none <&3)" = "1" ]
+[ "$(dd if=$TMP/m/t@cursor=c bs=2 count=1 status=none)" = "1" ]
+exec 4<$TMP/m/t
+[ "$(dd bs=6 count=1 status=none <&4)" = "$(printf "1\n2\n3")" ]
+timeout 10 dd bs=2 count=1 status=none <&4 > $TMP/out & READ=$!
+sleep 0.5
+
+./busfs -f -o $OPTS $TMP/m & B=$!
+wait $A
+sleep 0.5
+
+# Serials carry on, and every reader continues where it was
+[ "$(grep "^tail " $TMP/m/t@status)" = "$TAIL" ]
+echo 4 > $TMP/m/t
+wait $READ
+[ "$(cat $TMP/out)" = "4" ]
+[ "$(dd bs=2 count=1 status=none <&3)" = "2" ]
+[ "$(dd if=$TMP/m/t@cursor=c bs=2 count=1 status=none)" = "2" ]
+exec 3<&- 4<&-
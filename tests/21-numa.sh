@@ -0,0 +1,25 @@
+#!/bin/bash
+set -e
+# Runs its own daemon, with its workers spread over the NUMA nodes
+TMP=$(mktemp -d)
+mkdir $TMP/m $TMP/r
+! ./busfs -f -o realfs=$TMP/r,numa,numa_node=0 $TMP/m 2> /dev/null
+./busfs -f -o realfs=$TMP/r,numa,workers=4 $TMP/m & BUSFS=$!
+trap 'kill -9 $BUSFS; fusermount3 -u $TMP/m; rm -rf $TMP' EXIT
+sleep 0.5
+
+# The first writer places the topic on its node, and reads and writes are
+# served by the workers there
+touch $TMP/m/t
+! grep -q "^node" $TMP/m/t@status
+timeout 5 head -n 2 $TMP/m/t > $TMP/out & READ=$!
+sleep 0.2
+printf "hello\nworld\n" > $TMP/m/t
+wait $READ
+[ "$(cat $TMP/out)" = "$(printf "hello\nworld")" ]
+grep -q "^node [0-9]*$" $TMP/m/t@status
+
+# Or is given a node while empty
+touch $TMP/m/u@numa=0
+grep -q "^node 0$" $TMP/m/u@status
+! touch $TMP/m/v@numa=1023 2> /dev/null
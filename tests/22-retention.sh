@@ -0,0 +1,25 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+# Three bursts, a second apart
+touch "$FILE@retention_ms=3000"
+seq 1 100 > $FILE
+sleep 1
+T=$(date +%s.%N)
+seq 101 200 > $FILE
+sleep 1
+seq 201 300 > $FILE
+
+# since= and last= find the first message of a burst
+[ "$(head -n 1 "$FILE@since=$T")" = "101" ]
+[ "$(head -n 1 "$FILE@last=0.5")" = "201" ]
+[ "$(head -n 1 $FILE)" = "1" ]
+
+# Without further writes, the first burst expires under a reader which is
+# already open
+exec 3< $FILE
+sleep 1.5
+[ "$(head -n 1 <&3)" = "101" ]
+exec 3<&-
+rm $FILE
@@ -0,0 +1,31 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+OUT=$(mktemp)
+trap "rm -f $OUT" EXIT
+
+# A single read(2) waits for the third message, and returns all three
+touch $FILE
+dd if="$FILE@min_msgs=3,linger_ms=5000" bs=4096 count=1 status=none > $OUT & DD=$!
+sleep 0.3
+echo one > $FILE
+echo two > $FILE
+sleep 0.3
+kill -0 $DD
+echo three > $FILE
+wait $DD
+[ "$(cat $OUT)" = "$(printf 'one\ntwo\nthree')" ]
+rm $FILE
+
+# Short of min_bytes, it returns what there is once linger_ms has passed
+touch $FILE
+START=$(date +%s%N)
+dd if="$FILE@min_bytes=100,linger_ms=1000" bs=4096 count=1 status=none > $OUT & DD=$!
+sleep 0.3
+echo four > $FILE
+sleep 0.3
+kill -0 $DD
+wait $DD
+[ $(( ($(date +%s%N) - START) / 1000000 )) -ge 1000 ]
+[ "$(cat $OUT)" = "four" ]
+rm $FILE
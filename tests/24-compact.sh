@@ -0,0 +1,18 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+OUT=$(mktemp)
+trap "rm -f $OUT" EXIT
+
+# 'b' is forgotten by the message holding only its key
+touch "$FILE@compact"
+printf 'a 1\nb 1\na 2\nc 1\nb\n' > $FILE
+
+# A late reader gets the latest message for each key, then the live tail
+(sleep 0.5; echo "c 2" > $FILE) &
+timeout 1 cat $FILE > $OUT || [ $? = 124 ]
+[ "$(cat $OUT)" = "$(printf 'a 2\nc 1\nc 2')" ]
+
+# Without the snapshot it reads the ring as written
+[ "$(head -n 6 "$FILE@nosnapshot")" = "$(printf 'a 1\nb 1\na 2\nc 1\nb\nc 2')" ]
+rm $FILE
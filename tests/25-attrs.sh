@@ -0,0 +1,27 @@
+#!/bin/bash
+set -e
+FILE=$1/$2
+
+touch $FILE
+echo hello > $FILE
+[ "$(stat -c %a $FILE)" = "644" ]
+[ ! -x $FILE ]
+
+# A chmod drops the daemon's cached attributes and access results. Wait
+# out the kernel's attribute cache, so that the daemon is asked again
+chmod 755 $FILE
+sleep 1.1
+[ "$(stat -c %a $FILE)" = "755" ]
+[ -x $FILE ]
+chmod 644 $FILE
+sleep 1.1
+[ "$(stat -c %a $FILE)" = "644" ]
+[ ! -x $FILE ]
+
+# So does a rename, which changes the ctime
+T=$(date +%s)
+mv $FILE $FILE.2
+sleep 1.1
+[ "$(stat -c %Z $FILE.2)" -ge "$T" ]
+[ ! -x $FILE.2 ]
+rm $FILE.2